@@ -20,6 +20,9 @@
 // OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 //
 
+#ifndef _WIN32
+	#define _FILE_OFFSET_BITS	64		// 64-bit off_t for fseeko on 32-bit builds (traj.bin)
+#endif
 #include <time.h>
 #include "main.h"					// window system
 #include "timex.h"				// for accurate timing
@@ -35,6 +38,31 @@
 #include <iostream>
 #include <vector>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <set>
+#include <memory>
+#include <unordered_map>
+#include <sys/stat.h>
+#include <fcntl.h>
+#ifdef _WIN32
+	#include <io.h>
+	#include <direct.h>
+	#include <process.h>
+	#ifndef NOMINMAX
+		#define NOMINMAX
+	#endif
+	#include <windows.h>		// MoveFileEx
+#else
+	#include <dirent.h>
+	#include <unistd.h>
+	#include <sys/mman.h>
+#endif
 
 using namespace std;
 
@@ -87,6 +115,185 @@ struct graph_t {
 #define GRAPH_ACCEL		3
 #define GRAPH_MAX		4
 
+// Trace spans
+// ring of completed spans, dumped as Chrome trace JSON (chrome://tracing, ui.perfetto.dev)
+#define TRACE_MAX		65536
+#define TRACE_DEPTH		32
+struct trace_t {
+	const char*	name;
+	int			tid;
+	xlong		start, end;		// nanosec
+};
+
+// Worker pool (ParallelFor)
+// threads persist across calls, woken per call by a generation count. the caller runs chunk 0.
+struct pool_t {
+	std::vector<std::thread>	workers;			// worker t runs chunk t+1
+	std::mutex					lock;
+	std::condition_variable		wake, done;
+	std::function<void(int, int, int)>* fn;
+	int			n, nt;							// current call
+	int			gen, left;						// call generation, workers still running
+	bool		quit;
+
+	pool_t () : fn(0), n(0), nt(0), gen(0), left(0), quit(false)	{}
+	~pool_t ()	{ Stop(); }
+	void Stop () {
+		{ std::lock_guard<std::mutex> lk ( lock ); quit = true; }
+		wake.notify_all ();
+		for (auto& th : workers) th.join();
+		workers.clear();
+		quit = false;
+	}
+};
+static thread_local bool t_in_pool = false;		// nested ParallelFor runs serially
+
+// Neighbor query (CPU)
+// state of one bird's topological search, see FindNeighborsBird
+#define NBR_MAX			16
+#define NBR_HYST		0.1f			// temporal: band around boundary_cnt where r_nbrs is not carried
+#define NBR_GRID		0				// neighbor backends (nbr_backend)
+#define NBR_WALK		1
+#define NBR_KDTREE		2
+#define NBR_HGRID		3
+struct nbr_query_t {
+	Vec3F		pos, dir;				// bird position & heading
+	float		sort_d[ NBR_MAX+1 ];	// topological neighbors, sorted by squared distance
+	int			sort_j[ NBR_MAX+1 ];
+	int			sort_num, kmax;
+	float		r_nbrs;					// neighbors within radius & field-of-view
+	uint*		cl_nbrs;				// cluster neighbors (optional)
+	uint		cl_cnt;
+	std::vector<int> cl_more;			// cluster neighbors past CLUSTER_NBRS_MAX_ARRAY, see SetNeighbors
+	int			ncand, nfov, nins;		// search cost
+};
+// clustering (CPU). see AssignClustersCells & BuildDendrogram
+#define CLUSTER_DENSE_MAX	(1 << 24)		// max cluster grid cells stored densely
+struct dendro_link_t {
+	float		d;						// link length
+	int			i, j;					// birds joined
+};
+
+// trajectory file, traj.bin (see OutputTrajectory)
+// per frame: traj_frame_t, ncell traj_cell_t (occupied cells, ascending), num traj_rec_t in cell order
+struct traj_rec_t {
+	int			id;						// bird
+	Vec3F		pos, vel;
+};
+struct traj_cell_t {
+	uint		cell;					// grid cell. GRID_UNDEF for birds outside the grid, last
+	uint		start;					// first record
+};
+struct traj_frame_t {
+	char		magic[4];				// "FTRJ"
+	int			frame;
+	float		time;
+	int			num;					// records
+	int			ncell;					// index entries
+	Vec3F		gridMin, gridDelta;		// cell of pos is int( (pos - gridMin) * gridDelta ) per axis
+	Vec3I		gridRes;
+	xlong		next;					// bytes from this header to the next
+};
+#ifdef _WIN32
+	#define fseek64		_fseeki64			// offsets past 2 GB
+#else
+	#define fseek64		fseeko
+#endif
+
+// out-of-core state file (CPU). see RunOOC
+// records are Birds up to cluster_nbrs, in runs sorted by row (a y slab one neighbor radius high)
+struct ooc_file_t {
+	std::string	path;
+	int			fd;
+	char*		map;
+	size_t		size;					// mapped bytes
+	ooc_file_t () : fd(-1), map(0), size(0)	{}
+};
+
+// k-d tree node (CPU)
+// implicit layout, children of node n at 2n+1 and 2n+2. see KdBuild
+#define KD_LEAF			8
+#define KD_DEPTH_MAX	32				// int bird counts. a depth-first traversal stacks at most depth+1 nodes
+struct kdnode_t {
+	Vec3F		bmin, bmax;				// bounds of the birds below
+	int			start, end;				// range in m_kd_idx. end < start = unused
+	int			axis;					// split axis, -1 = leaf
+};
+
+// hierarchical grid (CPU)
+// a dense accel grid cell is subdivided into hgrid_sub^3 sub-cells, recursively. see HGridBuild
+#define HGRID_SUB_MAX		4
+#define HGRID_LEVELS_MAX	3
+#define HGRID_STACK_MAX		(64 + (HGRID_LEVELS_MAX-1)*HGRID_SUB_MAX*HGRID_SUB_MAX*HGRID_SUB_MAX)	// depth-first: adjacent cells (<= 64), plus sub^3 children per level below
+struct hgnode_t {
+	int			start, cnt;				// range in hgsub_t idx & pos
+	int			child;					// first of hgrid_sub^3 children, -1 = leaf
+};
+struct hgsub_t {
+	Vec3F		bmin, w;				// cell min & width
+	std::vector<hgnode_t>	node;		// node 0 = the dense cell
+	std::vector<int>		idx;		// bird index, in sub-cell order
+	std::vector<Vec3F>		pos;		// bird position, in sub-cell order
+	std::vector<int>		tmp_idx;	// counting sort scratch
+	std::vector<Vec3F>		tmp_pos;
+	std::vector<uchar>		scell;
+};
+
+// independent island of birds, with its own compact grid (CPU). see BuildIslands
+struct island_t {
+	Vec3F		bmin;					// grid min
+	Vec3I		res;					// grid res
+	float		w;						// cell width
+	std::vector<int>	start;			// per cell, first bird. res.x*res.y*res.z + 1
+	std::vector<int>	idx;			// bird index, in cell order
+	std::vector<Vec3F>	pos;			// bird position, in cell order
+	std::vector<int>	cell;			// bird cell, in cell order
+};
+
+// previous query of a bird (temporal coherence, see FindNeighbors)
+struct nbr_prev_t {
+	float		kdist;					// distance to k-th neighbor. 0 = unknown
+	int			r_full;					// r_nbrs of last full radius query
+	int			r_frame;				// frame of last full radius query
+};
+
+// past state of a bird, quantized, for perception delay (CPU). see DelayRecord
+struct delay_state_t {
+	short		pos[3];					// from the frame origin, in pos_scale units
+	short		vel[3];					// in vel_scale units
+};
+struct delay_frame_t {
+	Vec3F		origin;
+	float		pos_scale, vel_scale;
+};
+
+// quantize one bird into a ring slot
+static void DelayQuantize ( const delay_frame_t& f, Bird* b, delay_state_t& d )
+{
+	Vec3F p(0,0,0), v(0,0,0);
+	if ( std::isfinite( b->pos.x + b->pos.y + b->pos.z + b->vel.x + b->vel.y + b->vel.z ) ) {
+		p = (b->pos - f.origin) * (1.0f / f.pos_scale);
+		v = b->vel * (1.0f / f.vel_scale);
+	}
+	d.pos[0] = short( std::max( -32767.0f, std::min( 32767.0f, roundf(p.x) ) ) );
+	d.pos[1] = short( std::max( -32767.0f, std::min( 32767.0f, roundf(p.y) ) ) );
+	d.pos[2] = short( std::max( -32767.0f, std::min( 32767.0f, roundf(p.z) ) ) );
+	d.vel[0] = short( std::max( -32767.0f, std::min( 32767.0f, roundf(v.x) ) ) );
+	d.vel[1] = short( std::max( -32767.0f, std::min( 32767.0f, roundf(v.y) ) ) );
+	d.vel[2] = short( std::max( -32767.0f, std::min( 32767.0f, roundf(v.z) ) ) );
+}
+
+// spectral analysis of one flock (stable cluster), see OutputFFTW
+struct flock_spec_t {
+	int					birds;				// birds in the flock, last sample
+	int					frames;				// spectra accumulated
+	std::vector<double>	fmag;				// freq magnitudes, current sample
+	std::vector<float>	energy;				// spectral energy per plot column
+	float				grp[4];				// frequency group energy, summed over spectra
+	int					peak_cnt;
+	float				peak_ave, peak_max;
+};
+
 // FFTW Analysis
 #ifdef USE_FFTW
 	#include <fftw3.3/fftw3.h>
@@ -126,23 +333,77 @@ public:
 	virtual void shutdown();
 
 	// Simulation
-	Bird*			AddBird ( Vec3F pos, Vec3F vel, Vec3F target, float power );
+	Bird*			AddBird ( Vec3F pos, Vec3F vel, Vec3F target, float power, int ndx=-1 );
+	int				SpawnBird ( Vec3F pos, Vec3F vel, Vec3F target, float power );
+	bool			DespawnBird ( int i );
+	void			UpdatePopulation ();
+	void			CompactPopulation ();
 	void			DefaultParams();
 	void			SetupParams();
 	bool			SetParam(std::string name, float val, Vec3F vec);
 	void			LoadScene(std::string fname);
 	void			Reset (int num_bird, int num_pred);
 	void			Run ();
+	void			ResetOOC ( int num );
+	void			RunOOC ();
+	bool			OOCMap ( ooc_file_t& f, size_t bytes );
+	void			OOCUnmap ( ooc_file_t& f );
+	void			OOCAdvise ( ooc_file_t& f, xlong r0, xlong r1, int advice );
+	void			OOCReserve ( int num );
+	int				OOCRow ( float y );
 	void			FindNeighbors ();
+	void			FindNeighborsBird ( int i, nbr_query_t& q, bool approx, bool clusters, float rq2=0 );
+	void			FindNeighborsWalk ( int i, nbr_query_t& q );
+	bool			NbrLogFrame ();
+	void			FindClusterNbrs ( int i, nbr_query_t& q );
+	void			FindNeighborsKd ( int i, nbr_query_t& q, bool clusters, float rq2=0 );
+	void			FindNeighborsHGrid ( int i, nbr_query_t& q, bool clusters, float rq2=0 );
+	void			FindNeighborsIsland ( island_t& is, int k, nbr_query_t& q );
+	void			FindNeighborsIslands ();
+	void			BuildIslands ( float reach );
+	void			SetNeighbors ( int i, nbr_query_t& q );
+	void			DelayRecord ();
+	void			FindNeighborsQuery ( int i, nbr_query_t& q, bool approx, bool clusters, float rq2=0 );
+	void			BenchmarkNeighbors ();
 	void 			AssignClusters ();
 	void 			CalculateClusters ();
+	void			AssignClustersCells ();
+	template<class F> void ForNearPairs ( float rmax, F fn );
+	void			BuildDendrogram ();
+	int				DendrogramClusters ( float thresh, std::vector<int>& label );
+	void			DendrogramReport ();
 	void			AdvanceOrientationHoetzlein ();
 	void			AdvanceVectorsReynolds ();
 	void			UpdateFlockData ();
+	FILE*			OpenAnalysisFile ( FILE*& fp, const char* name, const char* mode, int& enable, std::function<void(FILE*)> header = 0 );
 	void			OutputPlot ( int what, int frame );
+	void			UpdateStableFlocks ();
+	void			LagAnalysis ();
+	void			PairCorrelation ();
+	void			NeighborAnisotropy ();
+	void			HealthRecover ();
+	void			FlockPeaks ( flock_spec_t& fs, int xf );
 	void			OutputPointCloudFiles (int frame);
+	void			OutputTrajectory ();
+	int				TrajectoryQuery ( std::string fname, int frame, Vec3F bmin, Vec3F bmax, std::vector<traj_rec_t>& out );
+	void			TrajectoryRead ();
 	void			OutputFFTW ( int frame );
 	void			StartNextRun ();
+	void			RunQueue ();
+	bool			QueueRunJob ( std::string name, ParamMap_t& defaults, std::vector<char>& values, Params& params, int seed );
+	void			QueueFail ( std::string name, std::string why );
+	bool			QueueClaim ( std::string name );
+	bool			QueueRenew ( std::string name );
+	bool			QueueStale ( std::string name );
+	bool			QueueTake ( std::string name, std::string owner );
+	std::string		QueueOwner ( std::string name );
+	void			Autotune ( const Mersenne& rnd0 );
+
+	// Tracing
+	void			TracePush ( const char* name );
+	void			TracePop ();
+	void			TraceStart ();
+	void			OutputTrace ( std::string fname );
 
 	// Predators
 	Predator*		AddPredator(Vec3F pos, Vec3F vel, Vec3F target, float power);
@@ -169,9 +430,23 @@ public:
 
 	// Acceleration
 	void			InitializeGrid ();
+	void			UpdateGridBounds ();
+	void			ResizeGrid ( Vec3F lo, Vec3F hi, const char* why );
 	void			InsertIntoGrid ();
 	void			PrefixSumGrid ();
 	void			DrawAccelGrid ();
+	void			ResetCellStats ();
+	void			OutputCellStats ( std::string fname );
+	void			KdBuild ();
+	bool			KdSplit ( int n );
+	void			KdBuildNode ( int n );
+	void			KdRefit ();
+	void			HGridBuild ();
+	void			HGridSplit ( hgsub_t& sub, int nd, Vec3F bmin, Vec3F w, int level );
+
+	// Threads
+	void			ParallelFor ( int n, std::function<void(int, int, int)> fn );
+	void			PoolWorker ( int t );
 
 	void			transitionPredState(int centroidReached, predState& currentState);
 	int				centroidReached;
@@ -187,6 +462,8 @@ public:
 
 	int									max_cluster_id;		// clustering birds: maximum id
 	std::vector<std::vector<int>>		cluster_assignment;
+	std::vector<std::pair<int,int>>		m_cl_more;			// cluster neighbor pairs past CLUSTER_NBRS_MAX_ARRAY (cpu)
+	std::mutex							m_cl_more_lock;
 	std::vector<int>					cluster_order;
 	std::vector<Histogram>				cluster_histogram;
 
@@ -209,6 +486,69 @@ public:
 	int				m_viewgrid;					// show grid.
 	int				m_seed;
 	Mersenne		m_rnd;
+	int				m_trace;						// trace.				0 = off, 1 = record spans (see OutputTrace)
+	int				m_threads;					// cpu threads (ParallelFor)
+	pool_t			m_pool;
+
+	// Grid domain
+	Vec3F			m_grid_lo, m_grid_hi;		// accel grid domain, before the cell border
+	int				m_grid_track;				// grid follows the flock.	0 = fixed to world bounds
+	float			m_grid_margin;				// track: margin, fraction of flock extent
+	float			m_grid_shrink;				// track: refit when domain exceeds this times flock volume
+
+	// Autotune (see Autotune)
+	int				m_autotune;					// tune perf knobs at Reset.	0 = off, 1 = cached per host & scene, 2 = always re-tune
+	int				m_autotune_frames;			// frames timed per trial
+	float			m_autotune_tol;				// max fraction of birds with other neighbors than the exact run
+	float			m_autotune_ctol;			// max cluster count deviation from the exact run (fraction)
+	bool			m_autotuning;
+
+	// Neighbor search
+	int				m_nbr_backend;				// backend.			0 = grid, 1 = graph walk, 2 = k-d tree, 3 = hierarchical grid (cpu). see NBR_*
+	int				m_nbr_backstop;				// walk: full grid search every N frames
+	int				m_nbr_backstop_frame;		// walk: frame of last full grid search
+	std::vector<int>	m_nbr_list;				// walk: previous topological neighbors, NBR_MAX per bird (-1 = none)
+	std::vector<int>	m_nbr_list_next;
+	std::vector<uint>	m_nbr_stamp;			// walk: query id that last visited each bird
+	uint				m_nbr_stamp_id;
+	std::vector<kdnode_t>	m_kd_node;			// k-d tree
+	std::vector<int>	m_kd_idx;				// k-d tree: bird index, in tree order
+	std::vector<Vec3F>	m_kd_pos;				// k-d tree: bird position, in tree order
+	std::vector<int>	m_kd_out;				// k-d tree: birds outside the grid when built, not in the tree
+	int				m_kd_num;					// k-d tree: num_birds when built
+	int				m_hgrid_occ;				// hierarchical grid: subdivide cells with more birds than this
+	int				m_hgrid_sub;				// hierarchical grid: sub-cells per axis (2-4)
+	int				m_hgrid_levels;				// hierarchical grid: levels, including the accel grid (1-3)
+	int				m_hg_res, m_hg_levels;		// hierarchical grid: as built
+	std::vector<int>	m_hg_cell;				// hierarchical grid: per accel grid cell, index in m_hg_sub (-1 = not subdivided)
+	std::vector<hgsub_t>	m_hg_sub;			// hierarchical grid: dense cells
+	int				m_nbr_islands;				// search independent islands as parallel tasks (cpu, exact search)
+	int				m_nbr_island_chunk;			// islands: max birds per task
+	std::vector<island_t>	m_islands;			// islands: first m_islands_cnt used
+	int				m_islands_cnt;
+	std::vector<Vec3I>	m_island_cost;			// islands: per bird cand, fov, ins (cell stats)
+	int				m_ooc;						// out-of-core: bird state in mapped files, run in blocks of rows (cpu). see RunOOC
+	float			m_ooc_block_mb;				// out-of-core: working set per block, MB
+	std::string		m_ooc_path;					// out-of-core: state file, -o. next state in path.next
+	ooc_file_t		m_ooc_file[2];
+	int				m_ooc_cur;					// out-of-core: file with the current state
+	int				m_ooc_num;					// out-of-core: birds. num_birds is the block in m_Birds
+	size_t			m_ooc_rec;					// out-of-core: bytes per record
+	int				m_ooc_rows;					// out-of-core: rows, each ooc_h high from ooc_ymin
+	float			m_ooc_ymin, m_ooc_h;
+	std::vector< std::vector<xlong> >	m_ooc_run;	// out-of-core: per run of the current file, first record of each row (rows+1)
+	int				m_ooc_blocks;				// out-of-core: blocks last frame
+	int				m_nbr_nearest;				// nearest-first cell order with early termination (cpu). exact
+	int				m_nbr_temporal;				// search radius from previous k-th neighbor distance (cpu)
+	float			m_nbr_margin;				// temporal: motion margin, in units of 2*max_speed*DT
+	int				m_nbr_refresh;				// temporal: frames an interior bird keeps r_nbrs before a full radius query
+	std::vector<nbr_prev_t>	m_nbr_prev;			// temporal: per bird
+	int				m_nbr_approx;				// approx search.	0 = exact, 1 = bounded candidates (cpu only)
+	int				m_nbr_cand_max;				// approx: max candidates examined per cell (stratified sample)
+	int				m_nbr_stop_cnt;				// approx: stop after this many neighbors within stop dist. 0 = off
+	float			m_nbr_stop_dist;			// approx: stop distance (m)
+	int				m_nbr_recall_freq;			// approx: measure recall vs. exact search every N frames. 0 = off
+	float			m_nbr_recall;				// last measured recall
 
 	// Rendering
 	bool			m_running;
@@ -221,12 +561,17 @@ public:
 	int				m_cluster_sel;
 	bool			m_cockpit_view;
 	int				m_draw_mesh;
-	bool			m_draw_grid;
+	int				m_draw_grid;				// 0 = off, 1 = bird counts, 2 = neighbor search cost (heatmap)
 	bool			m_draw_origin;
 	bool			m_draw_help;
 	bool			m_draw_clusters;
 	bool			m_draw_plot;
 	bool			m_calculate_clusters;
+	int				m_cluster_mode;				// clustering.		0 = bird pairs, 1 = connected grid cells (see AssignClustersCells), 2 = dendrogram
+	int				m_cl_cells;					// cell mode: occupied cells
+	std::vector<int>	m_cl_dense;				// cell mode: node per cluster grid cell (-1 = empty)
+	int				m_cl_refine;				// cell mode: cell pairs refined by bird distance
+	int				m_cell_stats_start;			// frame when cell stats were last reset
 	bool			m_kernels_loaded;
 	int				bird_index;
 	float			closest_bird;
@@ -263,12 +608,111 @@ public:
 		float				m_peak_ave;
 		float				m_peak_max;
 	#endif
+	std::vector<int>		m_bird_flock;			// per bird id, stable flock id (-1 = none)
+	std::map<int, flock_spec_t>	m_flock_spec;	// per stable flock id
+	int						m_flock_next;			// next stable flock id
+	FILE*					m_flocks_outfile;
+
+	// Stats - Neighbor lists, kept for lag & anisotropy (cpu)
+	std::vector<int>		m_stat_nbrs;			// topological neighbors, NBR_MAX per bird, nearest first
+
+	// Stats - Neighbor anisotropy
+	int						m_aniso;				// anisotropy.	0 = off, 1 = on (see NeighborAnisotropy)
+	int						m_aniso_k;				// neighbors per bird
+	int						m_aniso_bins;			// bearing & elevation bins
+	float					m_aniso_gamma;			// anisotropy factor
+	float					m_aniso_eig[3];
+	Vec3F					m_aniso_dir;			// least populated direction, body frame
+	std::vector<int>		m_aniso_bearing, m_aniso_elev;
+	FILE*					m_aniso_outfile;
+
+	// Stats - Dendrogram (single linkage, all thresholds)
+	int						m_dendro;				// dendrogram cadence, frames.	0 = off (see BuildDendrogram)
+	float					m_dendro_rmax;			// longest link. 0 = neighbor radius
+	int						m_dendro_steps;			// thresholds reported
+	int						m_dendro_frame;			// frame the dendrogram was built
+	std::vector<dendro_link_t>	m_dendro_links;		// MST links, shortest first
+	FILE*					m_dendro_outfile;
+
+	// Stats - Pair correlation g(r)
+	int						m_gr;					// g(r) cadence, frames.	0 = off (see PairCorrelation)
+	int						m_gr_bins;
+	float					m_gr_rmax;				// cutoff. 0 = neighbor radius
+	std::vector<float>		m_gr_g;					// last estimate, per bin
+	FILE*					m_gr_outfile;
+
+	// Trajectories, spatially indexed
+	int						m_traj;					// trajectory cadence, frames.	0 = off (see OutputTrajectory)
+	FILE*					m_traj_outfile;
+	std::string				m_traj_read;			// region to read, -r. empty = off (see TrajectoryRead)
+
+	// Stats - Energy
+	int						m_energy_out;			// energy time series.	0 = off, 1 = write energy.csv each frame
+	FILE*					m_energy_outfile;
+
+	// Stats - Heading lag (information transfer)
+	int						m_lag;					// lag analysis.	0 = off, 1 = on (see LagAnalysis)
+	int						m_lag_max;				// max lag (frames)
+	int						m_lag_window;			// correlation window (frames)
+	float					m_lag_corr_min;			// min correlation for a lagged pair
+	std::vector<Vec3F>		m_lag_turn;				// turn ring, lag_max+lag_window+1 per bird id
+	std::vector<Vec3F>		m_lag_head;				// last heading, per bird id
+	std::vector<Vec3F>		m_lag_msum;				// window sum of turns, per bird id & offset 0..lag_max
+	std::vector<double>		m_lag_qsum;				// window sum of squared turns, per bird id & offset
+	std::vector<int>		m_lag_pair;				// neighbor id, NBR_MAX per bird id (-1 = none), last frame
+	std::vector<double>		m_lag_sab;				// window cross sums, per pair & lag (2*lag_max+1)
+	int						m_lag_frames;
+	float					m_lag_mean;				// ave lag of correlated pairs (frames)
+	float					m_lag_speed;			// propagation speed (m/s)
+	FILE*					m_lag_outfile;
+
+	// Stats - Numerical health
+	int						m_health;				// health monitor.	0 = off, 1 = quarantine & re-seed bad birds
+	float					m_health_speed;			// bad speed, as a multiple of max_speed
+	int						m_health_log;			// min frames between health log lines
+	std::vector<int>		m_health_bad;			// birds found bad this frame
+	int						m_health_cnt[3];		// this frame. nan, inf, speed
+	int						m_health_sum[4];		// since last log. nan, inf, speed, recovered
+	int						m_health_frame;			// frame of last log
+
+	// Perception delay
+	float					m_delay;				// perception delay (sec). 0 = off (see DelayRecord)
+	int						m_delay_depth;			// ring frames
+	int						m_delay_frames;			// frames recorded
+	int						m_delay_read;			// slot seen this frame, -1 = none
+	std::vector<delay_state_t>	m_delay_ring;		// past states. ring slot * pop_cap + bird
+	std::vector<delay_frame_t>	m_delay_slot;		// quantization, per slot
+
+	// Dynamic population (see SpawnBird)
+	int						m_pop_max;				// bird slots allocated at reset. 0 = num_birds
+	float					m_pop_spawn;			// arrivals, birds per sec
+	float					m_pop_catch;			// predator catch distance (m), caught birds despawn. 0 = off
+	int						m_pop_compact;			// frames between compactions. 0 = never
+	int						m_pop_cap;				// bird slots
+	int						m_pop_dead;				// dead slots below num_birds
+	int						m_pop_caught;			// birds caught since reset
+	float					m_pop_acc;				// arrivals due, fraction of a bird
+	std::vector<char>		m_pop_alive;			// alive mask, per slot
+	std::vector<int>		m_pop_free;				// free list, dead slots
+
+	// Stats - Trace spans
+	trace_t					m_trace_buf[ TRACE_MAX ];
+	std::atomic<uint>		m_trace_head;
+	std::atomic<int>		m_trace_threads;
 
 	// Experiment setup
 	int				m_run;
 	int				m_num_run;
 	Vec3F			m_val;
 
+	// Job queue
+	std::string		m_queue_dir;				// shared queue directory, -q. empty = off (see RunQueue)
+	float			m_queue_lease;				// secs without a heartbeat before a claim is stale
+	float			m_queue_poll;				// secs between scans when no job is claimable
+	std::string		m_queue_worker;				// this worker, host-pid
+	int				m_queue_beat;
+	std::map<std::string, std::pair<std::string, double> >	m_queue_seen;	// claim content & when first seen
+
 
 	// CUDA / GPU
 	#ifdef BUILD_CUDA
@@ -316,11 +760,11 @@ Flock2 obj;
 	}
 #endif
 
-Bird* Flock2::AddBird ( Vec3F pos, Vec3F vel, Vec3F target, float power )
+Bird* Flock2::AddBird ( Vec3F pos, Vec3F vel, Vec3F target, float power, int ndx )
 {
 	Vec3F dir, angs;
 
-	int ndx = m_Birds.AddElem ( FBIRD );
+	if ( ndx < 0 ) ndx = m_Birds.AddElem ( FBIRD );			// else reuse slot ndx
 
 	Bird b;
 	b.id = ndx;
@@ -330,6 +774,8 @@ Bird* Flock2::AddBird ( Vec3F pos, Vec3F vel, Vec3F target, float power )
 	b.power = power;
 	b.pitch_adv = 0;
 	b.accel.Set(0,0,0);
+	b.Plift = 0; b.Pdrag = 0; b.Pfwd = 0; b.Pturn = 0; b.Ptotal = 0;
+	b.Ecum = 0;
 
 	dir = b.vel; dir.Normalize();
 	b.orient.fromDirectionAndUp ( dir, Vec3F(0,1,0) );
@@ -369,6 +815,195 @@ Predator* Flock2::AddPredator(Vec3F pos, Vec3F vel, Vec3F target, float power)
 	return (Predator*)m_Predators.GetElem(FPREDATOR, ndx);
 }
 
+// Dynamic population (CPU)
+// birds live in slots [0, num_birds) of up to pop_cap allocated at Reset (pop_max), with an alive
+// mask honoured by every cpu stage: dead birds are not binned (GRID_UNDEF), so they are never
+// neighbors or queried, and are skipped by advance, clusters, bounds, analyses & outputs.
+// - SpawnBird: reuses the last freed slot (free list), else appends. O(1)
+// - DespawnBird: clears the alive bit and frees the slot. O(1)
+// - CompactPopulation: every pop_compact frames, live birds in the tail move into the holes below,
+//   in parallel, inside InsertIntoGrid just before binning. per bird state (neighbor lists, delay ring,
+//   lag sums, flock ids) moves with them, neighbor ids are renumbered. O(dead)
+// spawning & despawning never reallocate, so population changes do not need a Reset.
+//
+int Flock2::SpawnBird ( Vec3F pos, Vec3F vel, Vec3F target, float power )
+{
+	int i;
+	if ( !m_pop_free.empty() ) {
+		i = m_pop_free.back ();
+		m_pop_free.pop_back ();
+		m_pop_dead--;
+	} else if ( m_Params.num_birds < m_pop_cap ) {
+		i = m_Params.num_birds++;
+	} else {
+		return -1;													// full
+	}
+	Bird* b = AddBird ( pos, vel, target, power, (i < m_Birds.GetNumElem(FBIRD)) ? i : -1 );
+	b->near_j = -1;
+	b->t_nbrs = 0;
+	b->r_nbrs = 0;
+	b->cluster_id = -1;
+	b->cluster_nbr_cnt = 0;
+	b->clr = Vec4F( (pos.x+100)/200.0f, pos.y/200.f, (pos.z+100)/200.f, 1.f );
+	m_pop_alive[i] = 1;
+
+	// per slot state of a previous occupant
+	if ( i < (int) m_nbr_prev.size() ) m_nbr_prev[i] = nbr_prev_t{0, 0, 0};
+	if ( (i+1)*NBR_MAX <= (int) m_nbr_list.size() ) std::fill ( &m_nbr_list[ i*NBR_MAX ], &m_nbr_list[ i*NBR_MAX ] + NBR_MAX, -1 );
+	if ( i < (int) m_bird_flock.size() ) m_bird_flock[i] = -1;
+	if ( i < (int) m_lag_head.size() ) {
+		size_t H = m_lag_turn.size() / m_lag_head.size();
+		std::fill ( m_lag_turn.begin() + i*H, m_lag_turn.begin() + i*H + H, Vec3F(0,0,0) );
+		std::fill ( &m_lag_pair[ i*NBR_MAX ], &m_lag_pair[ i*NBR_MAX ] + NBR_MAX, -1 );
+		m_lag_head[i] = vel;	m_lag_head[i].Normalize();
+	}
+	for (int s=0; s < std::min( m_delay_frames, m_delay_depth ); s++)
+		DelayQuantize ( m_delay_slot[s], b, m_delay_ring[ (size_t) s * m_pop_cap + i ] );
+	return i;
+}
+
+bool Flock2::DespawnBird ( int i )
+{
+	if ( i < 0 || i >= m_Params.num_birds || !m_pop_alive[i] ) return false;
+	m_pop_alive[i] = 0;
+	m_pop_free.push_back ( i );
+	m_pop_dead++;
+	if ( m_bird_sel == i ) m_bird_sel = -1;
+	return true;
+}
+
+// arrivals (pop_spawn per sec, placed as at Reset) & predator catches (pop_catch), once per frame
+void Flock2::UpdatePopulation ()
+{
+	if ( m_gpu ) {
+		dbgprintf ( "ERROR: Dynamic population is cpu only. Disabled.\n" );
+		m_pop_spawn = 0;
+		m_pop_catch = 0;
+		return;
+	}
+	Vec3F pos, vel;
+	Bird* b;
+	Predator* p;
+
+	// arrivals first. a slot freed by a catch is reused next frame, once no neighbor list or lag pair holds it
+	if ( m_pop_spawn > 0 ) {
+		for ( m_pop_acc += m_pop_spawn * m_Params.DT; m_pop_acc >= 1.0f; m_pop_acc -= 1.0f ) {
+			pos = m_rnd.randV3( -50, 50 );
+			pos.y = pos.y * .5f + 50;
+			vel = m_rnd.randV3( -20, 20 );
+			vel *= 7.5 / vel.Length ();
+			if ( SpawnBird ( pos, vel, Vec3F(0, 0, m_rnd.randF(-180, 180)), 1 ) < 0 ) { m_pop_acc = 0; break; }
+		}
+	}
+
+	if ( m_pop_catch > 0 ) {
+		float c2 = m_pop_catch * m_pop_catch;
+		for (int n=0; n < m_Params.num_predators; n++) {
+			p = (Predator*) m_Predators.GetElem( FPREDATOR, n );
+			for (int i=0; i < m_Params.num_birds; i++) {
+				if ( !m_pop_alive[i] ) continue;
+				b = (Bird*) m_Birds.GetElem( FBIRD, i );
+				Vec3F d = b->pos - p->pos;
+				if ( d.Dot( d ) < c2 && DespawnBird ( i ) ) m_pop_caught++;
+			}
+		}
+	}
+}
+
+// per bird state of w entries each (see CompactPopulation): rows of the tail move into the holes,
+// rows past alive are dropped. state not sized for all num birds is stale and cleared, so it restarts.
+// CompactIds renumbers neighbor ids by remap (-1 = dead). packed rows end at the first -1
+template <class T>
+void CompactRows ( std::vector<T>& v, size_t w, const std::vector<int>& hole, const std::vector<int>& tail, int num, int alive )
+{
+	if ( w == 0 || v.size() < (size_t) num * w ) { v.clear(); return; }
+	for (size_t k=0; k < hole.size(); k++)
+		std::copy ( v.begin() + tail[k]*w, v.begin() + tail[k]*w + w, v.begin() + hole[k]*w );
+	v.resize ( alive * w );
+}
+void CompactIds ( std::vector<int>& v, size_t w, const std::vector<int>& remap, bool packed )
+{
+	for (size_t r=0; r < v.size(); r += w) {
+		size_t m = r;
+		for (size_t k=r; k < r+w; k++) {
+			int j = v[k];
+			j = (j >= 0 && j < (int) remap.size()) ? remap[j] : -1;
+			if ( packed ) { if ( j >= 0 ) v[m++] = j; }
+			else v[k] = j;
+		}
+		if ( packed ) std::fill ( v.begin() + m, v.begin() + r + w, -1 );
+	}
+}
+
+void Flock2::CompactPopulation ()
+{
+	int num = m_Params.num_birds;
+	int alive = num - m_pop_dead;
+
+	// holes below the new end, and live birds at or above it. equal counts, disjoint
+	std::vector<int> hole, tail;
+	for (int i : m_pop_free)
+		if ( i < alive ) hole.push_back ( i );
+	std::sort ( hole.begin(), hole.end() );
+	for (int i = alive; i < num; i++)
+		if ( m_pop_alive[i] ) tail.push_back ( i );
+
+	// new slot of each old slot, -1 = dead
+	std::vector<int> remap ( num, -1 );
+	for (int i=0; i < alive; i++)
+		if ( m_pop_alive[i] ) remap[i] = i;
+	for (size_t k=0; k < hole.size(); k++)
+		remap[ tail[k] ] = hole[k];
+
+	int depth = m_delay_ring.empty() ? 0 : m_delay_depth;
+	bool prev = ( m_nbr_prev.size() >= (size_t) num );
+	ParallelFor ( (int) hole.size(), [&] (int a, int b, int t) {
+		for (int k=a; k < b; k++) {
+			int src = tail[k], dst = hole[k];
+			Bird* bd = (Bird*) m_Birds.GetElem( FBIRD, dst );
+			memcpy ( bd, m_Birds.GetElem( FBIRD, src ), sizeof(Bird) );
+			bd->id = dst;
+			m_pop_alive[dst] = 1;
+			if ( prev ) m_nbr_prev[dst] = m_nbr_prev[src];
+			for (int s=0; s < depth; s++)
+				m_delay_ring[ (size_t) s * m_pop_cap + dst ] = m_delay_ring[ (size_t) s * m_pop_cap + src ];
+		}
+	} );
+	for (int k=0; k < (int) hole.size(); k++) {
+		if ( m_bird_sel == tail[k] ) m_bird_sel = hole[k];
+		if ( bird_index == tail[k] ) bird_index = hole[k];
+	}
+	std::fill ( m_pop_alive.begin() + alive, m_pop_alive.begin() + num, 0 );
+
+	// per bird state kept across frames, by slot (= bird id on the cpu)
+	CompactRows ( m_nbr_list, NBR_MAX, hole, tail, num, alive );			// walk lists
+	CompactIds ( m_nbr_list, NBR_MAX, remap, true );
+	m_nbr_list_next.resize ( m_nbr_list.size() );
+	CompactRows ( m_stat_nbrs, NBR_MAX, hole, tail, num, alive );
+	CompactIds ( m_stat_nbrs, NBR_MAX, remap, true );
+	CompactRows ( m_bird_flock, 1, hole, tail, num, alive );				// stable flock ids
+	if ( !m_lag_head.empty() ) {											// lag analysis, all sized by one bird count
+		size_t n = m_lag_head.size();
+		CompactRows ( m_lag_turn, m_lag_turn.size() / n, hole, tail, num, alive );
+		CompactRows ( m_lag_msum, m_lag_msum.size() / n, hole, tail, num, alive );
+		CompactRows ( m_lag_qsum, m_lag_qsum.size() / n, hole, tail, num, alive );
+		CompactRows ( m_lag_sab, m_lag_sab.size() / n, hole, tail, num, alive );
+		CompactRows ( m_lag_pair, NBR_MAX, hole, tail, num, alive );
+		CompactIds ( m_lag_pair, NBR_MAX, remap, false );				// pairs line up with their sums
+		CompactRows ( m_lag_head, 1, hole, tail, num, alive );
+	}
+	#ifdef USE_FFTW
+		for (size_t k=0; k < hole.size(); k++)								// spectra samples
+			if ( tail[k] < MAX_BIRDS ) memcpy ( m_samples + hole[k]*SAMPLES, m_samples + tail[k]*SAMPLES, SAMPLES*sizeof(double) );
+	#endif
+
+	m_Params.num_birds = alive;
+	m_pop_dead = 0;
+	m_pop_free.clear ();
+	if ( !m_autotuning )
+		dbgprintf ( "Population: frame %d, compacted to %d birds, %d moved, %d caught\n", m_frame, alive, (int) hole.size(), m_pop_caught );
+}
+
 int iDivUp (int a, int b) {
 	return (a % b != 0) ? (a / b + 1) : (a / b);
 }
@@ -379,6 +1014,86 @@ void ComputeNumBlocks (int numPnts, int minThreads, int &numBlocks, int &numThre
 	numBlocks = (numThreads==0) ? 1 : iDivUp ( numPnts, numThreads );
 }
 
+// Cell vs. view cone (fov culling)
+// box relative to the bird, already known to be behind it (forward-most corner, see gridCone).
+// returns true if no point in the box is within the field-of-view:
+// - wide fov (fovcos <= 0), the region outside the cone is convex, so all corners outside => box outside
+// - narrow fov, being behind the bird is enough
+#define CONE_EPS	1e-4f
+#define CELL_EPS	1e-3f		// cell box padding (m), covers rounding in grid insert
+
+bool BoxOutsideCone ( Vec3F bmin, Vec3F bmax, Vec3F dir, float fovcos )
+{
+	if ( fovcos > 0 ) return true;
+	Vec3F v;
+	for (int n=0; n < 8; n++) {
+		v.Set ( (n & 1) ? bmax.x : bmin.x, (n & 2) ? bmax.y : bmin.y, (n & 4) ? bmax.z : bmin.z );
+		if ( v.Dot(dir) >= (fovcos - CONE_EPS) * v.Length() ) return false;
+	}
+	return true;
+}
+
+// min distance^2 from a point to a box, padded by CELL_EPS
+inline float BoxDist2 ( const Vec3F& bmin, const Vec3F& bmax, const Vec3F& p )
+{
+	float dx = std::max( std::max( bmin.x - CELL_EPS - p.x, p.x - bmax.x - CELL_EPS ), 0.f );
+	float dy = std::max( std::max( bmin.y - CELL_EPS - p.y, p.y - bmax.y - CELL_EPS ), 0.f );
+	float dz = std::max( std::max( bmin.z - CELL_EPS - p.z, p.z - bmax.z - CELL_EPS ), 0.f );
+	return dx*dx + dy*dy + dz*dz;
+}
+
+// Add a cluster neighbor to a query (CPU)
+// past the per-bird array they spill into cl_more, so clustering stays exact.
+inline void NbrCluster ( nbr_query_t& q, int j )
+{
+	if ( q.cl_cnt < CLUSTER_NBRS_MAX_ARRAY )
+		q.cl_nbrs[ q.cl_cnt++ ] = j;
+	else
+		q.cl_more.push_back ( j );
+}
+
+// Test one candidate neighbor of a query (CPU)
+// adds it to the cluster neighbors and the topological list, and counts r_nbrs.
+// returns true if within radius & field-of-view.
+inline bool NbrCandidate ( nbr_query_t& q, int j, const Vec3F& posj, float dsq, float rd2, float rc2, float fovcos )
+{
+	int k, m;
+	q.ncand++;
+
+	// bird is closer than cluster threshold
+	if ( q.cl_nbrs && dsq < rc2 ) NbrCluster ( q, j );
+
+	if ( dsq >= rd2 ) return false;
+
+	// confirm bird is within forward field-of-view
+	Vec3F dirj = posj - q.pos; dirj.Normalize();
+	if ( q.dir.Dot (dirj) <= fovcos ) {
+		q.nfov++;
+		return false;
+	}
+
+	// put into topological sorted list
+	for (k = 0; k < q.sort_num && dsq > q.sort_d[k];)
+		k++;
+
+	// only insert if bird is closer than the top N
+	if ( k < q.kmax ) {
+		// shift others down (insertion sort)
+		for (m = q.sort_num-1; m >= k; m--) {
+			q.sort_d[m+1] = q.sort_d[m];
+			q.sort_j[m+1] = q.sort_j[m];
+		}
+		q.sort_d[k] = dsq;
+		q.sort_j[k] = j;
+		if ( q.sort_num < q.kmax ) q.sort_num++;
+		q.nins++;
+	}
+
+	// count boundary neighbors
+	q.r_nbrs++;
+	return true;
+}
+
 float fmod180(float a)
 {
 	if(a > 180)
@@ -473,6 +1188,9 @@ void Flock2::DefaultParams ()
 	m_Params.reynolds_avoidance = 0.5;
 	m_Params.reynolds_alignment = 1.0;
 	m_Params.reynolds_cohesion =  0.2;
+
+	m_Params.cell_stats = 0;							// per-cell neighbor search cost (heatmap)
+	m_Params.nbr_cull = 1;								// fov cone culling of grid cells
 }
 
 void Flock2::SetupParams()
@@ -520,12 +1238,67 @@ void Flock2::SetupParams()
 	m_ParamMap["reynolds_avoidance"] =	ParamPtr('f', &m_Params.reynolds_avoidance);
 	m_ParamMap["reynolds_cohesion"] =		ParamPtr('f', &m_Params.reynolds_cohesion);
 	m_ParamMap["reynolds_alignment"] =  ParamPtr('f', &m_Params.reynolds_alignment);
+	m_ParamMap["cell_stats"] =					ParamPtr('i', &m_Params.cell_stats);
+	m_ParamMap["nbr_cull"] =						ParamPtr('i', &m_Params.nbr_cull);
 
 	m_ParamMap["visualize"]	=						ParamPtr('i', &m_visualize);
 	m_ParamMap["gpu"] =								ParamPtr('i', &m_gpu);
 	m_ParamMap["method"] =							ParamPtr('i', &m_method);
 	m_ParamMap["analysis"] =						ParamPtr('i', &m_analysis);
   m_ParamMap["grid"] =								ParamPtr('i', &m_viewgrid );
+	m_ParamMap["trace"] =								ParamPtr('i', &m_trace );
+	m_ParamMap["threads"] =							ParamPtr('i', &m_threads );
+	m_ParamMap["autotune"] =						ParamPtr('i', &m_autotune );
+	m_ParamMap["autotune_frames"] =			ParamPtr('i', &m_autotune_frames );
+	m_ParamMap["autotune_tol"] =					ParamPtr('f', &m_autotune_tol );
+	m_ParamMap["autotune_ctol"] =				ParamPtr('f', &m_autotune_ctol );
+	m_ParamMap["grid_track"] =						ParamPtr('i', &m_grid_track );
+	m_ParamMap["grid_margin"] =						ParamPtr('f', &m_grid_margin );
+	m_ParamMap["grid_shrink"] =						ParamPtr('f', &m_grid_shrink );
+	m_ParamMap["nbr_backend"] =					ParamPtr('i', &m_nbr_backend );
+	m_ParamMap["nbr_backstop"] =				ParamPtr('i', &m_nbr_backstop );
+	m_ParamMap["nbr_nearest"] =					ParamPtr('i', &m_nbr_nearest );
+	m_ParamMap["nbr_temporal"] =				ParamPtr('i', &m_nbr_temporal );
+	m_ParamMap["nbr_margin"] =					ParamPtr('f', &m_nbr_margin );
+	m_ParamMap["nbr_refresh"] =					ParamPtr('i', &m_nbr_refresh );
+	m_ParamMap["nbr_approx"] =					ParamPtr('i', &m_nbr_approx );
+	m_ParamMap["nbr_cand_max"] =				ParamPtr('i', &m_nbr_cand_max );
+	m_ParamMap["queue_lease"] =					ParamPtr('f', &m_queue_lease );
+	m_ParamMap["queue_poll"] =					ParamPtr('f', &m_queue_poll );
+	m_ParamMap["health"] =							ParamPtr('i', &m_health );
+	m_ParamMap["health_speed"] =				ParamPtr('f', &m_health_speed );
+	m_ParamMap["health_log"] =					ParamPtr('i', &m_health_log );
+	m_ParamMap["delay"] =								ParamPtr('f', &m_delay );
+	m_ParamMap["pop_max"] =							ParamPtr('i', &m_pop_max );
+	m_ParamMap["pop_spawn"] =						ParamPtr('f', &m_pop_spawn );
+	m_ParamMap["pop_catch"] =						ParamPtr('f', &m_pop_catch );
+	m_ParamMap["pop_compact"] =					ParamPtr('i', &m_pop_compact );
+	m_ParamMap["energy_out"] =					ParamPtr('i', &m_energy_out );
+	m_ParamMap["cluster_mode"] =				ParamPtr('i', &m_cluster_mode );
+	m_ParamMap["aniso"] =								ParamPtr('i', &m_aniso );
+	m_ParamMap["aniso_k"] =							ParamPtr('i', &m_aniso_k );
+	m_ParamMap["aniso_bins"] =					ParamPtr('i', &m_aniso_bins );
+	m_ParamMap["dendro"] =							ParamPtr('i', &m_dendro );
+	m_ParamMap["dendro_rmax"] =					ParamPtr('f', &m_dendro_rmax );
+	m_ParamMap["dendro_steps"] =				ParamPtr('i', &m_dendro_steps );
+	m_ParamMap["gr"] =									ParamPtr('i', &m_gr );
+	m_ParamMap["gr_bins"] =							ParamPtr('i', &m_gr_bins );
+	m_ParamMap["gr_rmax"] =							ParamPtr('f', &m_gr_rmax );
+	m_ParamMap["traj"] =								ParamPtr('i', &m_traj );
+	m_ParamMap["lag"] =									ParamPtr('i', &m_lag );
+	m_ParamMap["lag_max"] =							ParamPtr('i', &m_lag_max );
+	m_ParamMap["lag_window"] =						ParamPtr('i', &m_lag_window );
+	m_ParamMap["lag_corr_min"] =					ParamPtr('f', &m_lag_corr_min );
+	m_ParamMap["nbr_islands"] =					ParamPtr('i', &m_nbr_islands );
+	m_ParamMap["nbr_island_chunk"] =			ParamPtr('i', &m_nbr_island_chunk );
+	m_ParamMap["ooc"] =									ParamPtr('i', &m_ooc );
+	m_ParamMap["ooc_block_mb"] =				ParamPtr('f', &m_ooc_block_mb );
+	m_ParamMap["hgrid_occ"] =					ParamPtr('i', &m_hgrid_occ );
+	m_ParamMap["hgrid_sub"] =					ParamPtr('i', &m_hgrid_sub );
+	m_ParamMap["hgrid_levels"] =				ParamPtr('i', &m_hgrid_levels );
+	m_ParamMap["nbr_stop_cnt"] =				ParamPtr('i', &m_nbr_stop_cnt );
+	m_ParamMap["nbr_stop_dist"] =				ParamPtr('f', &m_nbr_stop_dist );
+	m_ParamMap["nbr_recall_freq"] =			ParamPtr('i', &m_nbr_recall_freq );
 }
 
 bool Flock2::SetParam (std::string name, float val, Vec3F vec)
@@ -552,6 +1325,10 @@ void Flock2::on_arg (int i, std::string arg, std::string val)
 	if (arg.compare("-m") == 0) 	{ m_method = strToI(val); }								// method select. 0 = Flock2 (Hoetzlein), 1 = Reynolds
 	if (arg.compare("-a") == 0) 	{ m_analysis = strToI(val); }							// analysis select. 0 = off, 1 = on
 	if (arg.compare("-d") == 0) 	{ m_viewgrid = strToI(val); }							// show grid
+	if (arg.compare("-t") == 0) 	{ m_trace = strToI(val); }								// trace spans. 0 = off, 1 = on
+	if (arg.compare("-q") == 0) 	{ m_queue_dir = val; }									// job queue dir. run as a sweep worker
+	if (arg.compare("-r") == 0) 	{ m_traj_read = val; }									// trajectory region. file,frame[,x0,y0,z0,x1,y1,z1]
+	if (arg.compare("-o") == 0) 	{ m_ooc_path = val; m_ooc = 1; }						// out-of-core state file
 
 }
 
@@ -607,6 +1384,13 @@ void Flock2::Reset (int num, int num_pred )
 	float h;
 	Bird* b;
 	Predator* p;
+	Mersenne rnd0 = m_rnd;
+
+	// out-of-core. num_birds is one block then, a reset restarts the population
+	if ( m_ooc ) {
+		ResetOOC ( (m_ooc_num > 0) ? m_ooc_num : num );
+		if ( m_ooc ) return;
+	}
 
 	if ( num > MAX_BIRDS ) {
 			printf ("ERROR: Maximum bird limit.\n" );
@@ -626,10 +1410,24 @@ void Flock2::Reset (int num, int num_pred )
 	int numPoints_pred = m_Params.num_predators;
 	uchar usage = (m_gpu) ? (DT_CPU | DT_CUMEM) : DT_CPU;
 
+	// slots for spawned birds (cpu). see SpawnBird
+	m_pop_cap = std::max( numPoints, std::min( m_pop_max, MAX_BIRDS ) );
+	m_pop_alive.assign ( m_pop_cap, 0 );
+	std::fill ( m_pop_alive.begin(), m_pop_alive.begin() + numPoints, 1 );
+	m_pop_free.clear ();
+	m_pop_dead = 0;
+	m_pop_caught = 0;
+	m_pop_acc = 0;
+
 	m_Birds.DeleteAllBuffers ();
-	m_Birds.AddBuffer ( FBIRD,  "bird",		sizeof(Bird),	numPoints, usage );
-	m_Birds.AddBuffer ( FGCELL, "gcell",	sizeof(uint),	numPoints, usage );
-	m_Birds.AddBuffer ( FGNDX,  "gndx",		sizeof(uint),	numPoints, usage );
+	m_Birds.AddBuffer ( FBIRD,  "bird",		sizeof(Bird),	m_pop_cap, usage );
+	m_Birds.AddBuffer ( FGCELL, "gcell",	sizeof(uint),	m_pop_cap, usage );
+	m_Birds.AddBuffer ( FGNDX,  "gndx",		sizeof(uint),	m_pop_cap, usage );
+
+	m_nbr_prev.assign ( numPoints, nbr_prev_t{0, 0, 0} );
+	m_nbr_list.assign ( numPoints*NBR_MAX, -1 );
+	m_nbr_list_next.assign ( numPoints*NBR_MAX, -1 );
+	m_nbr_backstop_frame = 0;
 
 	// -------- PREDATOR -----
 	m_Predators.DeleteAllBuffers();
@@ -697,6 +1495,8 @@ void Flock2::Reset (int num, int num_pred )
 	m_Accel.grid_density = 1.0;
 	m_Accel.sim_scale = 1.0;
 
+	m_grid_lo = m_Accel.bound_min;
+	m_grid_hi = m_Accel.bound_max;
 	InitializeGrid ();
 
 	#ifdef BUILD_CUDA
@@ -743,19 +1543,241 @@ void Flock2::Reset (int num, int num_pred )
 		}
 	#endif
 
-	printf ("Added %d birds.\n", m_Params.num_birds );
-	printf ("Added %d predators.\n", m_Params.num_predators);		// predators
+	if ( !m_autotuning ) {
+		printf ("Added %d birds.\n", m_Params.num_birds );
+		printf ("Added %d predators.\n", m_Params.num_predators);		// predators
+	}
+
+	// reset time
+	m_time = 0;
+	m_frame = 0;
+	m_health_frame = -1000000;
+	memset ( m_health_sum, 0, sizeof(m_health_sum) );
+	m_dendro_frame = -1;
+	m_delay_frames = 0;
+
+	// reset search cost
+	ResetCellStats ();
+
+	// clear plots
+	m_vis.clear ();
+	m_graph.clear ();
+	m_plot[0].Fill ( 0,0,0,0 );
+	m_plot[1].Fill ( 0,0,0,0 );
+
+	// tune perf knobs on this flock, then start over with them
+	if ( m_autotune && !m_autotuning ) {
+		m_autotuning = true;
+		Autotune ( rnd0 );
+		m_rnd = rnd0;
+		Reset ( num, num_pred );
+		m_autotuning = false;
+	}
+}
+
+
+// Out-of-core reset (CPU)
+// birds are generated as in Reset, into the next state file, then sorted by row into the current
+// file as one run. the world is scaled to keep the density of MAX_BIRDS in the in-core world, so
+// up to MAX_BIRDS it is the same flock. features that keep state per slot across frames, or need
+// the whole flock at once, are off.
+//
+void Flock2::ResetOOC ( int num )
+{
+	#ifdef _WIN32
+		dbgprintf ( "ERROR: Out-of-core mode needs mmap. Disabled.\n" );
+		m_ooc = 0;
+	#else
+	Vec3F pos, vel, p;
+	float h;
+	Bird* b;
+
+	if ( m_gpu || m_Params.num_predators > 0 || m_pop_spawn > 0 || m_pop_catch > 0 || m_delay > 0 || m_autotune || m_nbr_temporal || m_nbr_backend == NBR_WALK )
+		printf ( "Out-of-core: cpu only. predators, population changes, delay, autotune, temporal & walk search off.\n" );
+	m_gpu = false;
+	m_pop_spawn = 0;
+	m_pop_catch = 0;
+	m_delay = 0;
+	m_autotune = 0;
+	m_nbr_temporal = 0;
+	if ( m_nbr_backend == NBR_WALK ) m_nbr_backend = NBR_GRID;
+	m_analysis = 0;
+	m_energy_out = 0;
+	m_lag = 0;	m_aniso = 0;	m_dendro = 0;	m_gr = 0;	m_traj = 0;
+
+	m_ooc_num = num;
+	m_Params.num_birds = 0;
+	m_Params.num_predators = 0;
+	m_Params.fovcos = cos ( m_Params.fov * 0.5 * DEGtoRAD );
+	m_Predators.DeleteAllBuffers ();
+	m_Predators.AddBuffer ( FPREDATOR, "predator", sizeof(Predator), 0, DT_CPU );
+	m_pop_free.clear ();
+	m_pop_dead = 0;
+	m_pop_caught = 0;
+	m_pop_acc = 0;
+	m_nbr_prev.clear ();
+	m_nbr_list.clear ();
+	m_nbr_list_next.clear ();
+
+	// world
+	float s = std::max( 1.0f, cbrtf( float(num) / MAX_BIRDS ) );
+	m_Accel.bound_min = Vec3F(-200*s,   0, -200*s);
+	m_Accel.bound_max = Vec3F( 200*s, 200*s, 200*s);
+	m_Accel.psmoothradius = 10;
+	m_Accel.grid_density = 1.0;
+	m_Accel.sim_scale = 1.0;
+	m_grid_lo = m_Accel.bound_min;
+	m_grid_hi = m_Accel.bound_max;
+
+	// rows, one neighbor radius high. a block with one halo row on each side holds all neighbors
+	m_ooc_h = m_Accel.psmoothradius / m_Accel.sim_scale;
+	m_ooc_ymin = m_Accel.bound_min.y;
+	m_ooc_rows = std::max( 1, (int) ceil( (m_Accel.bound_max.y - m_Accel.bound_min.y) / m_ooc_h ) );
+
+	// state files. records up to the cluster neighbors, which are not kept, 16 byte aligned
+	Bird rb;
+	m_ooc_rec = ( size_t((char*) rb.cluster_nbrs - (char*) &rb) + 15 ) & ~size_t(15);
+	m_ooc_file[0].path = m_ooc_path;
+	m_ooc_file[1].path = m_ooc_path + ".next";
+	if ( !OOCMap ( m_ooc_file[0], size_t(num) * m_ooc_rec ) || !OOCMap ( m_ooc_file[1], size_t(num) * m_ooc_rec ) ) {
+		OOCUnmap ( m_ooc_file[0] );
+		OOCUnmap ( m_ooc_file[1] );
+		m_ooc = 0;
+		return;
+	}
+	m_ooc_cur = 0;
+
+	// working set
+	m_pop_cap = 0;
+	OOCReserve ( std::min( num, int( m_ooc_block_mb * 1048576.0 / (sizeof(Bird) + 2*sizeof(uint)) ) ) );
+
+	// add birds, into the next file
+	char* gen = m_ooc_file[1].map;
+	for (int n=0; n < num; n++) {
+		pos = m_rnd.randV3( -50, 50 );
+		pos.y = pos.y * .5f + 50;
+
+		vel = m_rnd.randV3( -20, 20 );
+		vel *= 7.5 / vel.Length ();
+		h = m_rnd.randF(-180, 180);
+		p = pos;	p *= s;
+		b = AddBird ( p, vel, Vec3F(0, 0, h), 1, 0 );
+		b->id = n;
+		b->clr = Vec4F( (pos.x+100)/200.0f, pos.y/200.f, (pos.z+100)/200.f, 1.f );
+		b->cluster_id = -1;
+		memcpy ( gen + size_t(n) * m_ooc_rec, b, m_ooc_rec );
+	}
+
+	// sort by row into the current file
+	std::vector<xlong> run ( m_ooc_rows + 1, 0 );
+	for (int n=0; n < num; n++)
+		run[ OOCRow( ((Bird*) (gen + size_t(n) * m_ooc_rec))->pos.y ) + 1 ]++;
+	for (int y=0; y < m_ooc_rows; y++)
+		run[y+1] += run[y];
+	m_ooc_run.assign ( 1, run );
+	for (int n=0; n < num; n++) {
+		b = (Bird*) (gen + size_t(n) * m_ooc_rec);
+		memcpy ( m_ooc_file[0].map + size_t( run[ OOCRow( b->pos.y ) ]++ ) * m_ooc_rec, b, m_ooc_rec );
+	}
+
+	printf ("Added %d birds, out-of-core in %s.\n", num, m_ooc_path.c_str() );
 
 	// reset time
 	m_time = 0;
 	m_frame = 0;
+	m_health_frame = -1000000;
+	memset ( m_health_sum, 0, sizeof(m_health_sum) );
+	m_dendro_frame = -1;
+	m_delay_frames = 0;
+	ResetCellStats ();
 
 	// clear plots
 	m_vis.clear ();
 	m_graph.clear ();
 	m_plot[0].Fill ( 0,0,0,0 );
 	m_plot[1].Fill ( 0,0,0,0 );
+	#endif
+}
+
+// Map a state file of bytes, read & write, shared. contents are kept if it is mapped again
+bool Flock2::OOCMap ( ooc_file_t& f, size_t bytes )
+{
+	#ifdef _WIN32
+		return false;
+	#else
+		OOCUnmap ( f );
+		f.fd = open ( f.path.c_str(), O_RDWR | O_CREAT, 0644 );
+		if ( f.fd < 0 ) {
+			dbgprintf ( "ERROR: Unable to open %s\n", f.path.c_str() );
+			return false;
+		}
+		size_t sz = std::max( bytes, (size_t) 4096 );
+		if ( ftruncate ( f.fd, sz ) != 0 ) {
+			dbgprintf ( "ERROR: Unable to size %s to %zu bytes\n", f.path.c_str(), sz );
+			OOCUnmap ( f );
+			return false;
+		}
+		void* p = mmap ( 0, sz, PROT_READ | PROT_WRITE, MAP_SHARED, f.fd, 0 );
+		if ( p == MAP_FAILED ) {
+			dbgprintf ( "ERROR: Unable to map %s\n", f.path.c_str() );
+			OOCUnmap ( f );
+			return false;
+		}
+		f.map = (char*) p;
+		f.size = sz;
+		return true;
+	#endif
+}
+
+void Flock2::OOCUnmap ( ooc_file_t& f )
+{
+	#ifndef _WIN32
+		if ( f.map ) munmap ( f.map, f.size );
+		if ( f.fd >= 0 ) close ( f.fd );
+	#endif
+	f.map = 0;
+	f.fd = -1;
+	f.size = 0;
+}
+
+// Advise the kernel on records [r0, r1) of a state file
+// WILLNEED starts async readahead. DONTNEED drops whole pages only, records sharing a page may still be needed
+void Flock2::OOCAdvise ( ooc_file_t& f, xlong r0, xlong r1, int advice )
+{
+	#ifndef _WIN32
+		if ( f.map == 0 || r1 <= r0 ) return;
+		size_t page = sysconf ( _SC_PAGESIZE );
+		size_t a = size_t(r0) * m_ooc_rec, b = size_t(r1) * m_ooc_rec;
+		if ( advice == MADV_DONTNEED ) {
+			a = (a + page-1) / page * page;
+			b = b / page * page;
+		} else {
+			a = a / page * page;
+		}
+		if ( b > a ) madvise ( f.map + a, b - a, advice );
+	#endif
+}
+
+// Working set of one block in m_Birds, at least num slots
+void Flock2::OOCReserve ( int num )
+{
+	if ( num <= m_pop_cap ) return;
+	m_pop_cap = num + num/4;
+	m_Birds.DeleteAllBuffers ();
+	m_Birds.AddBuffer ( FBIRD,  "bird",		sizeof(Bird),	m_pop_cap, DT_CPU );
+	m_Birds.AddBuffer ( FGCELL, "gcell",	sizeof(uint),	m_pop_cap, DT_CPU );
+	m_Birds.AddBuffer ( FGNDX,  "gndx",		sizeof(uint),	m_pop_cap, DT_CPU );
+	m_pop_alive.assign ( m_pop_cap, 1 );
+	InitializeGrid ();				// grid holds pop_cap birds
+}
 
+// Row of a height. beyond the world bounds in the first & last rows, nan in the first
+int Flock2::OOCRow ( float y )
+{
+	float r = (y - m_ooc_ymin) / m_ooc_h;
+	if ( !(r > 0) ) return 0;
+	if ( r >= m_ooc_rows ) return m_ooc_rows - 1;
+	return int(r);
 }
 
 
@@ -783,9 +1805,9 @@ void Flock2::InitializeGrid ()
 	// Grid size - cell spacing in SPH units
 	m_Accel.grid_size = m_Accel.psmoothradius / m_Accel.grid_density;
 
-	// Grid bounds - one cell beyond fluid domain
-	m_Accel.gridMin = m_Accel.bound_min;		m_Accel.gridMin -= float(2.0*(m_Accel.grid_size / m_Accel.sim_scale ));
-	m_Accel.gridMax = m_Accel.bound_max;		m_Accel.gridMax += float(2.0*(m_Accel.grid_size / m_Accel.sim_scale ));
+	// Grid bounds - two cells beyond grid domain (world bounds, or the flock, see UpdateGridBounds)
+	m_Accel.gridMin = m_grid_lo;		m_Accel.gridMin -= float(2.0*(m_Accel.grid_size / m_Accel.sim_scale ));
+	m_Accel.gridMax = m_grid_hi;		m_Accel.gridMax += float(2.0*(m_Accel.grid_size / m_Accel.sim_scale ));
 	m_Accel.gridSize = m_Accel.gridMax - m_Accel.gridMin;
 
 	float grid_size = m_Accel.grid_size;
@@ -812,8 +1834,8 @@ void Flock2::InitializeGrid ()
 	m_Accel.gridAdjCnt = m_Accel.gridSrch * m_Accel.gridSrch * m_Accel.gridSrch;
 	m_Accel.gridScanMax = m_Accel.gridRes - Vec3I( m_Accel.gridSrch, m_Accel.gridSrch, m_Accel.gridSrch );
 
-	if ( m_Accel.gridSrch > 6 ) {
-		dbgprintf ( "ERROR: Neighbor search is n > 6. \n " );
+	if ( m_Accel.gridAdjCnt > 64 ) {											// gridAdj size
+		dbgprintf ( "ERROR: Neighbor search is n > 4. \n " );
 		exit(-1);
 	}
 
@@ -823,7 +1845,7 @@ void Flock2::InitializeGrid ()
 	int numElem2 = int ( numElem1 / blockSize ) + 1;
 	int numElem3 = int ( numElem2 / blockSize ) + 1;
 
-	int numPoints = m_Params.num_birds;
+	int numPoints = std::max( m_Params.num_birds, m_pop_cap );		// bird slots
 	int numPoints_pred = m_Params.num_predators;
 
 	int mem_usage = (m_gpu) ? DT_CPU | DT_CUMEM : DT_CPU;
@@ -837,6 +1859,7 @@ void Flock2::InitializeGrid ()
 	m_Grid.AddBuffer ( AAUXSCAN1, "scan1", sizeof(uint), numElem2, mem_usage );
 	m_Grid.AddBuffer ( AAUXARRAY2,"aux2", sizeof(uint), numElem3, mem_usage );
 	m_Grid.AddBuffer ( AAUXSCAN2, "scan2", sizeof(uint), numElem3, mem_usage );
+	m_Grid.AddBuffer ( ACELLSTAT, "cellstat", sizeof(CellStat), m_Accel.gridTotal, mem_usage );	// on gpu too (DT_CUMEM), bound to FGrid by AssignToGPU
 
 	for (int b=0; b <= AAUXSCAN2; b++)
 		m_Grid.SetBufferUsage ( b, DT_UINT );		// for debugging
@@ -848,10 +1871,97 @@ void Flock2::InitializeGrid ()
 			for (int x=0; x < m_Accel.gridSrch; x++ )
 				m_Accel.gridAdj [ cell++]  = ( y * m_Accel.gridRes.z+ z ) * m_Accel.gridRes.x +  x ;
 
+	// Cone culling lookup - for each heading octant, the corner of each adjacent cell furthest along the heading.
+	// corner in cell units, relative to min corner of the home cell. see BoxOutsideCone
+	for (int oct=0; oct < 8; oct++) {
+		cell = 0;
+		for (int y=0; y < m_Accel.gridSrch; y++ )
+			for (int z=0; z < m_Accel.gridSrch; z++ )
+				for (int x=0; x < m_Accel.gridSrch; x++ )
+					m_Accel.gridCone[oct][ cell++ ] = Vec3F( float(x - (oct & 1)), float(y - ((oct >> 1) & 1)), float(z - ((oct >> 2) & 1)) );
+	}
+
 	// Done
-	dbgprintf ( "  Accel Grid: %d, Res: %dx%dx%d\n", m_Accel.gridTotal, (int) m_Accel.gridRes.x, (int) m_Accel.gridRes.y, (int) m_Accel.gridRes.z );
+	if ( !m_autotuning && !m_ooc )
+		dbgprintf ( "  Accel Grid: %d, Res: %dx%dx%d\n", m_Accel.gridTotal, (int) m_Accel.gridRes.x, (int) m_Accel.gridRes.y, (int) m_Accel.gridRes.z );
+}
+
+
+// Track the flock with the accel grid
+// grid domain is the flock bounding box plus a margin. refit with hysteresis, only when a bird
+// leaves the domain or the domain grows to grid_shrink times the flock's volume, so the grid is
+// reallocated occasionally. falls back to the world bounds if the domain would need more cells.
+//
+void Flock2::UpdateGridBounds ()
+{
+	int numPoints = m_Params.num_birds;
+	Vec3F lo = m_Accel.bound_min;
+	Vec3F hi = m_Accel.bound_max;
+	if ( !m_grid_track || numPoints == 0 ) {
+		ResizeGrid ( lo, hi, "fixed" );			// world bounds
+		return;
+	}
+
+	// flock bounds. birds are on cpu after Advance (retrieved on gpu)
+	Vec3F bmin(1e10, 1e10, 1e10), bmax(-1e10, -1e10, -1e10);
+	Bird* b;
+	for (int i=0; i < numPoints; i++) {
+		b = (Bird*) m_Birds.GetElem( FBIRD, i );
+		if ( !m_pop_alive[i] || isnan(b->pos.x) || isnan(b->pos.y) || isnan(b->pos.z) ) continue;
+		bmin.x = std::min(bmin.x, b->pos.x);	bmax.x = std::max(bmax.x, b->pos.x);
+		bmin.y = std::min(bmin.y, b->pos.y);	bmax.y = std::max(bmax.y, b->pos.y);
+		bmin.z = std::min(bmin.z, b->pos.z);	bmax.z = std::max(bmax.z, b->pos.z);
+	}
+	if ( bmin.x > bmax.x ) return;
+
+	// hysteresis
+	float r = m_Accel.psmoothradius / m_Accel.sim_scale;
+	Vec3F ext = bmax - bmin + Vec3F(2*r, 2*r, 2*r);
+	Vec3F dom = m_grid_hi - m_grid_lo;
+	bool out = bmin.x < m_grid_lo.x || bmin.y < m_grid_lo.y || bmin.z < m_grid_lo.z || bmax.x > m_grid_hi.x || bmax.y > m_grid_hi.y || bmax.z > m_grid_hi.z;
+	bool shrink = dom.x*dom.y*dom.z > m_grid_shrink * ext.x*ext.y*ext.z;
+	if ( !out && !shrink ) return;
+
+	Vec3F pad = (bmax - bmin) * m_grid_margin + Vec3F(r, r, r);
+	lo = bmin - pad;
+	hi = bmax + pad;
+
+	// cell count, with the 2-cell border added by InitializeGrid
+	float w = (m_Accel.psmoothradius / m_Accel.grid_density) / m_Accel.sim_scale;
+	auto cells = [w] (Vec3F a, Vec3F b) {
+		return double( ceil((b.x-a.x)/w) + 4 ) * double( ceil((b.y-a.y)/w) + 4 ) * double( ceil((b.z-a.z)/w) + 4 );
+	};
+	if ( cells( lo, hi ) > cells( m_Accel.bound_min, m_Accel.bound_max ) ) {
+		lo = m_Accel.bound_min;
+		hi = m_Accel.bound_max;
+	}
+	ResizeGrid ( lo, hi, out ? "flock left grid" : "flock shrank" );
 }
 
+// Set accel grid domain, and reallocate the grid if it changed
+void Flock2::ResizeGrid ( Vec3F lo, Vec3F hi, const char* why )
+{
+	if ( lo.x == m_grid_lo.x && lo.y == m_grid_lo.y && lo.z == m_grid_lo.z && hi.x == m_grid_hi.x && hi.y == m_grid_hi.y && hi.z == m_grid_hi.z ) return;
+
+	m_grid_lo = lo;
+	m_grid_hi = hi;
+	InitializeGrid ();
+
+	#ifdef BUILD_CUDA
+		if (m_gpu) {
+			m_Grid.AssignToGPU ( "FGrid", m_Module );
+			m_Grid.UpdateGPUAccess ();
+			cuCheck ( cuMemcpyHtoD ( m_cuAccel, &m_Accel,	sizeof(Accel) ),	(char*)"ResizeGrid", (char*)"cuMemcpyHtoD", (char*)"cuAccel", DEBUG_CUDA );
+		}
+	#endif
+
+	// cells changed, restart search cost
+	ResetCellStats ();
+
+	if ( !m_autotuning && !m_ooc )
+		dbgprintf ( "Grid: frame %d, %s. bounds (%4.1f, %4.1f, %4.1f) - (%4.1f, %4.1f, %4.1f), res %dx%dx%d\n", m_frame, why,
+			lo.x, lo.y, lo.z, hi.x, hi.y, hi.z, (int) m_Accel.gridRes.x, (int) m_Accel.gridRes.y, (int) m_Accel.gridRes.z );
+}
 
 void Flock2::InsertIntoGrid ()
 {
@@ -876,6 +1986,12 @@ void Flock2::InsertIntoGrid ()
 
 	} else {
 
+		// compaction, fused with the counting sort. birds are binned at their new slots
+		if ( m_pop_dead > 0 && m_pop_compact > 0 && m_frame % m_pop_compact == 0 ) {
+			CompactPopulation ();
+			numPoints = m_Params.num_birds;
+		}
+
 		// Insert into grid
 		// Reset all grid cells to empty
 		memset( m_Grid.bufUI(AGRIDCNT),	0,	m_Accel.gridTotal*sizeof(uint));
@@ -904,7 +2020,7 @@ void Flock2::InsertIntoGrid ()
 			gc = Vec3I( int(gcf.x), int(gcf.y), int(gcf.z) );
 			gs = (gc.y * m_Accel.gridRes.z + gc.z)*m_Accel.gridRes.x + gc.x;
 
-			if ( gc.x >= 1 && gc.x <= m_Accel.gridScanMax.x && gc.y >= 1 && gc.y <= m_Accel.gridScanMax.y && gc.z >= 1 && gc.z <= m_Accel.gridScanMax.z ) {
+			if ( m_pop_alive[n] && gc.x >= 1 && gc.x <= m_Accel.gridScanMax.x && gc.y >= 1 && gc.y <= m_Accel.gridScanMax.y && gc.z >= 1 && gc.z <= m_Accel.gridScanMax.z ) {
 				*pgcell = gs;
 				*pgndx = *m_Grid.bufUI(AGRIDCNT, gs);
 				(*m_Grid.bufUI(AGRIDCNT, gs))++;
@@ -1017,8 +2133,16 @@ void Flock2::PrefixSumGrid ()
 	}
 }
 
+// frames with neighbor search logs & recall checks. none during autotune trials
+bool Flock2::NbrLogFrame ()
+{
+	return !m_autotuning && m_nbr_recall_freq > 0 && (m_frame % m_nbr_recall_freq)==0;
+}
+
 void Flock2::FindNeighbors ()
 {
+	m_cl_more.clear();
+
 	if (m_gpu) {
 		#ifdef BUILD_CUDA
 			// Find neighborhood (GPU)
@@ -1032,254 +2156,1490 @@ void Flock2::FindNeighbors ()
 		// - near_j  - id of nearest bird
 		// - ave_pos - average centroid of neighbor birds
 		// - ave_vel - average velocity of neighbor birds
+		// - cluster_nbrs - birds closer than cluster threshold (see AssignClusters)
 		//
-		float d = m_Accel.sim_scale;
-		float d2 = d * d;
-		float rd2 = (m_Accel.psmoothradius*m_Accel.psmoothradius) / d2;
-		int	nadj = (m_Accel.gridRes.z + 1)*m_Accel.gridRes.x + 1;
-		int j;
-		uint cell;
-		Vec3F posi, posj, dist;
-		Vec3F diri, dirj;
-		Vec3F cdir;
-		float dsq;
-		float nearest, nearest_fwd;
-
-		uint* grid = m_Grid.bufUI(AGRID);
-		uint* gridcnt = m_Grid.bufUI(AGRIDCNT);
-		uint* fgc = m_Grid.bufUI(FGCELL);
-
-		Bird *bi, *bj, *bk;
-
-		float birdang;
-
-		// topological distance
-		float sort_d_nbr[16];
-		int sort_j_nbr[16];
-		int sort_num = 0;
-		sort_d_nbr[0] = 1e5;
-		sort_j_nbr[0] = -1;
+		nbr_query_t q, qx;
+		CellStat* cstat = (CellStat*) m_Grid.bufUI(ACELLSTAT);
+		int numPoints = m_Params.num_birds;
 		int k, m;
 
-		max_cluster_id = -1;
-		cluster_assignment.clear();
-
-		int numPoints = m_Params.num_birds;
+		// recall of approximate search or graph walk, measured against exact search
+		bool walk = ( m_nbr_backend == NBR_WALK );
+		bool recall = ( (m_nbr_approx || walk) && NbrLogFrame() );
+		int recall_hit = 0, recall_total = 0;
+
+		// graph walk, with full grid search as backstop. not on verify (recall) frames, so they measure the walk
+		bool backstop = ( m_nbr_backstop <= 0 || m_frame - m_nbr_backstop_frame >= m_nbr_backstop || m_frame < m_nbr_backstop_frame ) && !recall;
+		if ( walk && backstop ) m_nbr_backstop_frame = m_frame;
+		int nwalk = 0;
+		if ( m_nbr_backend == NBR_KDTREE ) {
+			TracePush ( "KdBuild" );
+			KdBuild ();
+			TracePop ();
+		}
+		if ( m_nbr_backend == NBR_HGRID ) {
+			TracePush ( "HGridBuild" );
+			HGridBuild ();
+			TracePop ();
+		}
+		if ( (m_lag || m_aniso || m_autotuning) && m_stat_nbrs.size() != numPoints*NBR_MAX )
+			m_stat_nbrs.assign ( numPoints*NBR_MAX, -1 );
+		DelayRecord ();
 
-		// for each bird
-		for (int i=0; i < numPoints; i++) {
-			bi = (Bird*) m_Birds.GetElem( FBIRD, i);
-			bi->cluster_id = -1; // reset all cluster assignments
+		// independent islands as parallel tasks. exact search only
+		if ( m_nbr_islands && !walk && !m_nbr_approx && !m_nbr_temporal ) {
+			FindNeighborsIslands ();
+			return;
+		}
+		if ( walk && m_nbr_list.size() < numPoints*NBR_MAX ) {
+			m_nbr_list.assign ( numPoints*NBR_MAX, -1 );
+			m_nbr_list_next.assign ( numPoints*NBR_MAX, -1 );
+		}
+		if ( walk && m_nbr_stamp.size() < numPoints ) {
+			m_nbr_stamp.assign ( numPoints, 0 );
+			m_nbr_stamp_id = 0;
 		}
 
-		// for each bird
-		for (int i=0; i < numPoints; i++) {
+		// temporal coherence. neighbors move at most 2*max_speed*DT relative to each other per step
+		float margin = m_nbr_margin * 2.0f * m_Params.max_speed * m_Params.DT;
+		int ntight = 0, ncarry = 0, nfull = 0;
+		bool full;
+		nbr_prev_t* np;
+		if ( m_nbr_prev.size() < numPoints ) m_nbr_prev.resize ( numPoints, nbr_prev_t{0, 0, 0} );
 
-			bi = (Bird*) m_Birds.GetElem( FBIRD, i);
-			posi = bi->pos;
+		// cluster neighbors are not needed when clustering by grid cells
+		bool cl = ( m_cluster_mode == 0 );
 
-			if(bi->cluster_id == -1) { // no cluster assigned yet for this bird
-				max_cluster_id ++;
-				bi->cluster_id = max_cluster_id;
-				vector<int> new_cluster(1);
-				new_cluster.at(0) = i;
-				cluster_assignment.push_back(new_cluster);
+		// for each bird
+		for (int i=0; i < numPoints; i++) {
 
-				//printf("bird %d new cluster %d size %d \n", i, max_cluster_id, cluster_assignment.size());
-			}
-
-			// pre-compute for efficiency
-			diri = bi->vel;			diri.Normalize();
-
-			// clear current bird info
-			bi->ave_pos.Set(0,0,0);
-			bi->ave_vel.Set(0,0,0);
-			bi->near_j = -1;
-			bi->t_nbrs = 0;
-			bi->r_nbrs = 0;
-
-			nearest = rd2;
-			nearest_fwd = rd2;
-
-			sort_num = 0;
-
-			// search neighbors
-			int gc = m_Birds.bufUI(FGCELL)[i];
-			if ( gc != GRID_UNDEF ) {
-
-				gc -= nadj;
-
-				for (int c=0; c < m_Accel.gridAdjCnt; c++) {
-					cell = gc + m_Accel.gridAdj[c];
-					int clast = m_Grid.bufUI(AGRIDOFF)[cell] + m_Grid.bufUI(AGRIDCNT)[cell];
-
-					for ( int cndx = m_Grid.bufUI(AGRIDOFF)[cell]; cndx < clast; cndx++ ) {
-
-							// get next possible neighbor
-							j = m_Grid.bufUI(AGRID)[cndx];
-							if (j >= numPoints) continue;
-							if (i==j) continue;
-							bj = (Bird*) m_Birds.GetElem( FBIRD, j );
-							posj = bj->pos;
-
-							dist = posi - posj;
-							dsq = (dist.x*dist.x + dist.y*dist.y + dist.z*dist.z);
-
-							if ( dsq < m_Params.cluster_threshold_dist*m_Params.cluster_threshold_dist ) { // bird is closer than cluster threshold
-								if(bj->cluster_id == -1) { // no cluster assigned yet for neighbor bird
-									bj->cluster_id = bi->cluster_id; // put both birds in same cluster
-									cluster_assignment.at(bi->cluster_id).push_back(j);
-								}
-								if(bj->cluster_id != bi->cluster_id) { // already assigned another cluster for neighbor bird, need to merge clusters
-									int merge_from_id = bj->cluster_id;
-									int merge_to_id = bi->cluster_id;
-
-									//printf("merge bird %d (cluster %d) to bird %d (cluster %d) \n", j, merge_from_id, i, merge_to_id);
-									for(unsigned int k = 0; k < cluster_assignment.at(merge_from_id).size(); k++) {
-										int kk = cluster_assignment.at(merge_from_id).at(k);
-										//printf("     bird %d -> %d\n", kk, merge_to_id);
-										bk = (Bird*) m_Birds.GetElem( FBIRD, cluster_assignment.at(merge_from_id).at(k));
-										bk->cluster_id = merge_to_id; // put birds in same cluster
-										cluster_assignment.at(merge_to_id).push_back(cluster_assignment.at(merge_from_id).at(k));
-									}
-									cluster_assignment.at(merge_from_id).clear();
-								}
-							}
-
-							if ( dsq < rd2 ) {
-								// neighbor is within radius..
-
-								// confirm bird is within forward field-of-view
-								dirj = posj - posi; dirj.Normalize();
-								birdang = diri.Dot (dirj);
-
-								if ( birdang > m_Params.fovcos ) {
-
-									// put into topological sorted list
-									for (k = 0; dsq > sort_d_nbr[k] && k < sort_num;)
-										k++;
-
-									// only insert if bird is closer than the top N
-									if (k <= sort_num) {
-										// shift others down (insertion sort)
-										if ( k != sort_num ) {
-											for (m = sort_num-1; m >= k; m--) {
-												sort_d_nbr[m+1] = sort_d_nbr[m];
-												sort_j_nbr[m+1] = sort_j_nbr[m];
-											}
-										}
-										sort_d_nbr[k] = dsq;
-										sort_j_nbr[k] = j;
-
-										// max topological neighbors
-										if (++sort_num > m_Params.neighbors ) sort_num = m_Params.neighbors;
-									}
-
-									// count bounary neighbors
-									bi->r_nbrs++;
-
-								}
-							}
-						}
+			if ( !m_pop_alive[i] ) {
+				if ( walk ) std::fill ( &m_nbr_list_next[ i*NBR_MAX ], &m_nbr_list_next[ i*NBR_MAX ] + NBR_MAX, -1 );
+				continue;
+			}
+			// search within previous k-th neighbor distance + margin. exact for the k nearest if k are found.
+			// only r_nbrs < boundary_cnt matters (boundary bird). r_nbrs within the reduced radius is a lower bound,
+			// so reaching boundary_cnt decides it. otherwise the bird keeps r_nbrs of its last full query for nbr_refresh
+			// frames, unless that was near boundary_cnt (hysteresis), and falls back to the full radius.
+			full = true;
+			np = &m_nbr_prev[i];
+			if ( walk && !backstop && np->kdist > 0 ) {
+				// walk previous neighbors and their neighbors. r_nbrs carried from last grid search
+				FindNeighborsWalk ( i, q );
+				if ( q.sort_num == q.kmax ) {
+					q.r_nbrs = np->r_full;
+					if ( cl ) FindClusterNbrs ( i, q );
+					full = false; nwalk++;
+				}
+			}
+			if ( full && m_nbr_temporal && np->kdist > 0 ) {
+				FindNeighborsQuery ( i, q, m_nbr_approx, cl, (np->kdist + margin)*(np->kdist + margin) );
+				if ( q.sort_num == q.kmax ) {
+					if ( q.r_nbrs >= m_Params.boundary_cnt ) {
+						full = false; ntight++;
+					} else if ( m_frame - np->r_frame < m_nbr_refresh && fabs(np->r_full - m_Params.boundary_cnt) > NBR_HYST * m_Params.boundary_cnt ) {
+						q.r_nbrs = np->r_full;
+						full = false; ncarry++;
 					}
 				}
-
-			// compute nearest and average among N (~7) topological neighbors
-			for (k=0; k < sort_num; k++) {
-				bj = (Bird*) m_Birds.GetElem( FBIRD, sort_j_nbr[k] );
-				bi->ave_pos += bj->pos;
-				bi->ave_vel += bj->vel;
 			}
-			bi->near_j = sort_j_nbr[0];
+			if ( full ) {
+				FindNeighborsQuery ( i, q, m_nbr_approx, cl );
+				np->r_full = int(q.r_nbrs + 0.5f);
+				np->r_frame = m_frame;
+				nfull++;
+			}
+			if ( walk ) {
+				int* list = &m_nbr_list_next[ i*NBR_MAX ];
+				for (k=0; k < NBR_MAX; k++)
+					list[k] = (k < q.sort_num) ? q.sort_j[k] : -1;
+			}
+			SetNeighbors ( i, q );
+
+			// accumulate search cost into home cell
+			if ( m_Params.cell_stats && m_Birds.bufUI(FGCELL)[i] != GRID_UNDEF ) {
+				uint home = m_Birds.bufUI(FGCELL)[i];
+				cstat[home].cand += q.ncand;
+				cstat[home].fov_reject += q.nfov;
+				cstat[home].insert += q.nins;
+			}
 
-			bi->t_nbrs = sort_num;
-			if (sort_num > 0 ) {
-				bi->ave_pos *= (1.0f / sort_num );
-				bi->ave_vel *= (1.0f / sort_num );
+			if ( recall ) {
+				FindNeighborsBird ( i, qx, false, false );
+				for (k=0; k < qx.sort_num; k++) {
+					for (m=0; m < q.sort_num && q.sort_j[m] != qx.sort_j[k]; ) m++;
+					if ( m < q.sort_num ) recall_hit++;
+				}
+				recall_total += qx.sort_num;
 			}
+		}
+
+		if ( walk ) m_nbr_list.swap ( m_nbr_list_next );
 
+		if ( (m_nbr_temporal || walk) && NbrLogFrame() )
+			printf ( "Neighbors: frame %d, walk %d, temporal radius %d, carried r_nbrs %d, full radius %d\n", m_frame, nwalk, ntight, ncarry, nfull );
+
+		if ( recall ) {
+			m_nbr_recall = (recall_total > 0) ? float(recall_hit) / recall_total : 1.0f;
+			printf ( "Neighbors: frame %d, recall %4.3f, miss rate %4.3f (%d of %d)\n", m_frame, m_nbr_recall, 1.0f - m_nbr_recall, recall_hit, recall_total );
 		}
 	}
 }
 
-void Flock2::AssignClusters ()
+// Topological neighbor query of a single bird (CPU)
+// - exact: tests the candidates in the adjacent grid cells, except cells entirely outside
+//   the field-of-view (nbr_cull) and beyond the cluster threshold. with nbr_nearest, cells
+//   are visited nearest-first and the search ends once no remaining cell can change the result.
+// - approx: examines at most m_nbr_cand_max candidates per cell as a stratified sample,
+//   and stops once m_nbr_stop_cnt neighbors closer than m_nbr_stop_dist have been seen.
+//   r_nbrs is extrapolated by the fraction of candidates examined. cluster neighbors are then
+//   also a sample, exact clustering needs nbr_approx=0.
+// - rq2: squared search radius, if less than the full radius. r_nbrs then counts only within it.
+//
+void Flock2::FindNeighborsBird ( int i, nbr_query_t& q, bool approx, bool clusters, float rq2 )
 {
-	if (m_gpu) {
-		// assign clusters on CPU.
-		// TODO: port this to run on GPU!
+	float d = m_Accel.sim_scale;
+	float rd2 = (m_Accel.psmoothradius*m_Accel.psmoothradius) / (d*d);
+	if ( rq2 > 0 && rq2 < rd2 ) rd2 = rq2;					// reduced search radius
+	float rc2 = m_Params.cluster_threshold_dist*m_Params.cluster_threshold_dist;
+	float rs2 = m_nbr_stop_dist*m_nbr_stop_dist;
+	int	nadj = (m_Accel.gridRes.z + 1)*m_Accel.gridRes.x + 1;
+	int numPoints = m_Params.num_birds;
+	int j, k, m, cnt, step;
+	int nexam = 0, ntotal = 0, nclose = 0;
+	bool stop = false;
+	uint cell, cndx;
+	float dsq, stride, jitter;
+	Vec3F dist, dirj;
+	Vec3F cw, hmin, bmin, bmax, bd;
+	Vec3F* cone = 0;
+	Vec3F* cmin = m_Accel.gridCone[7];			// octant (-x,-y,-z) holds the min corner of each adjacent cell
+	Bird *bi, *bj;
+	float reach2 = std::max( rd2, clusters ? rc2 : 0.f );
+	float cdist[64], dc;
+	int clist[64], ncell = 0;
 
-		int j;
-		Vec3F posi, posj, dist;
-		float dsq;
-		Bird *bi, *bj, *bk;
-		int cluster_min_nbs_id = -1;
+	uint* grid = m_Grid.bufUI(AGRID);
+	uint* gridcnt = m_Grid.bufUI(AGRIDCNT);
+	uint* gridoff = m_Grid.bufUI(AGRIDOFF);
+
+	bi = (Bird*) m_Birds.GetElem( FBIRD, i);
+	q.pos = bi->pos;
+	q.dir = bi->vel;		q.dir.Normalize();
+	q.sort_num = 0;
+	q.kmax = std::min( m_Params.neighbors, NBR_MAX );
+	q.r_nbrs = 0;
+	q.cl_nbrs = clusters ? bi->cluster_nbrs : 0;
+	q.cl_cnt = 0;
+	q.cl_more.clear();
+	q.ncand = 0; q.nfov = 0; q.nins = 0;
+
+	int gc = m_Birds.bufUI(FGCELL)[i];
+	if ( gc == GRID_UNDEF ) return;
+
+	// home cell min & cell width, relative to bird
+	cw = Vec3F(1,1,1) / m_Accel.gridDelta;
+	hmin = Vec3F( float(gc % m_Accel.gridRes.x), float(gc / (m_Accel.gridRes.x*m_Accel.gridRes.z)), float((gc / m_Accel.gridRes.x) % m_Accel.gridRes.z) );
+	hmin = m_Accel.gridMin + hmin * cw - q.pos;
+	if ( m_Params.nbr_cull && m_Params.fovcos > -1 )
+		cone = m_Accel.gridCone[ (q.dir.x < 0 ? 1 : 0) | (q.dir.y < 0 ? 2 : 0) | (q.dir.z < 0 ? 4 : 0) ];
+	gc -= nadj;
+
+	// visit order. non-empty adjacent cells, nearest-first by min distance to the cell box.
+	// cells beyond both the search radius and cluster threshold are dropped.
+	for (int c=0; c < m_Accel.gridAdjCnt; c++) {
+		if ( gridcnt[ gc + m_Accel.gridAdj[c] ] == 0 ) continue;
+		bmin = hmin + cmin[c] * cw - CELL_EPS;
+		bmax = bmin + cw + 2*CELL_EPS;
+		bd.Set ( std::max(bmin.x, std::max(0.f, -bmax.x)), std::max(bmin.y, std::max(0.f, -bmax.y)), std::max(bmin.z, std::max(0.f, -bmax.z)) );
+		dc = bd.Dot(bd);
+		if ( m_nbr_nearest ) {
+			if ( dc >= reach2 ) continue;
+			for (k = ncell; k > 0 && cdist[k-1] > dc; k--) {
+				cdist[k] = cdist[k-1];
+				clist[k] = clist[k-1];
+			}
+		} else {
+			k = ncell;
+		}
+		cdist[k] = dc;
+		clist[k] = c;
+		ncell++;
+	}
 
-		int numPoints = m_Params.num_birds;
+	for (int n=0; n < ncell; n++) {
+		int c = clist[n];
+		cell = gc + m_Accel.gridAdj[c];
+		cnt = gridcnt[cell];
+		dc = cdist[n];
+
+		// early termination. remaining cells are no closer than this one, so stop once
+		// the k nearest are all closer, r_nbrs has reached boundary_cnt, and no cluster neighbors remain.
+		if ( m_nbr_nearest ) {
+			bool knn_done = dc >= rd2 || ( q.sort_num == q.kmax && (q.kmax == 0 || q.sort_d[q.kmax-1] < dc) );
+			bool bnd_done = dc >= rd2 || ( q.r_nbrs >= m_Params.boundary_cnt && q.r_nbrs > 0 );
+			bool cl_done = !q.cl_nbrs || dc >= rc2;
+			if ( knn_done && bnd_done && cl_done ) break;
+		}
 
-		max_cluster_id = -1;
-		cluster_assignment.clear();
+		// fov cone culling
+		if ( cone && (hmin + cone[c] * cw).Dot( q.dir ) < 0 ) {
+			bmin = hmin + cmin[c] * cw - CELL_EPS;
+			bmax = bmin + cw + 2*CELL_EPS;
+			if ( BoxOutsideCone ( bmin, bmax, q.dir, m_Params.fovcos ) ) {
+				// cell may still hold cluster neighbors
+				if ( !q.cl_nbrs || dc >= rc2 ) continue;
+				for (cndx = gridoff[cell]; cndx < gridoff[cell] + cnt; cndx++) {
+					j = grid[cndx];
+					if (j >= numPoints) continue;
+					dist = q.pos - ((Bird*) m_Birds.GetElem( FBIRD, j ))->pos;
+					if ( dist.Dot(dist) < rc2 ) NbrCluster ( q, j );
+				}
+				continue;
+			}
+		}
+		ntotal += cnt;
+		if ( stop ) continue;
+
+		// stratified sample, random start per bird & cell
+		step = cnt; stride = 1; jitter = 0;
+		if ( approx && m_nbr_cand_max > 0 && cnt > m_nbr_cand_max ) {
+			step = m_nbr_cand_max;
+			stride = float(cnt) / step;
+			jitter = float( ((i+1)*2654435761u ^ cell*40503u) >> 8 ) / 16777216.0f;
+		}
+		for (int s=0; s < step; s++) {
 
-		// for each bird
-		for (int i=0; i < numPoints; i++) {
-			bi = (Bird*) m_Birds.GetElem( FBIRD, i);
-			bi->cluster_id = -1; // reset all cluster assignments
+			// get next possible neighbor
+			cndx = gridoff[cell] + std::min( int((s + jitter) * stride), cnt-1 );
+			nexam++;
+			j = grid[cndx];
+			if (j >= numPoints) continue;
+			if (i==j) continue;
+			bj = (Bird*) m_Birds.GetElem( FBIRD, j );
+
+			dist = q.pos - bj->pos;
+			dsq = (dist.x*dist.x + dist.y*dist.y + dist.z*dist.z);
+
+			if ( NbrCandidate ( q, j, bj->pos, dsq, rd2, rc2, m_Params.fovcos ) && dsq < rs2 )
+				nclose++;
 		}
+		if ( approx && m_nbr_stop_cnt > 0 && nclose >= m_nbr_stop_cnt ) stop = true;
+	}
 
-		if(!m_calculate_clusters)
-			return;
+	// extrapolate boundary count to candidates not examined
+	if ( approx && nexam > 0 && nexam < ntotal )
+		q.r_nbrs *= float(ntotal) / nexam;
+}
 
-		// for each bird
-		for (int i=0; i < numPoints; i++) {
-			bi = (Bird*) m_Birds.GetElem( FBIRD, i);
+// Graph walk neighbor query of a single bird (CPU)
+// candidates are the bird's previous topological neighbors and their neighbors (2-hop walk),
+// so no grid is needed while motion is coherent. approximate:
+// - a neighbor reachable only through birds outside the previous neighborhoods is missed
+// - r_nbrs is left to the caller, cluster neighbors come from the grid (FindClusterNbrs)
+// - each candidate is tested once, birds are stamped with the query id when visited
+//
+void Flock2::FindNeighborsWalk ( int i, nbr_query_t& q )
+{
+	float d = m_Accel.sim_scale;
+	float rd2 = (m_Accel.psmoothradius*m_Accel.psmoothradius) / (d*d);
+	float rc2 = m_Params.cluster_threshold_dist*m_Params.cluster_threshold_dist;
+	int numPoints = m_Params.num_birds;
+	int j;
+	float dsq;
+	Vec3F dist;
+	Bird *bi, *bj;
+
+	bi = (Bird*) m_Birds.GetElem( FBIRD, i);
+	q.pos = bi->pos;
+	q.dir = bi->vel;		q.dir.Normalize();
+	q.sort_num = 0;
+	q.kmax = std::min( m_Params.neighbors, NBR_MAX );
+	q.r_nbrs = 0;
+	q.cl_nbrs = 0;
+	q.cl_cnt = 0;
+	q.cl_more.clear();
+	q.ncand = 0; q.nfov = 0; q.nins = 0;
+
+	int* list = &m_nbr_list[ i*NBR_MAX ];
+	uint* stamp = &m_nbr_stamp[0];
+	if ( ++m_nbr_stamp_id == 0 ) {				// wrapped
+		std::fill ( m_nbr_stamp.begin(), m_nbr_stamp.end(), 0 );
+		m_nbr_stamp_id = 1;
+	}
+	stamp[i] = m_nbr_stamp_id;
 
-			if(bi->cluster_id == -1) { // no cluster assigned yet for this bird
-				// get minimum cluster id of all neighbors
-				cluster_min_nbs_id = -1;
-				for ( int l = 0; l < bi->cluster_nbr_cnt; l++ ) { // for each neighbor
-					j = bi->cluster_nbrs[l];
-					bj = (Bird*) m_Birds.GetElem( FBIRD, j );
-					if(bj->cluster_id != -1 && (bj->cluster_id < cluster_min_nbs_id || cluster_min_nbs_id == -1))
-						cluster_min_nbs_id = bj->cluster_id;
-				}
+	// hop 1 (h=-1), then hop 2 through each previous neighbor
+	for (int h=-1; h < NBR_MAX; h++) {
+		if ( h >= 0 && list[h] < 0 ) break;
+		int* hlist = (h < 0) ? list : &m_nbr_list[ list[h]*NBR_MAX ];
+
+		for (int n=0; n < NBR_MAX && hlist[n] >= 0; n++) {
+			j = hlist[n];
+			if (j >= numPoints || !m_pop_alive[j]) continue;
+
+			// skip birds already visited
+			if ( stamp[j] == m_nbr_stamp_id ) continue;
+			stamp[j] = m_nbr_stamp_id;
+
+			bj = (Bird*) m_Birds.GetElem( FBIRD, j );
+
+			dist = q.pos - bj->pos;
+			dsq = (dist.x*dist.x + dist.y*dist.y + dist.z*dist.z);
+			NbrCandidate ( q, j, bj->pos, dsq, rd2, rc2, m_Params.fovcos );
+		}
+	}
+}
+
+// Cluster neighbors of a single bird from the grid (CPU)
+// for queries that found their topological neighbors elsewhere (graph walk).
+// same cells & candidates as FindNeighborsBird, so clusters match the grid search.
+//
+void Flock2::FindClusterNbrs ( int i, nbr_query_t& q )
+{
+	float rc2 = m_Params.cluster_threshold_dist*m_Params.cluster_threshold_dist;
+	int	nadj = (m_Accel.gridRes.z + 1)*m_Accel.gridRes.x + 1;
+	int numPoints = m_Params.num_birds;
+	Vec3F* cmin = m_Accel.gridCone[7];
+	Vec3F cw, hmin, bmin, bmax, bd, dist;
+	Bird* bi = (Bird*) m_Birds.GetElem( FBIRD, i);
+	uint cell, cndx;
+	int j;
+
+	uint* grid = m_Grid.bufUI(AGRID);
+	uint* gridcnt = m_Grid.bufUI(AGRIDCNT);
+	uint* gridoff = m_Grid.bufUI(AGRIDOFF);
+
+	q.cl_nbrs = bi->cluster_nbrs;
+	q.cl_cnt = 0;
+	q.cl_more.clear();
+
+	int gc = m_Birds.bufUI(FGCELL)[i];
+	if ( gc == GRID_UNDEF ) return;
+
+	cw = Vec3F(1,1,1) / m_Accel.gridDelta;
+	hmin = Vec3F( float(gc % m_Accel.gridRes.x), float(gc / (m_Accel.gridRes.x*m_Accel.gridRes.z)), float((gc / m_Accel.gridRes.x) % m_Accel.gridRes.z) );
+	hmin = m_Accel.gridMin + hmin * cw - bi->pos;
+	gc -= nadj;
+
+	for (int c=0; c < m_Accel.gridAdjCnt; c++) {
+		cell = gc + m_Accel.gridAdj[c];
+		if ( gridcnt[cell] == 0 ) continue;
+
+		// skip cells beyond the cluster threshold
+		bmin = hmin + cmin[c] * cw - CELL_EPS;
+		bmax = bmin + cw + 2*CELL_EPS;
+		bd.Set ( std::max(bmin.x, std::max(0.f, -bmax.x)), std::max(bmin.y, std::max(0.f, -bmax.y)), std::max(bmin.z, std::max(0.f, -bmax.z)) );
+		if ( bd.Dot(bd) >= rc2 ) continue;
+
+		for (cndx = gridoff[cell]; cndx < gridoff[cell] + gridcnt[cell]; cndx++) {
+			j = grid[cndx];
+			if (j >= numPoints || j == i) continue;
+			dist = bi->pos - ((Bird*) m_Birds.GetElem( FBIRD, j ))->pos;
+			if ( dist.Dot(dist) < rc2 ) NbrCluster ( q, j );
+		}
+	}
+}
+
+// Run fn(start, end, thread) over [0,n) in contiguous chunks, one per thread (CPU)
+// chunks 1.. run on the worker pool, which grows to m_threads-1 on demand.
+void Flock2::ParallelFor ( int n, std::function<void(int, int, int)> fn )
+{
+	int nt = std::max( 1, std::min( m_threads, n ) );
+	if ( nt == 1 || t_in_pool ) { fn ( 0, n, 0 ); return; }
+
+	while ( (int) m_pool.workers.size() < nt-1 )
+		m_pool.workers.push_back ( std::thread( &Flock2::PoolWorker, this, (int) m_pool.workers.size()+1 ) );
+	{
+		std::lock_guard<std::mutex> lk ( m_pool.lock );
+		m_pool.fn = &fn;
+		m_pool.n = n;
+		m_pool.nt = nt;
+		m_pool.left = nt-1;
+		m_pool.gen++;
+	}
+	m_pool.wake.notify_all ();
+
+	t_in_pool = true;
+	fn ( 0, int( xlong(n) / nt ), 0 );
+	t_in_pool = false;
+
+	std::unique_lock<std::mutex> lk ( m_pool.lock );
+	m_pool.done.wait ( lk, [this] { return m_pool.left == 0; } );
+}
+
+// Worker thread t of the pool, runs chunk t of each ParallelFor call (CPU)
+void Flock2::PoolWorker ( int t )
+{
+	int gen = 0, n, nt;
+	std::function<void(int, int, int)>* fn;
+	t_in_pool = true;
+
+	for (;;) {
+		{
+			std::unique_lock<std::mutex> lk ( m_pool.lock );
+			m_pool.wake.wait ( lk, [&] { return m_pool.quit || m_pool.gen != gen; } );
+			if ( m_pool.quit ) return;
+			gen = m_pool.gen;
+			fn = m_pool.fn;	n = m_pool.n;	nt = m_pool.nt;
+		}
+		if ( t >= nt ) continue;				// fewer chunks than workers
+
+		(*fn) ( int( xlong(n)*t / nt ), int( xlong(n)*(t+1) / nt ), t );
+
+		std::lock_guard<std::mutex> lk ( m_pool.lock );
+		if ( --m_pool.left == 0 ) m_pool.done.notify_one ();
+	}
+}
+
+// Build k-d tree over birds (CPU)
+// - only birds inside the grid domain are inserted, same candidates as the grid
+// - median split on the widest axis down to KD_LEAF birds, so the tree is balanced
+//   and its depth is known up front (implicit layout, see kdnode_t)
+// - top levels are split serially, the subtrees below are built in parallel
+//
+void Flock2::KdBuild ()
+{
+	int numPoints = m_Params.num_birds;
+	uint* fgc = m_Birds.bufUI(FGCELL);
+
+	m_kd_idx.clear();
+	m_kd_out.clear();
+	m_kd_pos.resize ( numPoints );
+	for (int i=0; i < numPoints; i++) {
+		m_kd_pos[i] = ((Bird*) m_Birds.GetElem( FBIRD, i ))->pos;		// by bird index during build
+		if ( fgc[i] != GRID_UNDEF ) m_kd_idx.push_back ( i );
+		else if ( m_pop_alive[i] ) m_kd_out.push_back ( i );
+	}
+	int n = m_kd_idx.size();
+
+	// depth where every range fits in a leaf
+	int depth = 0;
+	while ( ((n + (1 << depth) - 1) >> depth) > KD_LEAF ) depth++;
+	m_kd_node.assign ( (2 << depth) - 1, kdnode_t{ Vec3F(0,0,0), Vec3F(0,0,0), 0, -1, -1 } );
+	m_kd_node[0].end = n;
+	m_kd_num = numPoints;
+
+	// top levels serially, until there are enough subtrees for the threads
+	int top = 0;
+	while ( top < depth && (1 << top) < m_threads*4 ) top++;
+	for (int nd=0; nd < (1 << top) - 1; nd++)
+		if ( m_kd_node[nd].end >= m_kd_node[nd].start ) KdSplit ( nd );
+
+	int first = (1 << top) - 1;
+	ParallelFor ( 1 << top, [this, first] (int a, int b, int t) {
+		for (int nd = first + a; nd < first + b; nd++)
+			KdBuildNode ( nd );
+	} );
+
+	// positions in tree order
+	std::vector<Vec3F> pos ( n );
+	for (int k=0; k < n; k++)
+		pos[k] = m_kd_pos[ m_kd_idx[k] ];
+	m_kd_pos.swap ( pos );
+}
+
+// Bound a k-d tree node, and split it unless it is a leaf. returns true if split
+bool Flock2::KdSplit ( int nd )
+{
+	kdnode_t& node = m_kd_node[nd];
+	int* idx = m_kd_idx.data();
+	Vec3F* pos = m_kd_pos.data();
+	Vec3F p;
+
+	node.bmin = node.bmax = (node.end > node.start) ? pos[ idx[node.start] ] : Vec3F(0,0,0);
+	for (int k = node.start+1; k < node.end; k++) {
+		p = pos[ idx[k] ];
+		node.bmin.x = std::min( node.bmin.x, p.x );	node.bmax.x = std::max( node.bmax.x, p.x );
+		node.bmin.y = std::min( node.bmin.y, p.y );	node.bmax.y = std::max( node.bmax.y, p.y );
+		node.bmin.z = std::min( node.bmin.z, p.z );	node.bmax.z = std::max( node.bmax.z, p.z );
+	}
+	if ( node.end - node.start <= KD_LEAF ) {
+		node.axis = -1;
+		return false;
+	}
+	// median of the widest axis
+	p = node.bmax - node.bmin;
+	int axis = (p.x >= p.y && p.x >= p.z) ? 0 : (p.y >= p.z ? 1 : 2);
+	int mid = (node.start + node.end) / 2;
+	node.axis = axis;
+	std::nth_element ( idx + node.start, idx + mid, idx + node.end, [pos, axis] (int a, int b) {
+		return (&pos[a].x)[axis] < (&pos[b].x)[axis];
+	} );
+	m_kd_node[2*nd+1].start = node.start;	m_kd_node[2*nd+1].end = mid;
+	m_kd_node[2*nd+2].start = mid;			m_kd_node[2*nd+2].end = node.end;
+	return true;
+}
+
+void Flock2::KdBuildNode ( int nd )
+{
+	if ( m_kd_node[nd].end < m_kd_node[nd].start ) return;
+	if ( KdSplit ( nd ) ) {
+		KdBuildNode ( 2*nd+1 );
+		KdBuildNode ( 2*nd+2 );
+	}
+}
+
+// Refit k-d tree to current bird positions (CPU)
+// keeps the tree structure and only updates bounds, so queries stay exact while the
+// bounds loosen as birds move. rebuilds if the bird count changed.
+void Flock2::KdRefit ()
+{
+	if ( m_kd_node.empty() || m_kd_num != m_Params.num_birds ) {
+		KdBuild ();
+		return;
+	}
+	for (int k=0; k < m_kd_idx.size(); k++)
+		m_kd_pos[k] = ((Bird*) m_Birds.GetElem( FBIRD, m_kd_idx[k] ))->pos;
+
+	for (int nd = m_kd_node.size()-1; nd >= 0; nd--) {
+		kdnode_t& node = m_kd_node[nd];
+		if ( node.end < node.start ) continue;
+		if ( node.axis < 0 ) {
+			node.bmin = node.bmax = (node.end > node.start) ? m_kd_pos[ node.start ] : Vec3F(0,0,0);
+			for (int k = node.start+1; k < node.end; k++) {
+				Vec3F& p = m_kd_pos[k];
+				node.bmin.x = std::min( node.bmin.x, p.x );	node.bmax.x = std::max( node.bmax.x, p.x );
+				node.bmin.y = std::min( node.bmin.y, p.y );	node.bmax.y = std::max( node.bmax.y, p.y );
+				node.bmin.z = std::min( node.bmin.z, p.z );	node.bmax.z = std::max( node.bmax.z, p.z );
+			}
+		} else {
+			kdnode_t& a = m_kd_node[2*nd+1];
+			kdnode_t& b = m_kd_node[2*nd+2];
+			node.bmin = Vec3F( std::min(a.bmin.x, b.bmin.x), std::min(a.bmin.y, b.bmin.y), std::min(a.bmin.z, b.bmin.z) );
+			node.bmax = Vec3F( std::max(a.bmax.x, b.bmax.x), std::max(a.bmax.y, b.bmax.y), std::max(a.bmax.z, b.bmax.z) );
+		}
+	}
+}
 
-				if(cluster_min_nbs_id == -1) {
-					max_cluster_id ++;
-					bi->cluster_id = max_cluster_id;
-					vector<int> new_cluster(1);
-					new_cluster.at(0) = i;
-					cluster_assignment.push_back(new_cluster);
+// Neighbor query with the selected backend (CPU)
+void Flock2::FindNeighborsQuery ( int i, nbr_query_t& q, bool approx, bool clusters, float rq2 )
+{
+	if ( m_nbr_backend == NBR_KDTREE )
+		FindNeighborsKd ( i, q, clusters, rq2 );
+	else if ( m_nbr_backend == NBR_HGRID )
+		FindNeighborsHGrid ( i, q, clusters, rq2 );
+	else
+		FindNeighborsBird ( i, q, approx, clusters, rq2 );
+}
+
+// K-d tree neighbor query of a single bird (CPU)
+// exact, same results as FindNeighborsBird. nodes are visited nearest-child-first and
+// pruned with the same rules as grid cells, but the node boxes adapt to the flock, so
+// dense cores and empty space cost no more than the birds they hold.
+//
+void Flock2::FindNeighborsKd ( int i, nbr_query_t& q, bool clusters, float rq2 )
+{
+	float d = m_Accel.sim_scale;
+	float rd2 = (m_Accel.psmoothradius*m_Accel.psmoothradius) / (d*d);
+	if ( rq2 > 0 && rq2 < rd2 ) rd2 = rq2;					// reduced search radius
+	float rc2 = m_Params.cluster_threshold_dist*m_Params.cluster_threshold_dist;
+	float fovcos = m_Params.fovcos;
+	float reach2 = std::max( rd2, clusters ? rc2 : 0.f );
+	bool cull = m_Params.nbr_cull && fovcos > -1;
+	int j, nd, top = 0;
+	int stack[KD_DEPTH_MAX+1];
+	float sdist[KD_DEPTH_MAX+1], dc, dsq, d0, d1;
+	bool cl_only;
+	Vec3F dist, fwd;
+	Bird* bi;
+
+	bi = (Bird*) m_Birds.GetElem( FBIRD, i);
+	q.pos = bi->pos;
+	q.dir = bi->vel;		q.dir.Normalize();
+	q.sort_num = 0;
+	q.kmax = std::min( m_Params.neighbors, NBR_MAX );
+	q.r_nbrs = 0;
+	q.cl_nbrs = clusters ? bi->cluster_nbrs : 0;
+	q.cl_cnt = 0;
+	q.cl_more.clear();
+	q.ncand = 0; q.nfov = 0; q.nins = 0;
+
+	if ( m_Birds.bufUI(FGCELL)[i] == GRID_UNDEF || m_kd_node.empty() ) return;
+
+	stack[top] = 0;
+	sdist[top++] = BoxDist2 ( m_kd_node[0].bmin, m_kd_node[0].bmax, q.pos );
+
+	while ( top > 0 ) {
+		top--;
+		nd = stack[top];
+		dc = sdist[top];
+		if ( dc >= reach2 ) continue;
+
+		// early termination, as in FindNeighborsBird
+		bool knn_done = dc >= rd2 || (q.sort_num == q.kmax && (q.kmax == 0 || q.sort_d[q.kmax-1] < dc));
+		bool bnd_done = dc >= rd2 || (q.r_nbrs >= m_Params.boundary_cnt && q.r_nbrs > 0);
+		bool cl_done = !q.cl_nbrs || dc >= rc2;
+		if ( knn_done && bnd_done && cl_done ) continue;
+
+		kdnode_t& node = m_kd_node[nd];
+
+		// fov culling. node entirely outside the view cone only adds cluster neighbors
+		cl_only = false;
+		if ( cull ) {
+			fwd = Vec3F( q.dir.x >= 0 ? node.bmax.x : node.bmin.x, q.dir.y >= 0 ? node.bmax.y : node.bmin.y, q.dir.z >= 0 ? node.bmax.z : node.bmin.z ) - q.pos;
+			if ( fwd.Dot( q.dir ) < 0 && BoxOutsideCone ( node.bmin - q.pos - CELL_EPS, node.bmax - q.pos + CELL_EPS, q.dir, fovcos ) ) {
+				if ( cl_done ) continue;
+				cl_only = true;
+			}
+		}
+
+		if ( node.axis < 0 ) {
+			for (int k = node.start; k < node.end; k++) {
+				j = m_kd_idx[k];
+				if ( j == i ) continue;
+				dist = q.pos - m_kd_pos[k];
+				dsq = (dist.x*dist.x + dist.y*dist.y + dist.z*dist.z);
+				if ( cl_only ) {
+					if ( dsq < rc2 ) NbrCluster ( q, j );
+					continue;
 				}
-				else {
-					bi->cluster_id = cluster_min_nbs_id;
-					cluster_assignment.at(bi->cluster_id).push_back(i);
+				NbrCandidate ( q, j, m_kd_pos[k], dsq, rd2, rc2, fovcos );
+			}
+		} else {
+			// push far child first, so the near child is visited next
+			int c0 = 2*nd+1, c1 = 2*nd+2;
+			d0 = BoxDist2 ( m_kd_node[c0].bmin, m_kd_node[c0].bmax, q.pos );
+			d1 = BoxDist2 ( m_kd_node[c1].bmin, m_kd_node[c1].bmax, q.pos );
+			if ( d0 > d1 ) { std::swap( c0, c1 ); std::swap( d0, d1 ); }
+			stack[top] = c1;	sdist[top++] = d1;
+			stack[top] = c0;	sdist[top++] = d0;
+		}
+	}
+}
+
+// Build hierarchical grid (CPU)
+// level 0 is the accel grid (InsertIntoGrid, PrefixSumGrid). cells holding more than
+// hgrid_occ birds are subdivided into hgrid_sub^3 sub-cells by a counting sort, and
+// dense sub-cells again, down to hgrid_levels. dense cells are sorted in parallel.
+//
+void Flock2::HGridBuild ()
+{
+	int numPoints = m_Params.num_birds;
+	uint* grid = m_Grid.bufUI(AGRID);
+	uint* gridcnt = m_Grid.bufUI(AGRIDCNT);
+	uint* gridoff = m_Grid.bufUI(AGRIDOFF);
+	Vec3I res = m_Accel.gridRes;
+	Vec3F cw = Vec3F(1,1,1) / m_Accel.gridDelta;
+
+	m_hg_res = std::max( 2, std::min( m_hgrid_sub, HGRID_SUB_MAX ) );
+	m_hg_levels = std::max( 1, std::min( m_hgrid_levels, HGRID_LEVELS_MAX ) );
+
+	// dense cells
+	std::vector<int> dense;
+	m_hg_cell.assign ( m_Accel.gridTotal, -1 );
+	if ( m_hg_levels > 1 ) {
+		for (int c=0; c < m_Accel.gridTotal; c++)
+			if ( gridcnt[c] > m_hgrid_occ ) {
+				m_hg_cell[c] = dense.size();
+				dense.push_back ( c );
+			}
+	}
+	if ( m_hg_sub.size() < dense.size() ) m_hg_sub.resize ( dense.size() );
+
+	ParallelFor ( dense.size(), [&] (int a, int b, int t) {
+		for (int d=a; d < b; d++) {
+			int c = dense[d];
+			hgsub_t& sub = m_hg_sub[d];
+			sub.bmin = m_Accel.gridMin + Vec3F( float(c % res.x), float(c / (res.x*res.z)), float((c / res.x) % res.z) ) * cw;
+			sub.w = cw;
+			sub.idx.clear();
+			sub.pos.clear();
+			for (uint cndx = gridoff[c]; cndx < gridoff[c] + gridcnt[c]; cndx++) {
+				if ( grid[cndx] >= numPoints ) continue;
+				sub.idx.push_back ( grid[cndx] );
+				sub.pos.push_back ( ((Bird*) m_Birds.GetElem( FBIRD, grid[cndx] ))->pos );
+			}
+			sub.node.clear();
+			sub.node.push_back ( hgnode_t{ 0, (int) sub.idx.size(), -1 } );
+			HGridSplit ( sub, 0, sub.bmin, sub.w, 0 );
+		}
+	} );
+}
+
+// Counting sort of a hierarchical grid node into sub-cells (CPU)
+// sub-cell index is x fastest, then y, then z
+void Flock2::HGridSplit ( hgsub_t& sub, int nd, Vec3F bmin, Vec3F w, int level )
+{
+	int S = m_hg_res;
+	int start = sub.node[nd].start;
+	int n = sub.node[nd].cnt;
+	int cnt[64], off[64], s;
+	Vec3F sw = w / float(S);
+	Vec3F p;
+
+	sub.scell.resize ( n );
+	memset ( cnt, 0, S*S*S*sizeof(int) );
+	for (int k=0; k < n; k++) {
+		p = sub.pos[start + k] - bmin;
+		s = (std::max( 0, std::min( int(p.z / sw.z), S-1 ) ) * S + std::max( 0, std::min( int(p.y / sw.y), S-1 ) )) * S + std::max( 0, std::min( int(p.x / sw.x), S-1 ) );
+		sub.scell[k] = s;
+		cnt[s]++;
+	}
+	off[0] = 0;
+	for (s=1; s < S*S*S; s++)
+		off[s] = off[s-1] + cnt[s-1];
+
+	sub.tmp_idx.resize ( n );
+	sub.tmp_pos.resize ( n );
+	for (int k=0; k < n; k++) {
+		s = sub.scell[k];
+		sub.tmp_idx[ off[s] ] = sub.idx[start + k];
+		sub.tmp_pos[ off[s]++ ] = sub.pos[start + k];
+	}
+	memcpy ( &sub.idx[start], sub.tmp_idx.data(), n*sizeof(int) );
+	memcpy ( &sub.pos[start], sub.tmp_pos.data(), n*sizeof(Vec3F) );
+
+	// children. off[] is now the end of each sub-cell
+	int child = sub.node.size();
+	sub.node[nd].child = child;
+	for (s=0; s < S*S*S; s++)
+		sub.node.push_back ( hgnode_t{ start + off[s] - cnt[s], cnt[s], -1 } );
+
+	if ( level + 2 < m_hg_levels ) {
+		for (s=0; s < S*S*S; s++)
+			if ( cnt[s] > m_hgrid_occ )
+				HGridSplit ( sub, child + s, bmin + Vec3F( float(s % S), float((s / S) % S), float(s / (S*S)) ) * sw, sw, level+1 );
+	}
+}
+
+// Hierarchical grid neighbor query of a single bird (CPU)
+// exact, same results as FindNeighborsBird. walks the adjacent cells and the sub-cells
+// of dense cells nearest-first, with the same pruning and cone culling as grid cells,
+// so dense cores are searched at sub-cell resolution while sparse regions stay coarse.
+//
+void Flock2::FindNeighborsHGrid ( int i, nbr_query_t& q, bool clusters, float rq2 )
+{
+	float d = m_Accel.sim_scale;
+	float rd2 = (m_Accel.psmoothradius*m_Accel.psmoothradius) / (d*d);
+	if ( rq2 > 0 && rq2 < rd2 ) rd2 = rq2;					// reduced search radius
+	float rc2 = m_Params.cluster_threshold_dist*m_Params.cluster_threshold_dist;
+	float fovcos = m_Params.fovcos;
+	float reach2 = std::max( rd2, clusters ? rc2 : 0.f );
+	bool cull = m_Params.nbr_cull && fovcos > -1;
+	int	nadj = (m_Accel.gridRes.z + 1)*m_Accel.gridRes.x + 1;
+	int numPoints = m_Params.num_birds;
+	int S = m_hg_res;
+	int j, n, top = 0;
+	uint cell;
+	bool cl_only;
+	Vec3F cw, hmin, fwd, sw;
+	Bird* bi;
+
+	struct hgvisit_t { int cell, sub, node; Vec3F bmin, w; float dc; };
+	hgvisit_t stack[HGRID_STACK_MAX], v;
+	auto far_first = [] (const hgvisit_t& a, const hgvisit_t& b) { return a.dc > b.dc; };
+
+	uint* grid = m_Grid.bufUI(AGRID);
+	uint* gridcnt = m_Grid.bufUI(AGRIDCNT);
+	uint* gridoff = m_Grid.bufUI(AGRIDOFF);
+
+	bi = (Bird*) m_Birds.GetElem( FBIRD, i);
+	q.pos = bi->pos;
+	q.dir = bi->vel;		q.dir.Normalize();
+	q.sort_num = 0;
+	q.kmax = std::min( m_Params.neighbors, NBR_MAX );
+	q.r_nbrs = 0;
+	q.cl_nbrs = clusters ? bi->cluster_nbrs : 0;
+	q.cl_cnt = 0;
+	q.cl_more.clear();
+	q.ncand = 0; q.nfov = 0; q.nins = 0;
+
+	int gc = m_Birds.bufUI(FGCELL)[i];
+	if ( gc == GRID_UNDEF || m_hg_cell.size() != m_Accel.gridTotal ) return;
+
+	// adjacent cells, relative to bird. pushed far-to-near
+	cw = Vec3F(1,1,1) / m_Accel.gridDelta;
+	hmin = Vec3F( float(gc % m_Accel.gridRes.x), float(gc / (m_Accel.gridRes.x*m_Accel.gridRes.z)), float((gc / m_Accel.gridRes.x) % m_Accel.gridRes.z) );
+	hmin = m_Accel.gridMin + hmin * cw - q.pos;
+	gc -= nadj;
+	for (int c=0; c < m_Accel.gridAdjCnt; c++) {
+		cell = gc + m_Accel.gridAdj[c];
+		if ( gridcnt[cell] == 0 ) continue;
+		v.cell = cell;
+		v.sub = m_hg_cell[cell];
+		v.node = 0;
+		v.bmin = hmin + m_Accel.gridCone[7][c] * cw;
+		v.w = cw;
+		v.dc = BoxDist2 ( v.bmin, v.bmin + cw, Vec3F(0,0,0) );
+		if ( v.dc < reach2 ) stack[top++] = v;
+	}
+	std::sort ( stack, stack + top, far_first );
+
+	auto test = [&] (int j, const Vec3F& posj) {
+		if ( j == i ) return;
+		Vec3F dist = q.pos - posj;
+		float dsq = (dist.x*dist.x + dist.y*dist.y + dist.z*dist.z);
+		if ( cl_only ) {
+			if ( dsq < rc2 ) NbrCluster ( q, j );
+			return;
+		}
+		NbrCandidate ( q, j, posj, dsq, rd2, rc2, fovcos );
+	};
+
+	while ( top > 0 ) {
+		v = stack[--top];
+
+		// early termination, as in FindNeighborsBird
+		bool knn_done = v.dc >= rd2 || (q.sort_num == q.kmax && (q.kmax == 0 || q.sort_d[q.kmax-1] < v.dc));
+		bool bnd_done = v.dc >= rd2 || (q.r_nbrs >= m_Params.boundary_cnt && q.r_nbrs > 0);
+		bool cl_done = !q.cl_nbrs || v.dc >= rc2;
+		if ( knn_done && bnd_done && cl_done ) continue;
+
+		// fov culling. cell entirely outside the view cone only adds cluster neighbors
+		cl_only = false;
+		if ( cull ) {
+			fwd = v.bmin + Vec3F( q.dir.x >= 0 ? v.w.x : 0, q.dir.y >= 0 ? v.w.y : 0, q.dir.z >= 0 ? v.w.z : 0 );
+			if ( fwd.Dot( q.dir ) < 0 && BoxOutsideCone ( v.bmin - CELL_EPS, v.bmin + v.w + CELL_EPS, q.dir, fovcos ) ) {
+				if ( cl_done ) continue;
+				cl_only = true;
+			}
+		}
+
+		if ( v.sub < 0 ) {
+			// coarse cell
+			for (uint cndx = gridoff[v.cell]; cndx < gridoff[v.cell] + gridcnt[v.cell]; cndx++) {
+				j = grid[cndx];
+				if ( j >= numPoints ) continue;
+				test ( j, ((Bird*) m_Birds.GetElem( FBIRD, j ))->pos );
+			}
+			continue;
+		}
+		hgsub_t& sub = m_hg_sub[ v.sub ];
+		hgnode_t node = sub.node[ v.node ];
+		if ( node.child < 0 ) {
+			for (int k = node.start; k < node.start + node.cnt; k++)
+				test ( sub.idx[k], sub.pos[k] );
+			continue;
+		}
+		// sub-cells, pushed far-to-near
+		sw = v.w / float(S);
+		n = top;
+		for (int s=0; s < S*S*S; s++) {
+			if ( sub.node[ node.child + s ].cnt == 0 ) continue;
+			stack[top].cell = v.cell;
+			stack[top].sub = v.sub;
+			stack[top].node = node.child + s;
+			stack[top].bmin = v.bmin + Vec3F( float(s % S), float((s / S) % S), float(s / (S*S)) ) * sw;
+			stack[top].w = sw;
+			stack[top].dc = BoxDist2 ( stack[top].bmin, stack[top].bmin + sw, Vec3F(0,0,0) );
+			if ( stack[top].dc < reach2 ) top++;
+		}
+		std::sort ( stack + n, stack + top, far_first );
+	}
+}
+
+// Independent work units (CPU)
+// groups birds by their previous cluster, then merges groups whose bounds are closer than
+// the interaction reach (search radius or cluster threshold). birds in different islands
+// cannot be neighbors, so each island gets its own compact grid and is searched as
+// parallel tasks. islands merge back as soon as their bounds come within reach.
+//
+void Flock2::BuildIslands ( float reach )
+{
+	int numPoints = m_Params.num_birds;
+	uint* fgc = m_Birds.bufUI(FGCELL);
+	Bird* b;
+
+	// groups. 0 = unclustered (no cluster assigned yet, or clusters off)
+	int ng = max_cluster_id + 2;
+	std::vector<int> group ( numPoints, -1 ), parent ( ng ), gcnt ( ng, 0 ), order;
+	std::vector<Vec3F> gmin ( ng, Vec3F(1e10, 1e10, 1e10) ), gmax ( ng, Vec3F(-1e10, -1e10, -1e10) );
+	for (int i=0; i < numPoints; i++) {
+		if ( fgc[i] == GRID_UNDEF ) continue;
+		b = (Bird*) m_Birds.GetElem( FBIRD, i );
+		int g = b->cluster_id + 1;
+		if ( g < 0 || g >= ng ) g = 0;
+		group[i] = g;
+		gmin[g].x = std::min(gmin[g].x, b->pos.x);	gmax[g].x = std::max(gmax[g].x, b->pos.x);
+		gmin[g].y = std::min(gmin[g].y, b->pos.y);	gmax[g].y = std::max(gmax[g].y, b->pos.y);
+		gmin[g].z = std::min(gmin[g].z, b->pos.z);	gmax[g].z = std::max(gmax[g].z, b->pos.z);
+		gcnt[g]++;
+	}
+
+	// merge groups within reach. sweep along x, union-find over groups
+	auto root = [&parent] (int g) {
+		while ( parent[g] != g ) g = parent[g] = parent[ parent[g] ];
+		return g;
+	};
+	for (int g=0; g < ng; g++) {
+		parent[g] = g;
+		if ( gcnt[g] > 0 ) order.push_back ( g );
+	}
+	std::sort ( order.begin(), order.end(), [&gmin] (int a, int b) { return gmin[a].x < gmin[b].x; } );
+	for (int a=0; a < order.size(); a++) {
+		int ga = order[a];
+		for (int c=a+1; c < order.size() && gmin[ order[c] ].x < gmax[ga].x + reach; c++) {
+			int gb = order[c];
+			if ( gmin[gb].y < gmax[ga].y + reach && gmin[ga].y < gmax[gb].y + reach &&
+				 gmin[gb].z < gmax[ga].z + reach && gmin[ga].z < gmax[gb].z + reach )
+				parent[ root(ga) ] = root(gb);
+		}
+	}
+
+	// islands
+	std::vector<int> isl ( ng, -1 );
+	int nisl = 0;
+	for (int g : order)
+		if ( isl[ root(g) ] < 0 ) isl[ root(g) ] = nisl++;
+	if ( m_islands.size() < nisl ) m_islands.resize ( nisl );
+	m_islands_cnt = nisl;
+	for (int n=0; n < nisl; n++)
+		m_islands[n].idx.clear();
+	for (int i=0; i < numPoints; i++)
+		if ( group[i] >= 0 ) m_islands[ isl[ root(group[i]) ] ].idx.push_back ( i );
+
+	// compact grid of each island, one cell per reach. counting sort
+	ParallelFor ( nisl, [this, reach] (int a, int c, int t) {
+		for (int n=a; n < c; n++) {
+			island_t& is = m_islands[n];
+			int cnt = is.idx.size();
+			Vec3F bmin(1e10, 1e10, 1e10), bmax(-1e10, -1e10, -1e10), p;
+			is.pos.resize ( cnt );
+			for (int k=0; k < cnt; k++) {
+				p = is.pos[k] = ((Bird*) m_Birds.GetElem( FBIRD, is.idx[k] ))->pos;
+				bmin.x = std::min(bmin.x, p.x);	bmax.x = std::max(bmax.x, p.x);
+				bmin.y = std::min(bmin.y, p.y);	bmax.y = std::max(bmax.y, p.y);
+				bmin.z = std::min(bmin.z, p.z);	bmax.z = std::max(bmax.z, p.z);
+			}
+			is.bmin = bmin;
+			is.w = reach;
+			is.res = Vec3I( int((bmax.x - bmin.x) / reach) + 1, int((bmax.y - bmin.y) / reach) + 1, int((bmax.z - bmin.z) / reach) + 1 );
+			int ncell = is.res.x * is.res.y * is.res.z;
+
+			is.cell.resize ( cnt );
+			is.start.assign ( ncell + 1, 0 );
+			for (int k=0; k < cnt; k++) {
+				p = (is.pos[k] - bmin) / reach;
+				is.cell[k] = ( std::min( int(p.z), is.res.z-1 ) * is.res.y + std::min( int(p.y), is.res.y-1 ) ) * is.res.x + std::min( int(p.x), is.res.x-1 );
+				is.start[ is.cell[k] + 1 ]++;
+			}
+			for (int c=0; c < ncell; c++)
+				is.start[c+1] += is.start[c];
+
+			std::vector<int> idx ( cnt ), cell ( cnt ), off ( is.start.begin(), is.start.end()-1 );
+			std::vector<Vec3F> pos ( cnt );
+			for (int k=0; k < cnt; k++) {
+				int m = off[ is.cell[k] ]++;
+				idx[m] = is.idx[k];
+				pos[m] = is.pos[k];
+				cell[m] = is.cell[k];
+			}
+			is.idx.swap ( idx );
+			is.pos.swap ( pos );
+			is.cell.swap ( cell );
+		}
+	} );
+}
+
+// Neighbor query of bird k of an island, over the island's grid (CPU)
+// exact, same results as FindNeighborsBird without fov culling.
+void Flock2::FindNeighborsIsland ( island_t& is, int k, nbr_query_t& q )
+{
+	float d = m_Accel.sim_scale;
+	float rd2 = (m_Accel.psmoothradius*m_Accel.psmoothradius) / (d*d);
+	float rc2 = m_Params.cluster_threshold_dist*m_Params.cluster_threshold_dist;
+	float reach2 = std::max( rd2, rc2 );
+	int i = is.idx[k];
+	int c = is.cell[k];
+	int cx = c % is.res.x, cy = (c / is.res.x) % is.res.y, cz = c / (is.res.x*is.res.y);
+	Vec3F bmin, dist;
+	float dsq;
+	Bird* bi;
+
+	bi = (Bird*) m_Birds.GetElem( FBIRD, i);
+	q.pos = is.pos[k];
+	q.dir = bi->vel;		q.dir.Normalize();
+	q.sort_num = 0;
+	q.kmax = std::min( m_Params.neighbors, NBR_MAX );
+	q.r_nbrs = 0;
+	q.cl_nbrs = bi->cluster_nbrs;
+	q.cl_cnt = 0;
+	q.cl_more.clear();
+	q.ncand = 0; q.nfov = 0; q.nins = 0;
+
+	for (int z = std::max(cz-1, 0); z <= std::min(cz+1, is.res.z-1); z++)
+		for (int y = std::max(cy-1, 0); y <= std::min(cy+1, is.res.y-1); y++)
+			for (int x = std::max(cx-1, 0); x <= std::min(cx+1, is.res.x-1); x++) {
+				c = (z * is.res.y + y) * is.res.x + x;
+				if ( is.start[c] == is.start[c+1] ) continue;
+				bmin = is.bmin + Vec3F( float(x), float(y), float(z) ) * is.w;
+				if ( BoxDist2 ( bmin, bmin + is.w, q.pos ) >= reach2 ) continue;
+
+				for (int m = is.start[c]; m < is.start[c+1]; m++) {
+					if ( m == k ) continue;
+					dist = q.pos - is.pos[m];
+					dsq = (dist.x*dist.x + dist.y*dist.y + dist.z*dist.z);
+					NbrCandidate ( q, is.idx[m], is.pos[m], dsq, rd2, rc2, m_Params.fovcos );
 				}
 			}
+}
+
+// Find neighbors over independent islands, as parallel tasks (CPU)
+// large islands are split into tasks of nbr_island_chunk birds, largest first.
+void Flock2::FindNeighborsIslands ()
+{
+	int numPoints = m_Params.num_birds;
+	float d = m_Accel.sim_scale;
+	float rd2 = (m_Accel.psmoothradius*m_Accel.psmoothradius) / (d*d);
+	float rc2 = m_Params.cluster_threshold_dist*m_Params.cluster_threshold_dist;
+	uint* fgc = m_Birds.bufUI(FGCELL);
+	nbr_query_t q;
+
+	TracePush ( "BuildIslands" );
+	BuildIslands ( sqrt( std::max(rd2, rc2) ) );
+	TracePop ();
+
+	// tasks. island, first & last bird
+	struct task_t { int isl, start, end; };
+	std::vector<task_t> tasks;
+	int chunk = std::max( 1, m_nbr_island_chunk );
+	for (int n=0; n < m_islands_cnt; n++)
+		for (int k=0; k < m_islands[n].idx.size(); k += chunk)
+			tasks.push_back ( task_t{ n, k, std::min( k + chunk, (int) m_islands[n].idx.size() ) } );
+	std::sort ( tasks.begin(), tasks.end(), [] (const task_t& a, const task_t& b) { return a.end - a.start > b.end - b.start; } );
+
+	if ( NbrLogFrame() ) {
+		int largest = 0;
+		for (int n=0; n < m_islands_cnt; n++) largest = std::max( largest, (int) m_islands[n].idx.size() );
+		printf ( "Neighbors: frame %d, %d islands, largest %d birds, %d tasks\n", m_frame, m_islands_cnt, largest, (int) tasks.size() );
+	}
+
+	if ( m_nbr_prev.size() < numPoints ) m_nbr_prev.resize ( numPoints, nbr_prev_t{0, 0, 0} );
+	if ( m_Params.cell_stats ) m_island_cost.resize ( numPoints );
+
+	std::atomic<int> next ( 0 );
+	TracePush ( "IslandTasks" );
+	ParallelFor ( std::min( m_threads, (int) tasks.size() ), [&] (int a, int b, int t) {
+		nbr_query_t q;
+		for (int n = next++; n < tasks.size(); n = next++) {
+			island_t& is = m_islands[ tasks[n].isl ];
+			for (int k = tasks[n].start; k < tasks[n].end; k++) {
+				int i = is.idx[k];
+				FindNeighborsIsland ( is, k, q );
+				SetNeighbors ( i, q );
+				if ( m_Params.cell_stats ) m_island_cost[i] = Vec3I( q.ncand, q.nfov, q.nins );
+			}
+		}
+	} );
+	TracePop ();
+
+	// birds outside the grid, no neighbors
+	CellStat* cstat = (CellStat*) m_Grid.bufUI(ACELLSTAT);
+	for (int i=0; i < numPoints; i++) {
+		if ( !m_pop_alive[i] ) {
+			continue;
+		} else if ( fgc[i] == GRID_UNDEF ) {
+			FindNeighborsBird ( i, q, false, true );
+			SetNeighbors ( i, q );
+		} else if ( m_Params.cell_stats ) {
+			cstat[ fgc[i] ].cand += m_island_cost[i].x;
+			cstat[ fgc[i] ].fov_reject += m_island_cost[i].y;
+			cstat[ fgc[i] ].insert += m_island_cost[i].z;
+		}
+	}
+}
+
+// Perception delay (CPU)
+// birds react to neighbors as they were delay secs ago. rather than keep whole Birds, a ring of
+// delay/DT+1 frames holds only pos & vel, quantized to 16 bits against a per frame origin & scale
+// (12 bytes per bird per frame, mm scale precision for flocks under a km). slots are indexed by
+// bird, which on cpu is the bird id, so SetNeighbors reads a neighbor's past state with one gather.
+// neighbors are still chosen by current position. until the ring fills, the oldest frame is used.
+//
+void Flock2::DelayRecord ()
+{
+	int numPoints = m_Params.num_birds;
+	m_delay_read = -1;
+	if ( m_delay <= 0 || numPoints == 0 ) {
+		if ( !m_delay_ring.empty() ) {
+			std::vector<delay_state_t>().swap ( m_delay_ring );
+			m_delay_depth = 0;
+		}
+		return;
+	}
+	int back = std::max( 0, int( m_delay / m_Params.DT + 0.5f ) );
+	int depth = std::min( back + 1, 4096 );
+	back = depth - 1;
+	if ( depth != m_delay_depth || m_delay_ring.size() != (size_t) depth * m_pop_cap ) {
+		m_delay_ring.assign ( (size_t) depth * m_pop_cap, delay_state_t() );
+		m_delay_slot.assign ( depth, delay_frame_t() );
+		m_delay_depth = depth;
+		m_delay_frames = 0;
+	}
+	Bird* b;
+
+	// frame bounds. non-finite birds are stored as the origin
+	Vec3F bmin(1e10, 1e10, 1e10), bmax(-1e10, -1e10, -1e10);
+	float vmax = 0;
+	for (int i=0; i < numPoints; i++) {
+		b = (Bird*) m_Birds.GetElem( FBIRD, i );
+		if ( !m_pop_alive[i] || !std::isfinite( b->pos.x + b->pos.y + b->pos.z + b->vel.x + b->vel.y + b->vel.z ) ) continue;
+		bmin.x = std::min(bmin.x, b->pos.x);	bmax.x = std::max(bmax.x, b->pos.x);
+		bmin.y = std::min(bmin.y, b->pos.y);	bmax.y = std::max(bmax.y, b->pos.y);
+		bmin.z = std::min(bmin.z, b->pos.z);	bmax.z = std::max(bmax.z, b->pos.z);
+		vmax = std::max( vmax, std::max( fabs(b->vel.x), std::max( fabs(b->vel.y), fabs(b->vel.z) ) ) );
+	}
+	int cur = m_delay_frames % depth;
+	delay_frame_t& f = m_delay_slot[ cur ];
+	if ( bmin.x > bmax.x ) { bmin.Set(0,0,0); bmax.Set(0,0,0); }
+	f.origin = (bmin + bmax) * 0.5f;
+	f.pos_scale = std::max( std::max( bmax.x - bmin.x, bmax.y - bmin.y ), std::max( bmax.z - bmin.z, 1e-3f ) ) * 0.5f / 32767.0f;
+	f.vel_scale = std::max( vmax, 1e-3f ) / 32767.0f;
+
+	// quantize
+	delay_state_t* ring = &m_delay_ring[ (size_t) cur * m_pop_cap ];
+	ParallelFor ( numPoints, [&] (int a0, int a1, int t) {
+		for (int i=a0; i < a1; i++)
+			DelayQuantize ( f, (Bird*) m_Birds.GetElem( FBIRD, i ), ring[i] );
+	} );
+	m_delay_frames++;
+
+	// slot seen this frame
+	back = std::min( back, m_delay_frames - 1 );
+	m_delay_read = (cur - back + depth) % depth;
+}
+
+// Store neighbor query results in the bird (CPU)
+// - near_j, t_nbrs, r_nbrs, cluster_nbr_cnt
+// - ave_pos, ave_vel - average of the topological neighbors
+// - previous query (temporal coherence)
+void Flock2::SetNeighbors ( int i, nbr_query_t& q )
+{
+	Bird* bi = (Bird*) m_Birds.GetElem( FBIRD, i);
+	Bird* bj;
+	nbr_prev_t* np = &m_nbr_prev[i];
+
+	np->kdist = (q.sort_num == q.kmax && q.kmax > 0) ? sqrt( q.sort_d[q.kmax-1] ) : 0;
+	if ( (m_lag || m_aniso || m_autotuning) && m_stat_nbrs.size() >= (i+1)*NBR_MAX ) {
+		for (int k=0; k < NBR_MAX; k++)
+			m_stat_nbrs[ i*NBR_MAX + k ] = (k < q.sort_num) ? q.sort_j[k] : -1;
+	}
+
+	// clear current bird info
+	bi->ave_pos.Set(0,0,0);
+	bi->ave_vel.Set(0,0,0);
+	bi->near_j = (q.sort_num > 0) ? q.sort_j[0] : -1;
+	bi->t_nbrs = q.sort_num;
+	bi->r_nbrs = int(q.r_nbrs + 0.5f);
+	bi->cluster_nbr_cnt = q.cl_cnt;
+	if ( !q.cl_more.empty() ) {
+		std::lock_guard<std::mutex> lock ( m_cl_more_lock );
+		for (int j : q.cl_more)
+			m_cl_more.push_back ( std::make_pair( i, j ) );
+	}
+
+	// compute nearest and average among N (~7) topological neighbors
+	if ( m_delay_read >= 0 ) {
+		// as perceived, delay secs ago. one gather per neighbor
+		const delay_frame_t& f = m_delay_slot[ m_delay_read ];
+		const delay_state_t* ring = &m_delay_ring[ (size_t) m_delay_read * m_pop_cap ];
+		Vec3F psum(0,0,0), vsum(0,0,0);
+		for (int k=0; k < q.sort_num; k++) {
+			const delay_state_t& d = ring[ q.sort_j[k] ];
+			psum += Vec3F( d.pos[0], d.pos[1], d.pos[2] );
+			vsum += Vec3F( d.vel[0], d.vel[1], d.vel[2] );
+		}
+		bi->ave_pos = f.origin * float(q.sort_num) + psum * f.pos_scale;
+		bi->ave_vel = vsum * f.vel_scale;
+	} else {
+		for (int k=0; k < q.sort_num; k++) {
+			bj = (Bird*) m_Birds.GetElem( FBIRD, q.sort_j[k] );
+			bi->ave_pos += bj->pos;
+			bi->ave_vel += bj->vel;
+		}
+	}
+	if (q.sort_num > 0 ) {
+		bi->ave_pos *= (1.0f / q.sort_num );
+		bi->ave_vel *= (1.0f / q.sort_num );
+	}
+}
+
+void Flock2::AssignClusters ()
+{
+	// assign clusters on CPU, from cluster_nbrs found by FindNeighbors (CPU or GPU).
+	// TODO: port this to run on GPU!
+
+	int j;
+	Vec3F posi, posj, dist;
+	float dsq;
+	Bird *bi, *bj, *bk;
+	int cluster_min_nbs_id = -1;
+
+	int numPoints = m_Params.num_birds;
 
+	max_cluster_id = -1;
+	cluster_assignment.clear();
+
+	// for each bird
+	for (int i=0; i < numPoints; i++) {
+		bi = (Bird*) m_Birds.GetElem( FBIRD, i);
+		bi->cluster_id = -1; // reset all cluster assignments
+	}
+
+	if(!m_calculate_clusters)
+		return;
+
+	if ( m_cluster_mode == 1 ) {
+		AssignClustersCells ();
+		return;
+	}
+	if ( m_cluster_mode == 2 ) {
+		// read out of the dendrogram
+		std::vector<int> label;
+		BuildDendrogram ();
+		int nc = DendrogramClusters ( m_Params.cluster_threshold_dist, label );
+		cluster_assignment.resize ( nc );
+		for (int i=0; i < numPoints; i++) {
+			if ( label[i] < 0 ) continue;						// dead
+			bi = (Bird*) m_Birds.GetElem( FBIRD, i);
+			bi->cluster_id = label[i];
+			cluster_assignment[ label[i] ].push_back ( i );
+		}
+		max_cluster_id = nc - 1;
+		return;
+	}
+
+	// for each bird
+	for (int i=0; i < numPoints; i++) {
+		if ( !m_pop_alive[i] ) continue;
+		bi = (Bird*) m_Birds.GetElem( FBIRD, i);
+
+		if(bi->cluster_id == -1) { // no cluster assigned yet for this bird
+			// get minimum cluster id of all neighbors
+			cluster_min_nbs_id = -1;
 			for ( int l = 0; l < bi->cluster_nbr_cnt; l++ ) { // for each neighbor
 				j = bi->cluster_nbrs[l];
 				bj = (Bird*) m_Birds.GetElem( FBIRD, j );
+				if(bj->cluster_id != -1 && (bj->cluster_id < cluster_min_nbs_id || cluster_min_nbs_id == -1))
+					cluster_min_nbs_id = bj->cluster_id;
+			}
+
+			if(cluster_min_nbs_id == -1) {
+				max_cluster_id ++;
+				bi->cluster_id = max_cluster_id;
+				vector<int> new_cluster(1);
+				new_cluster.at(0) = i;
+				cluster_assignment.push_back(new_cluster);
+			}
+			else {
+				bi->cluster_id = cluster_min_nbs_id;
+				cluster_assignment.at(bi->cluster_id).push_back(i);
+			}
+		}
+
+		for ( int l = 0; l < bi->cluster_nbr_cnt; l++ ) { // for each neighbor
+			j = bi->cluster_nbrs[l];
+			bj = (Bird*) m_Birds.GetElem( FBIRD, j );
+
+			if(bj->cluster_id == -1) { // no cluster assigned yet for neighbor bird
+				bj->cluster_id = bi->cluster_id; // put both birds in same cluster
+				cluster_assignment.at(bi->cluster_id).push_back(j);
+			}
+			if(bj->cluster_id != bi->cluster_id) { // already assigned another cluster for neighbor bird, need to merge clusters
+				int merge_from_id = bj->cluster_id;
+				int merge_to_id = bi->cluster_id;
+
+				//printf("merge bird %d (cluster %d) to bird %d (cluster %d) \n", j, merge_from_id, i, merge_to_id);
+				for(unsigned int k = 0; k < cluster_assignment.at(merge_from_id).size(); k++) {
+					int kk = cluster_assignment.at(merge_from_id).at(k);
+					//printf("     bird %d -> %d\n", kk, merge_to_id);
+					bk = (Bird*) m_Birds.GetElem( FBIRD, cluster_assignment.at(merge_from_id).at(k));
+					bk->cluster_id = merge_to_id; // put birds in same cluster
+					cluster_assignment.at(merge_to_id).push_back(cluster_assignment.at(merge_from_id).at(k));
+				}
+				cluster_assignment.at(merge_from_id).clear();
+			}
+		}
+	}
+
+	// cluster neighbors past the per-bird array (CPU), every bird has a cluster by now
+	for (auto& pr : m_cl_more) {
+		int merge_to_id = ((Bird*) m_Birds.GetElem( FBIRD, pr.first ))->cluster_id;
+		int merge_from_id = ((Bird*) m_Birds.GetElem( FBIRD, pr.second ))->cluster_id;
+		if ( merge_from_id == merge_to_id ) continue;
+		for (int kk : cluster_assignment.at(merge_from_id)) {
+			bk = (Bird*) m_Birds.GetElem( FBIRD, kk );
+			bk->cluster_id = merge_to_id;
+			cluster_assignment.at(merge_to_id).push_back( kk );
+		}
+		cluster_assignment.at(merge_from_id).clear();
+	}
+}
+
+// Cluster by connected grid cells (CPU)
+// birds are binned into a cluster grid with cell width cluster_threshold_dist / sqrt(3), so birds
+// sharing a cell are always within the threshold and each occupied cell is one node. cells up to
+// two apart may hold birds within the threshold. a cell whose 26 neighbors are all occupied is
+// interior, and is joined to its adjacent interior cells outright. every other pair is refined,
+// joined only if some pair of their birds is within the threshold (early out). union-find is
+// lock-free (CAS on roots, larger root linked under smaller), cells are split across threads.
+// cost is O(occupied cells), plus the birds of boundary cells. without the interior shortcut
+// this is exact single linkage, the same clusters as AssignClusters.
+//
+static int ClusterFind ( std::atomic<int>* parent, int x )
+{
+	int p, gp;
+	while ( (p = parent[x].load()) != x ) {
+		gp = parent[p].load();
+		parent[x].compare_exchange_weak ( p, gp );				// path halving, a lost race is harmless
+		x = gp;
+	}
+	return x;
+}
+
+static bool ClusterUnite ( std::atomic<int>* parent, int a, int b )
+{
+	for (;;) {
+		a = ClusterFind ( parent, a );
+		b = ClusterFind ( parent, b );
+		if ( a == b ) return false;
+		if ( a < b ) std::swap ( a, b );
+		int expect = a;
+		if ( parent[a].compare_exchange_strong ( expect, b ) ) return true;		// true for the one call that linked
+	}
+}
 
-				if(bj->cluster_id == -1) { // no cluster assigned yet for neighbor bird
-					bj->cluster_id = bi->cluster_id; // put both birds in same cluster
-					cluster_assignment.at(bi->cluster_id).push_back(j);
+void Flock2::AssignClustersCells ()
+{
+	int numPoints = m_Params.num_birds;
+	float T = m_Params.cluster_threshold_dist;
+	float T2 = T * T;
+	float w = T / sqrt(3.0f);
+	Bird* b;
+
+	// flock bounds
+	Vec3F bmin(1e10, 1e10, 1e10), bmax(-1e10, -1e10, -1e10);
+	for (int i=0; i < numPoints; i++) {
+		b = (Bird*) m_Birds.GetElem( FBIRD, i );
+		if ( !m_pop_alive[i] || !std::isfinite( b->pos.x + b->pos.y + b->pos.z ) ) continue;
+		bmin.x = std::min(bmin.x, b->pos.x);	bmax.x = std::max(bmax.x, b->pos.x);
+		bmin.y = std::min(bmin.y, b->pos.y);	bmax.y = std::max(bmax.y, b->pos.y);
+		bmin.z = std::min(bmin.z, b->pos.z);	bmax.z = std::max(bmax.z, b->pos.z);
+	}
+	xlong rx = xlong( (bmax.x - bmin.x) / w ) + 1;
+	xlong ry = xlong( (bmax.y - bmin.y) / w ) + 1;
+	xlong rz = xlong( (bmax.z - bmin.z) / w ) + 1;
+
+	// sort birds by cell. occupied cells are the runs
+	std::vector< std::pair<xlong, int> > key;
+	key.reserve ( numPoints );
+	for (int i=0; i < numPoints && bmin.x <= bmax.x; i++) {
+		b = (Bird*) m_Birds.GetElem( FBIRD, i );
+		if ( !m_pop_alive[i] || !std::isfinite( b->pos.x + b->pos.y + b->pos.z ) ) continue;
+		Vec3F p = (b->pos - bmin) / w;
+		key.push_back ( std::make_pair( (xlong(p.z) * ry + xlong(p.y)) * rx + xlong(p.x), i ) );
+	}
+	std::sort ( key.begin(), key.end() );
+
+	// cell to node. dense when the flock bounds are small enough, hashed otherwise
+	bool dense = ( bmin.x <= bmax.x && rx * ry * rz <= CLUSTER_DENSE_MAX );
+	std::vector<int> start;
+	std::unordered_map<xlong, int> node;
+	if ( dense )	m_cl_dense.assign ( rx * ry * rz, -1 );
+	else			node.reserve ( key.size() );
+	for (int k=0; k < (int) key.size(); k++) {
+		if ( k > 0 && key[k].first == key[k-1].first ) continue;
+		if ( dense )	m_cl_dense[ key[k].first ] = start.size();
+		else			node[ key[k].first ] = start.size();
+		start.push_back ( k );
+	}
+	int n = start.size();
+	start.push_back ( key.size() );
+
+	std::unique_ptr< std::atomic<int>[] > parent ( new std::atomic<int>[ std::max(n, 1) ] );
+	std::vector<char> interior ( n, 0 );
+	for (int a=0; a < n; a++) parent[a] = a;
+
+	// cell coords per node
+	std::vector<Vec3I> cc ( n );
+	for (int a=0; a < n; a++) {
+		xlong k = key[ start[a] ].first;
+		cc[a] = Vec3I( int(k % rx), int((k / rx) % ry), int(k / (rx * ry)) );
+	}
+	auto cell = [&] (int a, int dx, int dy, int dz) -> int {
+		xlong x = cc[a].x + dx, y = cc[a].y + dy, z = cc[a].z + dz;
+		if ( x < 0 || x >= rx || y < 0 || y >= ry || z < 0 || z >= rz ) return -1;
+		if ( dense ) return m_cl_dense[ (z * ry + y) * rx + x ];
+		auto it = node.find ( (z * ry + y) * rx + x );
+		return ( it == node.end() ) ? -1 : it->second;
+	};
+
+	ParallelFor ( n, [&] (int a0, int a1, int t) {
+		for (int a=a0; a < a1; a++) {
+			bool in = true;
+			for (int dz=-1; in && dz <= 1; dz++)
+			for (int dy=-1; in && dy <= 1; dy++)
+			for (int dx=-1; in && dx <= 1; dx++)
+				if ( cell ( a, dx, dy, dz ) < 0 ) in = false;
+			interior[a] = in;
+		}
+	} );
+
+	// half stencil, each cell pair once
+	struct { int dx, dy, dz; xlong off; } st[62];
+	int ns = 0;
+	for (int dz=-2; dz <= 2; dz++)
+	for (int dy=-2; dy <= 2; dy++)
+	for (int dx=-2; dx <= 2; dx++)
+		if ( (dz*5 + dy)*5 + dx > 0 ) { st[ns].dx = dx; st[ns].dy = dy; st[ns].dz = dz; st[ns].off = (dz * ry + dy) * rx + dx; ns++; }
+
+	std::atomic<int> nrefine (0);
+	ParallelFor ( n, [&] (int a0, int a1, int t) {
+		Vec3F pi, d;
+		int refine = 0;
+		for (int a=a0; a < a1; a++) {
+			// away from the bounds, dense lookups need no checks
+			bool inner = dense && cc[a].x >= 2 && cc[a].x < rx-2 && cc[a].y >= 2 && cc[a].y < ry-2 && cc[a].z >= 2 && cc[a].z < rz-2;
+			xlong base = key[ start[a] ].first;
+			for (int s=0; s < ns; s++) {
+				int dx = st[s].dx, dy = st[s].dy, dz = st[s].dz;
+				int c = inner ? m_cl_dense[ base + st[s].off ] : cell ( a, dx, dy, dz );
+				if ( c < 0 ) continue;
+				if ( abs(dx) <= 1 && abs(dy) <= 1 && abs(dz) <= 1 && interior[a] && interior[c] ) {
+					ClusterUnite ( parent.get(), a, c );
+					continue;
 				}
-				if(bj->cluster_id != bi->cluster_id) { // already assigned another cluster for neighbor bird, need to merge clusters
-					int merge_from_id = bj->cluster_id;
-					int merge_to_id = bi->cluster_id;
-
-					//printf("merge bird %d (cluster %d) to bird %d (cluster %d) \n", j, merge_from_id, i, merge_to_id);
-					for(unsigned int k = 0; k < cluster_assignment.at(merge_from_id).size(); k++) {
-						int kk = cluster_assignment.at(merge_from_id).at(k);
-						//printf("     bird %d -> %d\n", kk, merge_to_id);
-						bk = (Bird*) m_Birds.GetElem( FBIRD, cluster_assignment.at(merge_from_id).at(k));
-						bk->cluster_id = merge_to_id; // put birds in same cluster
-						cluster_assignment.at(merge_to_id).push_back(cluster_assignment.at(merge_from_id).at(k));
+				if ( ClusterFind ( parent.get(), a ) == ClusterFind ( parent.get(), c ) ) continue;
+
+				// boundary. joined if any pair of birds is within threshold
+				refine++;
+				bool hit = false;
+				for (int ci = start[a]; ci < start[a+1] && !hit; ci++) {
+					pi = ((Bird*) m_Birds.GetElem( FBIRD, key[ci].second ))->pos;
+					for (int cj = start[c]; cj < start[c+1]; cj++) {
+						d = ((Bird*) m_Birds.GetElem( FBIRD, key[cj].second ))->pos - pi;
+						if ( d.Dot( d ) < T2 ) { hit = true; break; }
 					}
-					cluster_assignment.at(merge_from_id).clear();
 				}
+				if ( hit ) ClusterUnite ( parent.get(), a, c );
 			}
 		}
+		nrefine += refine;
+	} );
+
+	// label. cluster ids in cell order, then birds outside the bounds (nan) as singletons
+	std::vector<int> label ( n, -1 );
+	for (int a=0; a < n; a++) {
+		int r = ClusterFind ( parent.get(), a );
+		if ( label[r] < 0 ) {
+			label[r] = ++max_cluster_id;
+			cluster_assignment.push_back ( vector<int>() );
+		}
+		for (int ci = start[a]; ci < start[a+1]; ci++) {
+			b = (Bird*) m_Birds.GetElem( FBIRD, key[ci].second );
+			b->cluster_id = label[r];
+			cluster_assignment.at( label[r] ).push_back ( key[ci].second );
+		}
 	}
+	for (int i=0; i < numPoints; i++) {
+		b = (Bird*) m_Birds.GetElem( FBIRD, i );
+		if ( b->cluster_id != -1 || !m_pop_alive[i] ) continue;
+		b->cluster_id = ++max_cluster_id;
+		cluster_assignment.push_back ( vector<int>( 1, i ) );
+	}
+	m_cl_cells = n;
+	m_cl_refine = nrefine;
 }
 
 void Flock2::CalculateClusters ()
@@ -1301,6 +3661,30 @@ void Flock2::CalculateClusters ()
 	}
 */
 
+	// dead birds (see DespawnBird) are in no cluster
+	if ( m_pop_dead > 0 ) {
+		for (auto& c : cluster_assignment) {
+			c.erase ( std::remove_if ( c.begin(), c.end(), [this] (int i) {
+				if ( m_pop_alive[i] ) return false;
+				((Bird*) m_Birds.GetElem( FBIRD, i ))->cluster_id = -1;
+				return true;
+			} ), c.end() );
+		}
+	}
+	// drop clusters emptied by merges or by the above, renumbering the rest
+	int nc = 0;
+	for (size_t c=0; c < cluster_assignment.size(); c++) {
+		if ( cluster_assignment[c].empty() ) continue;
+		if ( nc != (int) c ) {
+			cluster_assignment[nc].swap ( cluster_assignment[c] );
+			for (int i : cluster_assignment[nc])
+				((Bird*) m_Birds.GetElem( FBIRD, i ))->cluster_id = nc;
+		}
+		nc++;
+	}
+	cluster_assignment.resize ( nc );
+	max_cluster_id = nc - 1;
+
 	cluster_histogram.clear();
 	cluster_histogram.resize(cluster_assignment.size());
 
@@ -1363,11 +3747,64 @@ void Flock2::TrackBird() {
 	int numPoints = m_Params.num_birds;
 	int numPoints_pred = m_Params.num_predators;
 
+	// k-d tree. nearest bird in view of each predator, nodes beyond the closest so far are skipped
+	if ( m_nbr_backend == NBR_KDTREE && !m_gpu ) {
+		int stack[KD_DEPTH_MAX+1], top, nd;
+		float dc;
+		KdRefit ();
+		for (int i = 0; i < numPoints_pred; i++) {
+			p = (Predator*)m_Predators.GetElem(FPREDATOR, i);
+			ppos = p->pos;
+			diri = p->vel; diri.Normalize();
+			closest = 1000;
+			top = 0;
+			stack[top++] = 0;
+			while ( top > 0 ) {
+				nd = stack[--top];
+				kdnode_t& node = m_kd_node[nd];
+				dc = BoxDist2 ( node.bmin, node.bmax, ppos );
+				if ( dc >= closest*closest ) continue;
+				if ( node.axis < 0 ) {
+					for (int k = node.start; k < node.end; k++) {
+						dist = m_kd_pos[k] - ppos;
+						disti = dist.Length();
+						dirj = dist.Normalize();
+						predang = diri.Dot(dirj);
+						if (disti < closest && predang > m_Params.fovcos_pred) {
+							bird_index = m_kd_idx[k];
+							closest = disti;
+							closest_bird = closest;
+						}
+					}
+				} else {
+					// near child on top
+					dc = (&ppos.x)[node.axis] - (&m_kd_node[2*nd+1].bmax.x)[node.axis];
+					stack[top++] = (dc > 0) ? 2*nd+1 : 2*nd+2;
+					stack[top++] = (dc > 0) ? 2*nd+2 : 2*nd+1;
+				}
+			}
+			// birds outside the tree
+			for (int j : m_kd_out) {
+				dist = ((Bird*) m_Birds.GetElem( FBIRD, j ))->pos - ppos;
+				disti = dist.Length();
+				dirj = dist.Normalize();
+				predang = diri.Dot(dirj);
+				if (disti < closest && predang > m_Params.fovcos_pred) {
+					bird_index = j;
+					closest = disti;
+					closest_bird = closest;
+				}
+			}
+		}
+		return;
+	}
+
 	for (int i = 0; i < numPoints_pred; i++) {
 		p = (Predator*)m_Predators.GetElem(FPREDATOR, i);
 		ppos = p->pos;
 		closest = 1000;
 		for (int j = 0; j < numPoints; j++) {
+			if ( !m_pop_alive[j] ) continue;
 			b = (Bird*)m_Birds.GetElem(FBIRD, j);
 			bpos = b->pos;
 			// printf("pposj = %f, %f, %f ; ", pposj.x, pposj.y, pposj.z);
@@ -1441,26 +3878,63 @@ void Flock2::DebugBird ( int id, std::string msg )
 	}
 }
 
+// bird health checks (see HealthRecover)
+// a nan or inf in any state component poisons the sum, so one finite test covers them all
+static inline bool BirdFinite ( Bird* b )
+{
+	return std::isfinite( b->pos.x + b->pos.y + b->pos.z + b->vel.x + b->vel.y + b->vel.z + b->speed
+		+ b->orient.X + b->orient.Y + b->orient.Z + b->orient.W );
+}
+
+static inline bool BirdHealthy ( Bird* b, float speed_max )
+{
+	return BirdFinite(b) && b->speed <= speed_max;
+}
+
+// Analysis output, opened on first use
+// a file that cannot be created is reported and its analysis turned off (enable = 0).
+// header writes the column names once, when the file is created. returns the file, or 0.
+//
+FILE* Flock2::OpenAnalysisFile ( FILE*& fp, const char* name, const char* mode, int& enable, std::function<void(FILE*)> header )
+{
+	if ( fp ) return fp;
+	fp = fopen ( name, mode );
+	if ( fp == 0 ) {
+		dbgprintf ( "ERROR: Unable to write %s\n", name );
+		enable = 0;
+		return 0;
+	}
+	if ( header ) header ( fp );
+	return fp;
+}
+
 void Flock2::UpdateFlockData ()
 {
 	Vec3F centroid (0,0,0);
 	float speed = 0;
 	float plift = 0, pdrag = 0;
 	float pfwd = 0, pturn=0, ptotal = 0;
+	double ecum = 0;
 	Vec3F flock_centers[MAX_FLOCKS] {{0,0,0}};
+	float flock_power[MAX_FLOCKS] {0};
+	double flock_ecum[MAX_FLOCKS] {0};
 	int order_n;
+	float speed_max = m_Params.max_speed * m_health_speed;
 
 	// compute centroid & energy of birds
+	// with health checks fused in (BirdHealthy). bad birds are skipped & recovered below
 	Bird* b;
+	m_health_bad.clear ();
 	for (int i=0; i < m_Params.num_birds; i++) {
+		if ( !m_pop_alive[i] ) continue;
 		b = (Bird*) m_Birds.GetElem( FBIRD, i);
+		if ( m_health && !BirdHealthy ( b, speed_max ) ) {
+			m_health_bad.push_back ( i );
+			continue;
+		}
 		int gc = m_Birds.bufUI(FGCELL)[i];
 		if ( gc != GRID_UNDEF ) {
-			if(isnan(b->pos.x) || isnan(b->pos.y) || isnan(b->pos.z)) {
-				printf("Warning: Position for bird %d is NaN!\n", i);
-				continue;
-			}
-			assert(!isnan(b->pos.x) && !isnan(b->pos.y) && !isnan(b->pos.z));
+			if ( isnan(b->pos.x) || isnan(b->pos.y) || isnan(b->pos.z) ) continue;
 			centroid += b->pos;
 			speed += b->speed;
 			plift += b->Plift;
@@ -1468,25 +3942,58 @@ void Flock2::UpdateFlockData ()
 			pfwd  += b->Pfwd;
 			pturn += b->Pturn;
 			ptotal += b->Ptotal;
-
-			order_n = cluster_order.at(b->cluster_id);
-			if(order_n < MAX_FLOCKS)
-				flock_centers[order_n] += b->pos;
+			ecum += b->Ecum;
+
+			if ( b->cluster_id >= 0 ) {
+				order_n = cluster_order.at(b->cluster_id);
+				if(order_n < MAX_FLOCKS) {
+					flock_centers[order_n] += b->pos;
+					flock_power[order_n] += b->Ptotal;
+					flock_ecum[order_n] += b->Ecum;
+				}
+			}
 		}
 	}
-	centroid *= (1.0f / m_Params.num_birds);
-	for (int i=0; i < MAX_FLOCKS; i++)
+	if ( m_health )
+		HealthRecover ();
+
+	float nalive = float( std::max( 1, m_Params.num_birds - m_pop_dead ) );
+	centroid *= (1.0f / nalive);
+	for (int i=0; i < MAX_FLOCKS && i < (int) cluster_histogram.size(); i++) {
 		flock_centers[i] /= cluster_histogram.at(i).bird_cnt;
+		flock_power[i] /= cluster_histogram.at(i).bird_cnt;
+		flock_ecum[i] /= cluster_histogram.at(i).bird_cnt;
+	}
 
 	m_Flock.centroid = centroid;
-	m_Flock.speed = speed / m_Params.num_birds;
-	m_Flock.Plift = plift / m_Params.num_birds;
-	m_Flock.Pdrag = pdrag / m_Params.num_birds;
-	m_Flock.Pfwd =  pfwd / m_Params.num_birds;
-	m_Flock.Pturn = pturn / m_Params.num_birds;
-	m_Flock.Ptotal = ptotal / m_Params.num_birds;
-	for (int i=0; i < MAX_FLOCKS; i++)
+	m_Flock.speed = speed / nalive;
+	m_Flock.Plift = plift / nalive;
+	m_Flock.Pdrag = pdrag / nalive;
+	m_Flock.Pfwd =  pfwd / nalive;
+	m_Flock.Pturn = pturn / nalive;
+	m_Flock.Ptotal = ptotal / nalive;
+	m_Flock.Ecum = ecum / nalive;
+	for (int i=0; i < MAX_FLOCKS; i++) {
 		m_Flock.flock_centers[i] = flock_centers[i];
+		m_Flock.flock_power[i] = flock_power[i];
+	}
+
+	// energy time series. flock averages, then ave power & energy of the largest clusters
+	if ( m_energy_out && !m_autotuning ) {
+		OpenAnalysisFile ( m_energy_outfile, "energy.csv", "wt", m_energy_out, [] (FILE* fp) {
+			fprintf ( fp, "frame, time, Plift, Pdrag, Pfwd, Pturn, Ptotal, Ecum" );
+			for (int i=0; i < MAX_FLOCKS; i++) fprintf ( fp, ", c%d_birds, c%d_Ptotal, c%d_Ecum", i, i, i );
+			fprintf ( fp, "\n" );
+		} );
+		if ( m_energy_outfile ) {
+			fprintf ( m_energy_outfile, "%d, %f, %f, %f, %f, %f, %f, %f", m_frame, m_time, m_Flock.Plift, m_Flock.Pdrag, m_Flock.Pfwd, m_Flock.Pturn, m_Flock.Ptotal, m_Flock.Ecum );
+			for (int i=0; i < MAX_FLOCKS; i++) {
+				int cnt = (i < (int) cluster_histogram.size()) ? cluster_histogram.at(i).bird_cnt : 0;
+				fprintf ( m_energy_outfile, ", %d, %f, %f", cnt, flock_power[i], flock_ecum[i] );
+			}
+			fprintf ( m_energy_outfile, "\n" );
+		}
+	}
 
 	if ( m_frame > m_start_frame ) {
 		if ( m_frame % 8 == 0 ) {
@@ -1496,14 +4003,91 @@ void Flock2::UpdateFlockData ()
 		}
 	}
 
-	if ( m_gpu ) {
-		#ifdef BUILD_CUDA
-			// transfer flock data to GPU, eg. centroid
-			cuCheck ( cuMemcpyHtoD ( m_cuFlock, &m_Flock, sizeof(Flock) ),	(char*)"Flock", (char*)"cuMemcpyHtoD", (char*)"cuFlock", DEBUG_CUDA );
+	if ( m_gpu ) {
+		#ifdef BUILD_CUDA
+			TracePush ( "Commit" );
+			// transfer flock data to GPU, eg. centroid
+			cuCheck ( cuMemcpyHtoD ( m_cuFlock, &m_Flock, sizeof(Flock) ),	(char*)"Flock", (char*)"cuMemcpyHtoD", (char*)"cuFlock", DEBUG_CUDA );
+
+			// transfer predators to GPU
+			m_Predators.CommitAll ();
+			TracePop ();
+		#endif
+	}
+}
+
+// Numerical health (recovery)
+// birds found bad in the UpdateFlockData reduction (nan/inf state or impossible speed) are
+// quarantined there, then re-seeded here from their neighbors' state so they do not poison
+// neighbors through ave_pos & ave_vel next frame. one summary log line per health_log frames.
+//
+static inline bool Vec3Finite ( const Vec3F& v )
+{
+	return std::isfinite( v.x + v.y + v.z );
+}
+
+void Flock2::HealthRecover ()
+{
+	int numPoints = m_Params.num_birds;
+	float speed_max = m_Params.max_speed * m_health_speed;
+	Bird *b, *bj;
+	Vec3F pos, vel, dir;
+	int j;
+
+	m_health_cnt[0] = m_health_cnt[1] = m_health_cnt[2] = 0;
+
+	for (int i : m_health_bad) {
+		b = (Bird*) m_Birds.GetElem( FBIRD, i );
+
+		// classify
+		if ( !BirdFinite ( b ) ) {
+			bool nan = isnan(b->pos.x) || isnan(b->pos.y) || isnan(b->pos.z) || isnan(b->vel.x) || isnan(b->vel.y) || isnan(b->vel.z)
+				|| isnan(b->speed) || isnan(b->orient.X) || isnan(b->orient.Y) || isnan(b->orient.Z) || isnan(b->orient.W);
+			m_health_cnt[ nan ? 0 : 1 ]++;
+		} else {
+			m_health_cnt[2]++;
+		}
+
+		// donor. the nearest neighbor, else the next healthy bird
+		j = b->near_j;
+		if ( j < 0 || j >= numPoints || j == i || !m_pop_alive[j] || !BirdHealthy( (Bird*) m_Birds.GetElem( FBIRD, j ), speed_max ) ) {
+			for (j = (i+1) % numPoints; j != i; j = (j+1) % numPoints)
+				if ( m_pop_alive[j] && BirdHealthy( (Bird*) m_Birds.GetElem( FBIRD, j ), speed_max ) ) break;
+			if ( j == i ) continue;					// nothing healthy to copy
+		}
+		bj = (Bird*) m_Birds.GetElem( FBIRD, j );
+
+		// re-seed from the neighborhood average when it is sane, else trail the donor
+		vel = ( b->t_nbrs > 0 && Vec3Finite(b->ave_vel) && b->ave_vel.Length() > 0.001 ) ? b->ave_vel : bj->vel;
+		dir = vel;	dir.Normalize();
+		pos = ( b->t_nbrs > 0 && Vec3Finite(b->ave_pos) ) ? b->ave_pos : bj->pos - dir;
+		b->speed = std::min( std::max( bj->speed, m_Params.min_speed ), m_Params.max_speed );
+		b->pos = pos;
+		b->vel = dir * b->speed;
+		b->accel.Set(0,0,0);
+		b->ang_accel.Set(0,0,0);
+		b->target = bj->target;
+		b->power = bj->power;
+		b->pitch_adv = 0;
+		b->orient = bj->orient;
+		b->Plift = 0; b->Pdrag = 0; b->Pfwd = 0; b->Pturn = 0; b->Ptotal = 0;
+		if ( !std::isfinite(b->Ecum) ) b->Ecum = 0;
+		m_health_sum[3]++;
+	}
+	for (int k=0; k < 3; k++)
+		m_health_sum[k] += m_health_cnt[k];
+
+	#ifdef BUILD_CUDA
+		if ( m_gpu && !m_health_bad.empty() ) m_Birds.Commit ( FBIRD );
+	#endif
 
-			// transfer predators to GPU
-			m_Predators.CommitAll ();
-		#endif
+	// rate limited summary
+	int bad = m_health_sum[0] + m_health_sum[1] + m_health_sum[2];
+	if ( bad > 0 && m_frame - m_health_frame >= m_health_log && !m_autotuning ) {
+		dbgprintf ( "health: frame %d, %d bad since frame %d (%d nan, %d inf, %d speed), %d re-seeded\n",
+			m_frame, bad, std::max(m_health_frame, 0), m_health_sum[0], m_health_sum[1], m_health_sum[2], m_health_sum[3] );
+		memset ( m_health_sum, 0, sizeof(m_health_sum) );
+		m_health_frame = m_frame;
 	}
 }
 
@@ -1548,18 +4132,509 @@ bool fit( double& A, double& B, double& C, points_t const& pnts )
 	return true;
 }
 
+static std::string HostName ()
+{
+	char host[256] = "node";
+	#ifdef _WIN32
+		if ( getenv("COMPUTERNAME") ) strncpy ( host, getenv("COMPUTERNAME"), 255 );
+	#else
+		if ( gethostname ( host, 255 ) != 0 && getenv("HOSTNAME") ) strncpy ( host, getenv("HOSTNAME"), 255 );
+		host[255] = '\0';
+	#endif
+	return host;
+}
+
+// Job queue (sweeps over a shared filesystem)
+// a queue is a directory any number of workers can mount:
+//   jobs/<name>.job     - spec, one 'param: value' per line as in scene files, plus 'frames' and 'seed'
+//   claims/<name>.claim - the lock. created with O_EXCL holding the owner, so only one worker claims a job.
+//                         never rewritten, only renamed away (stolen or released)
+//   claims/<name>.<worker>.beat - heartbeat, a counter only the owner writes (temp then rename)
+//   results/<name>.csv  - written to a temp name, then renamed, so readers never see partial results
+//   results/<name>.failed - job could not run (unreadable spec, unwritable result). not retried
+// a claim whose owner's heartbeat has not changed for queue_lease secs, timed on the observer's own
+// clock so node clocks need not agree, is stale: the lock is renamed away (atomic, one stealer wins)
+// and the job is claimed again. owners check the lock is still theirs on each heartbeat and before
+// publishing, and release it by renaming it away too, putting back a lock that turns out not to be theirs.
+// run with -q <dir>. workers exit when every job has a result or has failed.
+//
+static std::vector<std::string> QueueList ( std::string dir, std::string ext )
+{
+	std::vector<std::string> names;
+	#ifdef _WIN32
+		struct _finddata_t fd;
+		intptr_t h = _findfirst ( (dir + "/*" + ext).c_str(), &fd );
+		if ( h != -1 ) {
+			do { names.push_back ( std::string(fd.name).substr( 0, strlen(fd.name) - ext.length() ) ); } while ( _findnext ( h, &fd ) == 0 );
+			_findclose ( h );
+		}
+	#else
+		DIR* d = opendir ( dir.c_str() );
+		if ( d ) {
+			struct dirent* e;
+			while ( (e = readdir(d)) != 0 ) {
+				std::string n = e->d_name;
+				if ( n.length() > ext.length() && n.compare ( n.length() - ext.length(), ext.length(), ext ) == 0 )
+					names.push_back ( n.substr( 0, n.length() - ext.length() ) );
+			}
+			closedir ( d );
+		}
+	#endif
+	std::sort ( names.begin(), names.end() );
+	return names;
+}
+
+static bool QueueExists ( std::string fname )
+{
+	struct stat st;
+	return stat ( fname.c_str(), &st ) == 0;
+}
+
+static std::string QueueRead ( std::string fname )
+{
+	char buf[512] = {0};
+	FILE* fp = fopen ( fname.c_str(), "rt" );
+	if ( fp == 0 ) return "";
+	size_t n = fread ( buf, 1, sizeof(buf)-1, fp );
+	buf[n] = '\0';
+	fclose ( fp );
+	return buf;
+}
+
+// rename. replace an existing target, else fail if it exists
+static bool QueueMove ( std::string from, std::string to, bool replace )
+{
+	#ifdef _WIN32
+		return MoveFileExA ( from.c_str(), to.c_str(), replace ? MOVEFILE_REPLACE_EXISTING : 0 ) != 0;
+	#else
+		if ( replace ) return rename ( from.c_str(), to.c_str() ) == 0;
+		if ( link ( from.c_str(), to.c_str() ) != 0 ) return false;		// exclusive, unlike rename
+		unlink ( from.c_str() );
+		return true;
+	#endif
+}
+
+static void QueueMkdir ( std::string dir )
+{
+	#ifdef _WIN32
+		_mkdir ( dir.c_str() );
+	#else
+		mkdir ( dir.c_str(), 0775 );
+	#endif
+}
+
+// claim a job. exclusive create, so exactly one worker succeeds
+bool Flock2::QueueClaim ( std::string name )
+{
+	std::string fname = m_queue_dir + "/claims/" + name + ".claim";
+	std::string owner = m_queue_worker + "\n";
+	#ifdef _WIN32
+		int fd = _open ( fname.c_str(), _O_CREAT | _O_EXCL | _O_WRONLY, _S_IREAD | _S_IWRITE );
+		if ( fd < 0 ) return false;
+		bool ok = _write ( fd, owner.c_str(), (unsigned) owner.length() ) == (int) owner.length();
+		_close ( fd );
+	#else
+		int fd = open ( fname.c_str(), O_CREAT | O_EXCL | O_WRONLY, 0664 );
+		if ( fd < 0 ) return false;
+		bool ok = write ( fd, owner.c_str(), owner.length() ) == (ssize_t) owner.length();
+		close ( fd );
+	#endif
+	if ( !ok ) {
+		remove ( fname.c_str() );
+		return false;
+	}
+	m_queue_beat = 0;
+	return QueueRenew ( name );
+}
+
+// owner of a claim. empty if none, or not yet written
+std::string Flock2::QueueOwner ( std::string name )
+{
+	return strTrim ( QueueRead ( m_queue_dir + "/claims/" + name + ".claim" ) );
+}
+
+// heartbeat. false if the claim was lost (stolen as stale)
+bool Flock2::QueueRenew ( std::string name )
+{
+	if ( QueueOwner ( name ) != m_queue_worker ) return false;
+
+	// only this worker writes its beat file, so a late write cannot touch another owner's claim
+	std::string beat = m_queue_dir + "/claims/" + name + "." + m_queue_worker + ".beat";
+	std::string tmp = beat + ".tmp";
+	FILE* fp = fopen ( tmp.c_str(), "wt" );
+	if ( fp == 0 ) return false;
+	fprintf ( fp, "%d\n", ++m_queue_beat );
+	fclose ( fp );
+	if ( !QueueMove ( tmp, beat, true ) ) {
+		remove ( tmp.c_str() );
+		return false;
+	}
+	return true;
+}
+
+// take the lock away from owner: rename it (atomic, one worker wins), then confirm it was owner's.
+// a lock re-claimed by someone else in between is put back. false if not taken
+bool Flock2::QueueTake ( std::string name, std::string owner )
+{
+	std::string fname = m_queue_dir + "/claims/" + name + ".claim";
+	std::string taken = fname + ".taken." + m_queue_worker;
+	if ( !QueueMove ( fname, taken, true ) ) return false;
+	if ( strTrim ( QueueRead ( taken ) ) != owner ) {
+		if ( !QueueMove ( taken, fname, false ) ) remove ( taken.c_str() );		// a newer claim exists, this one is void
+		return false;
+	}
+	remove ( taken.c_str() );
+	remove ( (m_queue_dir + "/claims/" + name + "." + owner + ".beat").c_str() );
+	return true;
+}
+
+// stale claim. owner's heartbeat unchanged for a full lease, as seen by this worker
+bool Flock2::QueueStale ( std::string name )
+{
+	std::string owner = QueueOwner ( name );
+	std::string cur = owner + " " + strTrim ( QueueRead ( m_queue_dir + "/claims/" + name + "." + owner + ".beat" ) );
+	double now = std::chrono::duration<double>( std::chrono::steady_clock::now().time_since_epoch() ).count();
+
+	auto it = m_queue_seen.find ( name );
+	if ( it == m_queue_seen.end() || it->second.first != cur ) {
+		m_queue_seen[ name ] = std::make_pair ( cur, now );
+		return false;
+	}
+	if ( now - it->second.second < m_queue_lease ) return false;
+
+	// steal. only the lock is renamed, never written
+	m_queue_seen.erase ( it );
+	if ( !QueueTake ( name, owner ) ) return false;
+	printf ( "queue: %s, lease expired (%s), requeued\n", name.c_str(), cur.c_str() );
+	return true;
+}
+
+// mark a claimed job failed, and release the claim
+void Flock2::QueueFail ( std::string name, std::string why )
+{
+	if ( QueueOwner ( name ) != m_queue_worker ) {
+		printf ( "queue: %s, claim lost, failure (%s) not recorded\n", name.c_str(), why.c_str() );
+		return;
+	}
+	FILE* fp = fopen ( (m_queue_dir + "/results/" + name + ".failed").c_str(), "wt" );
+	if ( fp ) {
+		fprintf ( fp, "%s %s\n", m_queue_worker.c_str(), why.c_str() );
+		fclose ( fp );
+	}
+	QueueTake ( name, m_queue_worker );
+	printf ( "queue: %s, failed, %s\n", name.c_str(), why.c_str() );
+}
+
+// run a claimed job. true if its result was published
+bool Flock2::QueueRunJob ( std::string name, ParamMap_t& defaults, std::vector<char>& values, Params& params, int seed )
+{
+	// restore defaults, so jobs do not leak params into each other
+	size_t off = 0;
+	for (auto& it : defaults) {
+		size_t sz = (it.second.dt == 'v') ? sizeof(Vec3F) : 4;
+		memcpy ( it.second.ptr, &values[off], sz );
+		off += sz;
+	}
+	m_Params = params;
+	m_seed = seed;
+
+	// read spec
+	int frames = 1000;
+	char buf[2048];
+	std::string lin, param, value;
+	float val = 0;
+	Vec3F vec;
+	FILE* fp = fopen ( (m_queue_dir + "/jobs/" + name + ".job").c_str(), "rt" );
+	if ( fp == 0 ) {
+		QueueFail ( name, "unable to read job" );
+		return false;
+	}
+	while ( fgets ( buf, 2048, fp ) ) {
+		lin = strLTrim ( buf );
+		if ( lin.empty() || lin[0] == '#' ) continue;
+		if ( !strSplitLeft ( lin, ":", param, value ) ) continue;
+		param = strTrim ( param );
+		if ( value[0] == '<' )	vec = strToVec3 ( value, ',' );
+		else					val = strToF ( value );
+		if ( param.compare("frames") == 0 )		frames = int(val);
+		else if ( param.compare("seed") == 0 )	m_seed = int(val);
+		else SetParam ( param, val, vec );
+	}
+	fclose ( fp );
+
+	// run
+	printf ( "queue: %s, claimed by %s, %d birds, %d frames\n", name.c_str(), m_queue_worker.c_str(), m_Params.num_birds, frames );
+	m_rnd.seed ( m_seed );
+	Reset ( m_Params.num_birds, m_Params.num_predators );
+
+	auto t0 = std::chrono::steady_clock::now();
+	auto tbeat = t0;
+	for (int f=0; f < frames; f++) {
+		Run ();
+		auto t = std::chrono::steady_clock::now();
+		if ( std::chrono::duration<double>( t - tbeat ).count() > m_queue_lease * 0.25 ) {
+			tbeat = t;
+			if ( !QueueRenew ( name ) ) {
+				printf ( "queue: %s, claim lost at frame %d, abandoned\n", name.c_str(), f );
+				return false;
+			}
+		}
+	}
+	double msec = std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - t0 ).count();
+
+	// publish result. temp file then rename, never partial
+	int largest = cluster_histogram.empty() ? 0 : cluster_histogram[0].bird_cnt;
+	std::string res = m_queue_dir + "/results/" + name + ".csv";
+	std::string tmp = res + ".tmp." + m_queue_worker;
+	fp = fopen ( tmp.c_str(), "wt" );
+	if ( fp == 0 ) {
+		dbgprintf ( "ERROR: Unable to write %s\n", tmp.c_str() );
+		QueueFail ( name, "unable to write result" );
+		return false;
+	}
+	fprintf ( fp, "job, worker, seed, birds, frames, time, msec, speed, Plift, Pdrag, Pfwd, Pturn, Ptotal, Ecum, clusters, largest, cx, cy, cz\n" );
+	fprintf ( fp, "%s, %s, %d, %d, %d, %f, %f, %f, %f, %f, %f, %f, %f, %f, %d, %d, %f, %f, %f\n", name.c_str(), m_queue_worker.c_str(), m_seed,
+		m_Params.num_birds, frames, m_time, msec, m_Flock.speed, m_Flock.Plift, m_Flock.Pdrag, m_Flock.Pfwd, m_Flock.Pturn, m_Flock.Ptotal, m_Flock.Ecum,
+		(int) cluster_histogram.size(), largest, m_Flock.centroid.x, m_Flock.centroid.y, m_Flock.centroid.z );
+	fclose ( fp );
+
+	// still the owner. a lease can expire during a long frame, then the new owner publishes
+	if ( !QueueRenew ( name ) ) {
+		remove ( tmp.c_str() );
+		printf ( "queue: %s, claim lost before publishing, result dropped\n", name.c_str() );
+		return false;
+	}
+	if ( !QueueMove ( tmp, res, true ) ) {
+		remove ( tmp.c_str() );
+		dbgprintf ( "ERROR: Unable to write %s\n", res.c_str() );
+		QueueFail ( name, "unable to write result" );
+		return false;
+	}
+	QueueTake ( name, m_queue_worker );
+	printf ( "queue: %s, done in %.1f sec\n", name.c_str(), msec / 1000.0 );
+	return true;
+}
+
+void Flock2::RunQueue ()
+{
+	#ifdef _WIN32
+		m_queue_worker = HostName() + "-" + std::to_string( _getpid() );
+	#else
+		m_queue_worker = HostName() + "-" + std::to_string( getpid() );
+	#endif
+
+	QueueMkdir ( m_queue_dir + "/claims" );
+	QueueMkdir ( m_queue_dir + "/results" );
+
+	// snapshot params, restored before each job
+	ParamMap_t defaults = m_ParamMap;
+	std::vector<char> values;
+	for (auto& it : defaults) {
+		size_t sz = (it.second.dt == 'v') ? sizeof(Vec3F) : 4;
+		values.insert ( values.end(), it.second.ptr, it.second.ptr + sz );
+	}
+	Params params = m_Params;
+	int seed = m_seed;
+	m_queue_seen.clear ();
+
+	printf ( "queue: %s, worker %s\n", m_queue_dir.c_str(), m_queue_worker.c_str() );
+	int done = 0;
+	for (;;) {
+		std::vector<std::string> jobs = QueueList ( m_queue_dir + "/jobs", ".job" );
+		int pending = 0;
+		bool ran = false;
+		for (auto& name : jobs) {
+			if ( QueueExists ( m_queue_dir + "/results/" + name + ".csv" ) ) continue;
+			if ( QueueExists ( m_queue_dir + "/results/" + name + ".failed" ) ) continue;
+			pending++;
+			if ( QueueExists ( m_queue_dir + "/claims/" + name + ".claim" ) && !QueueStale ( name ) ) continue;
+			if ( !QueueClaim ( name ) ) continue;
+			if ( QueueRunJob ( name, defaults, values, params, seed ) ) done++;
+			ran = true;
+			break;													// rescan, others may have finished jobs
+		}
+		if ( pending == 0 ) break;
+		if ( !ran )
+			std::this_thread::sleep_for ( std::chrono::milliseconds( int(m_queue_poll * 1000) ) );
+	}
+	printf ( "queue: %s, worker %s ran %d jobs, queue empty\n", m_queue_dir.c_str(), m_queue_worker.c_str(), done );
+}
+
+// Autotune (perf knobs)
+// at Reset, times short runs of the initial flock over the cpu perf knobs: threads, neighbor
+// backend, temporal search & its margin (skin) and islands. cluster_mode is not a knob, it
+// changes the clusters reported. nor is the accel grid cell size, the adjacent cell window
+// assumes cells one neighbor radius wide. knobs are tuned one at a time (coordinate descent),
+// each kept at its fastest value that still passes the regression checks against an exact run
+// (grid search, no temporal, no islands): at most autotune_tol of birds with a different
+// topological neighbor list, and the cluster count within autotune_ctol. a change must be 3%
+// faster to be taken, so timing noise does not flip knobs.
+// the choice is cached in autotune.cache per host & scene hash (all other params and the seed),
+// and logged. only knobs are read back from the cache. trials run with m_autotuning set, which
+// turns off every output & log in Run, and keeps the neighbor lists for the checks.
+//
+#define AUTOTUNE_CACHE	"autotune.cache"
+
+void Flock2::Autotune ( const Mersenne& rnd0 )
+{
+	if ( m_gpu || m_Params.num_birds == 0 ) return;				// knobs are cpu
+
+	int nb = m_Params.num_birds, np = m_Params.num_predators;
+	int hw = std::max( 1, (int) std::thread::hardware_concurrency() );
+	struct knob_t { const char* name; std::vector<float> vals; };
+	std::vector<knob_t> knobs = {
+		{ "threads",		{} },
+		{ "nbr_backend",	{ NBR_GRID, NBR_KDTREE, NBR_HGRID, NBR_WALK } },
+		{ "nbr_temporal",	{ 0, 1 } },
+		{ "nbr_margin",		{ 1, 2 } },
+		{ "nbr_islands",	{ 0, 1 } },
+	};
+	for (int t=1; t < hw; t *= 2) knobs[0].vals.push_back ( t );
+	knobs[0].vals.push_back ( hw );
+
+	auto get = [&] (const char* name) -> float {
+		ParamPtr& p = m_ParamMap[ name ];
+		return (p.dt == 'i') ? float( *((int*) p.ptr) ) : *((float*) p.ptr);
+	};
+	auto set = [&] (const char* name, float v) { SetParam ( name, v, Vec3F(0,0,0) ); };
+	auto config = [&] () {
+		std::string c;
+		for (auto& k : knobs) { char buf[64]; sprintf ( buf, "%s%s=%g", c.empty() ? "" : " ", k.name, get( k.name ) ); c += buf; }
+		return c;
+	};
+
+	// scene hash. every param but the knobs (fnv-1a)
+	uint64_t hash = 14695981039346656037ULL;
+	auto mix = [&] (const char* p, size_t sz) { for (size_t i=0; i < sz; i++) { hash ^= uchar(p[i]); hash *= 1099511628211ULL; } };
+	for (auto& it : m_ParamMap) {
+		if ( it.first.compare ( 0, 8, "autotune" ) == 0 ) continue;
+		bool knob = false;
+		for (auto& k : knobs) if ( it.first == k.name ) knob = true;
+		if ( knob ) continue;
+		mix ( it.first.c_str(), it.first.length() );
+		mix ( it.second.ptr, (it.second.dt == 'v') ? sizeof(Vec3F) : 4 );
+	}
+	mix ( (const char*) &m_seed, sizeof(m_seed) );
+	std::string host = HostName ();
+
+	// cached. last entry wins
+	char buf[1024], hname[256];
+	unsigned long long h;
+	if ( m_autotune == 1 ) {
+		std::string found;
+		FILE* fp = fopen ( AUTOTUNE_CACHE, "rt" );
+		if ( fp ) {
+			while ( fgets ( buf, 1024, fp ) ) {
+				if ( buf[0] == '#' || sscanf ( buf, "%255s %llx", hname, &h ) != 2 ) continue;
+				if ( host == hname && h == hash ) found = buf;
+			}
+			fclose ( fp );
+		}
+		if ( !found.empty() ) {
+			std::string lin = found, word, name, value;
+			strSplitLeft ( lin, " ", word, lin );						// host
+			strSplitLeft ( lin, " ", word, lin );						// hash
+			while ( !lin.empty() ) {
+				if ( !strSplitLeft ( lin, " ", word, lin ) ) { word = strTrim(lin); lin = ""; }
+				if ( !strSplitLeft ( word, "=", name, value ) ) continue;
+				for (auto& k : knobs) if ( name == k.name ) set ( name.c_str(), strToF(value) );
+			}
+			printf ( "autotune: %s %016llx, cached: %s\n", host.c_str(), (unsigned long long) hash, config().c_str() );
+			return;
+		}
+	}
+
+	// trials run with m_autotuning set, so Run writes no outputs or logs (see Run)
+	int frames = std::max( 2, m_autotune_frames );
+	std::vector<int> ref_nbrs, nbrs;
+	int ref_clusters = 0, clusters = 0;
+
+	// msec per frame. first frame is not timed, it fills caches
+	auto trial = [&] (std::vector<int>& nbr, int& nc) -> float {
+		m_rnd = rnd0;
+		Reset ( nb, np );
+		Run ();
+		auto t0 = std::chrono::steady_clock::now();
+		for (int f=1; f < frames; f++) Run ();
+		float msec = std::chrono::duration<float, std::milli>( std::chrono::steady_clock::now() - t0 ).count() / (frames-1);
+		nbr = m_stat_nbrs;											// topological neighbors, NBR_MAX per bird
+		nc = (int) cluster_histogram.size();
+		return msec;
+	};
+	auto pass = [&] () -> bool {
+		int diff = 0, n = std::min( nbrs.size(), ref_nbrs.size() ) / NBR_MAX;
+		for (int i=0; i < n; i++)
+			if ( !std::equal ( &nbrs[ i*NBR_MAX ], &nbrs[ i*NBR_MAX ] + NBR_MAX, &ref_nbrs[ i*NBR_MAX ] ) ) diff++;
+		diff += abs( int(nbrs.size() - ref_nbrs.size()) ) / NBR_MAX;
+		return diff <= m_autotune_tol * nb && abs( clusters - ref_clusters ) <= m_autotune_ctol * ref_clusters;
+	};
+
+	// exact reference
+	std::vector<float> cur;
+	for (auto& k : knobs) cur.push_back ( get( k.name ) );
+	set ( "nbr_backend", NBR_GRID );	set ( "nbr_temporal", 0 );	set ( "nbr_islands", 0 );
+	trial ( ref_nbrs, ref_clusters );
+
+	// from the current knobs
+	for (size_t k=0; k < knobs.size(); k++) set ( knobs[k].name, cur[k] );
+	float base = trial ( nbrs, clusters );
+	float best = base;
+	dbgprintf ( "autotune: %s, %.2f ms%s\n", config().c_str(), base, pass() ? "" : ", outside tolerance" );
+
+	for (auto& k : knobs) {
+		if ( std::string(k.name) == "nbr_margin" && get( "nbr_temporal" ) == 0 ) continue;
+		float keep = get( k.name ), orig = keep;
+		for (float v : k.vals) {
+			if ( v == keep || v == orig ) continue;
+			set ( k.name, v );
+			float msec = trial ( nbrs, clusters );
+			bool ok = pass ();
+			dbgprintf ( "autotune: %s, %.2f ms%s\n", config().c_str(), msec, ok ? "" : ", outside tolerance" );
+			if ( ok && msec < best * 0.97f ) { best = msec; keep = v; }
+			set ( k.name, keep );
+		}
+		set ( k.name, keep );
+	}
+
+	if ( !m_lag && !m_aniso ) std::vector<int>().swap ( m_stat_nbrs );
+
+	// cache & log
+	FILE* fp = fopen ( AUTOTUNE_CACHE, "at" );
+	if ( fp ) {
+		fseek ( fp, 0, SEEK_END );
+		if ( ftell ( fp ) == 0 ) fprintf ( fp, "# host hash knobs msec\n" );
+		fprintf ( fp, "%s %016llx %s msec=%.3f\n", host.c_str(), (unsigned long long) hash, config().c_str(), best );
+		fclose ( fp );
+	} else {
+		dbgprintf ( "ERROR: Unable to write %s\n", AUTOTUNE_CACHE );
+	}
+	printf ( "autotune: %s %016llx, %s, %.2f ms/frame (was %.2f)\n", host.c_str(), (unsigned long long) hash, config().c_str(), best, base );
+}
+
 void Flock2::StartNextRun ()
 {
 	// record the last run
 	// printf ( "run, num_run, val, #bird, #peaks, peak_ave, g0_min,g0_max, g1_min,g1_max, g2_min,g2_max, g3_min,g3_max\n" );
 	#ifdef USE_FFTW
 		if (m_run >= 0) {
+			TracePush ( "OutputRuns" );
 		  fprintf ( m_runs_outfile, "%d,%d,%f, %d,%d,%f, %f, %f,%f, %f,%f, %f,%f, %f,%f\n", m_run, m_num_run, m_val.z, m_Params.num_birds, m_peak_cnt, m_peak_ave, m_peak_max,
 			  m_freq_gmin[0],m_freq_gmax[0], m_freq_gmin[1],m_freq_gmax[1], m_freq_gmin[2],m_freq_gmax[2], m_freq_gmin[3],m_freq_gmax[3] );
 
+			// per flock
+			for (auto& it : m_flock_spec) {
+				flock_spec_t& fs = it.second;
+				if ( fs.frames == 0 ) continue;
+				fprintf ( m_flocks_outfile, "%d,%f, %d,%d,%d,%f, %f, %f,%f,%f,%f\n", m_run, m_val.z, it.first, fs.birds, fs.peak_cnt, fs.peak_ave, fs.peak_max,
+					fs.grp[0] / fs.frames, fs.grp[1] / fs.frames, fs.grp[2] / fs.frames, fs.grp[3] / fs.frames );
+			}
+
 			// close & reopen to save
 			fclose ( m_runs_outfile );
 			m_runs_outfile = fopen ( "output.csv", "a" );
+			fclose ( m_flocks_outfile );
+			m_flocks_outfile = fopen ( "output_flocks.csv", "a" );
+			TracePop ();
 		}
 	#endif
 
@@ -1573,6 +4648,13 @@ void Flock2::StartNextRun ()
 
 	//m_Params.align_amt = m_val.z;
 
+	// restart lag analysis, its turn history is of the previous run's birds
+	if ( m_lag_outfile ) {
+		fclose ( m_lag_outfile );
+		m_lag_outfile = 0;
+	}
+	m_lag_turn.clear();
+
 	// reset simulation
 	Reset ( m_Params.num_birds, m_Params.num_predators );
 
@@ -1612,6 +4694,14 @@ void Flock2::OutputFFTW ( int frame )
 		for (int f=0; f < N; f++) {
 			fmag[f] = 0;
 		}
+		if ( xi == 0 ) {
+			m_bird_flock.clear ();
+			m_flock_spec.clear ();
+			m_flock_next = 0;
+		}
+		UpdateStableFlocks ();
+		for (auto& it : m_flock_spec)
+			if ( it.second.birds > 0 ) it.second.fmag.assign ( N/2, 0 );
 
 		// Build sample matrix
 		// x-axis = time
@@ -1620,6 +4710,7 @@ void Flock2::OutputFFTW ( int frame )
 		double* s = m_samples + xi;									// for a given time x (column)
 		float ave = 0;
 		for (int i=0; i < m_Params.num_birds; i++) {
+			if ( !m_pop_alive[i] ) continue;
 			b = (Bird*) m_Birds.GetElem( FBIRD, i );
 			y = b->id;
 			ang_accel = b->ang_accel.Length();				// sample from angular acceleration
@@ -1641,12 +4732,14 @@ void Flock2::OutputFFTW ( int frame )
 				// execute fftw
 				fftw_execute ( m_fftw_plan );
 
-				// accumulate freq magnitudes
+				// accumulate freq magnitudes, total and for the bird's flock
+				double* ffmag = ( y < (int) m_bird_flock.size() && m_bird_flock[y] >= 0 ) ? m_flock_spec[ m_bird_flock[y] ].fmag.data() : 0;
 				for (int f=0; f < N/2; f++) {
 					fr = m_fftw_out[f][0] * 2.0/N;			// real part
 					fi = m_fftw_out[f][1] * 2.0/N;			// imaginary part
 					fm = fr*fr + fi*fi;									// magnitude of given freq
 					fmag[f] += fm;
+					if ( ffmag ) ffmag[f] += fm;
 				}
 			}
 		}
@@ -1694,6 +4787,25 @@ void Flock2::OutputFFTW ( int frame )
 			energy = energy * e_amp / (N/256.0f);
 			m_fftw_energy [ xf ] = energy;
 
+			// per flock energy & frequency groups, as above. current flocks only
+			for (auto& it : m_flock_spec) {
+				flock_spec_t& fs = it.second;
+				if ( fs.birds == 0 ) continue;
+				float fe = 0, fg[4] = {0, 0, 0, 0};
+				for (int f=1; f < N/2; f++) {
+					v = fmax(0, fmin( 1, 0.01f * 10. * log(fs.fmag[f] + 1e-6) / log(10) ));
+					v = v*v * f_amp;
+					if (f < N/4) fe += v;
+					for (int g=0; g < 4; g++)
+						if ( (g/4.0)*(N/2) < f && f < ((g+1)/4.0)*(N/2) ) fg[g] += v;
+				}
+				if ( (int) fs.energy.size() <= xf ) fs.energy.resize ( xf+1, 0 );
+				fs.energy[xf] = fe * e_amp / (N/256.0f);
+				for (int g=0; g < 4; g++)
+					fs.grp[g] += fg[g] * 0.5 / (N/256.0f);
+				fs.frames++;
+			}
+
 			// plot weighted ave. frequency
 			Vec4F clrgrp[4];
 			clrgrp[0] = Vec4F(1,0,0,1);			//  low f, red
@@ -1782,38 +4894,646 @@ void Flock2::OutputFFTW ( int frame )
 				}
 				printf ( "peaks: %d, ave: %f, max: %f\n", m_peak_cnt, m_peak_ave, m_peak_max );
 
-				// measure min/max frequency groups
-				for (int g=0; g < 4; g++) {
-					m_freq_gmin[g] = m_freq_grp[1][g];
-					m_freq_gmax[g] = m_freq_grp[1][g];
-					for (int j = 1; j <= xi; j++) {
-						if ( m_freq_grp[j][g] < m_freq_gmin[g] ) m_freq_gmin[g] = m_freq_grp[j][g];
-						if ( m_freq_grp[j][g] > m_freq_gmax[g] ) m_freq_gmax[g] = m_freq_grp[j][g];
-					}
+				// per flock peaks & mean frequency group energy
+				for (auto& it : m_flock_spec) {
+					flock_spec_t& fs = it.second;
+					if ( fs.birds == 0 || fs.frames == 0 ) continue;
+					FlockPeaks ( fs, xf );
+					printf ( "  flock %d: %d birds, peaks: %d, ave: %f, max: %f, groups: %f %f %f %f\n", it.first, fs.birds, fs.peak_cnt, fs.peak_ave, fs.peak_max,
+						fs.grp[0] / fs.frames, fs.grp[1] / fs.frames, fs.grp[2] / fs.frames, fs.grp[3] / fs.frames );
+				}
+
+				// measure min/max frequency groups
+				for (int g=0; g < 4; g++) {
+					m_freq_gmin[g] = m_freq_grp[1][g];
+					m_freq_gmax[g] = m_freq_grp[1][g];
+					for (int j = 1; j <= xi; j++) {
+						if ( m_freq_grp[j][g] < m_freq_gmin[g] ) m_freq_gmin[g] = m_freq_grp[j][g];
+						if ( m_freq_grp[j][g] > m_freq_gmax[g] ) m_freq_gmax[g] = m_freq_grp[j][g];
+					}
+				}
+
+				//m_lines.push_back ( Vec4F(0, PLOT_RESY-m_freq_gmin[0]*400, xf, PLOT_RESY-m_freq_gmin[0]*400 ) );
+				//m_lines.push_back ( Vec4F(0, PLOT_RESY-m_freq_gmax[0]*400, xf, PLOT_RESY-m_freq_gmax[0]*400 ) );
+			}
+		}
+
+		// plot samples
+		s = m_samples + (N/2)*SAMPLES + x;
+		for (y = N/2; y < N; y++) {
+			v = (*s) * 0.05f / 5.f;
+			c = m_plot[0].GetPixel ( x, y);
+			c += Vec4F(v, v, v, 1);
+			m_plot[0].SetPixel ( x, y, c );
+			s += SAMPLES;
+		}
+
+		if ( xi % xdiv == 0 ) {
+			m_plot[0].Commit ();
+		}
+
+  #endif
+}
+
+
+// Eigen decomposition of a symmetric 3x3 matrix (cyclic Jacobi)
+// eigenvalues in val, eigenvectors in the columns of vec
+static void Jacobi3 ( double a[3][3], double val[3], double vec[3][3] )
+{
+	for (int r=0; r < 3; r++)
+		for (int c=0; c < 3; c++) vec[r][c] = (r==c) ? 1 : 0;
+
+	for (int sweep=0; sweep < 16; sweep++) {
+		double off = a[0][1]*a[0][1] + a[0][2]*a[0][2] + a[1][2]*a[1][2];
+		if ( off < 1e-20 ) break;
+		for (int p=0; p < 2; p++)
+		for (int q=p+1; q < 3; q++) {
+			if ( fabs(a[p][q]) < 1e-20 ) continue;
+			double theta = (a[q][q] - a[p][p]) / (2.0 * a[p][q]);
+			double t = ((theta >= 0) ? 1.0 : -1.0) / (fabs(theta) + sqrt( theta*theta + 1.0 ));
+			double c = 1.0 / sqrt( t*t + 1.0 ), s = t * c;
+			for (int k=0; k < 3; k++) {						// a = a J
+				double akp = a[k][p], akq = a[k][q];
+				a[k][p] = c*akp - s*akq;	a[k][q] = s*akp + c*akq;
+			}
+			for (int k=0; k < 3; k++) {						// a = J^T a
+				double apk = a[p][k], aqk = a[q][k];
+				a[p][k] = c*apk - s*aqk;	a[q][k] = s*apk + c*aqk;
+			}
+			for (int k=0; k < 3; k++) {						// vec = vec J
+				double vkp = vec[k][p], vkq = vec[k][q];
+				vec[k][p] = c*vkp - s*vkq;	vec[k][q] = s*vkp + c*vkq;
+			}
+		}
+	}
+	for (int k=0; k < 3; k++) val[k] = a[k][k];
+}
+
+// Neighbor anisotropy (analysis)
+// as in the starling field studies (Ballerini et al. 2008). for each bird, unit vectors to its
+// first aniso_k neighbors, from FindNeighbors (no extra search), are taken into the bird's body
+// frame (x fwd, y up, z right) and summed into a projection tensor M = <u u^T>. the eigenvector
+// of M with the smallest eigenvalue is the direction with the fewest neighbors. the anisotropy
+// factor is its squared forward component: 1/3 when isotropic, 1 when neighbors avoid the front
+// & back. also histograms neighbor bearing & elevation. writes aniso.csv, one row per frame.
+//
+void Flock2::NeighborAnisotropy ()
+{
+	int numPoints = m_Params.num_birds;
+	int kmax = std::max( 1, std::min( m_aniso_k, NBR_MAX ) );
+	int nb = std::max( 4, std::min( m_aniso_bins, 360 ) );
+	Bird *b, *bj;
+	Vec3F fwd, up, right, u;
+	int nbr[NBR_MAX], nnbr;
+	double M[3][3] = {{0,0,0},{0,0,0},{0,0,0}};
+	double bx, by, bz;
+	int cnt = 0;
+
+	m_aniso_bearing.assign ( nb, 0 );
+	m_aniso_elev.assign ( nb, 0 );
+
+	for (int i=0; i < numPoints; i++) {
+		if ( !m_pop_alive[i] ) continue;
+		b = (Bird*) m_Birds.GetElem( FBIRD, i );
+
+		// topological neighbors (cpu), or the nearest (gpu)
+		nnbr = 0;
+		if ( !m_gpu && m_stat_nbrs.size() >= (i+1)*NBR_MAX ) {
+			for (int k=0; k < kmax && m_stat_nbrs[ i*NBR_MAX + k ] >= 0; k++)
+				nbr[nnbr++] = m_stat_nbrs[ i*NBR_MAX + k ];
+		} else if ( b->near_j >= 0 && b->near_j < numPoints ) {
+			nbr[nnbr++] = b->near_j;
+		}
+		if ( nnbr == 0 ) continue;
+
+		fwd = Vec3F(1,0,0) * b->orient;			// X-axis is body forward
+		up  = Vec3F(0,1,0) * b->orient;			// Y-axis is body up
+		right = Vec3F(0,0,1) * b->orient;		// Z-axis is body right
+
+		for (int k=0; k < nnbr; k++) {
+			bj = (Bird*) m_Birds.GetElem( FBIRD, nbr[k] );
+			u = bj->pos - b->pos;
+			if ( u.Length() < 1e-6f ) continue;
+			u.Normalize();
+			bx = u.Dot( fwd );	by = u.Dot( up );	bz = u.Dot( right );
+			M[0][0] += bx*bx;	M[0][1] += bx*by;	M[0][2] += bx*bz;
+			M[1][1] += by*by;	M[1][2] += by*bz;	M[2][2] += bz*bz;
+
+			// bearing -180/180 from forward, clockwise seen from above. elevation -90/90
+			float bearing = atan2( bz, bx ) * RADtoDEG;
+			float elev = asin( std::max( -1.0, std::min( by, 1.0 ) ) ) * RADtoDEG;
+			m_aniso_bearing[ std::min( int( (bearing + 180.0f) * nb / 360.0f ), nb-1 ) ]++;
+			m_aniso_elev[ std::min( int( (elev + 90.0f) * nb / 180.0f ), nb-1 ) ]++;
+			cnt++;
+		}
+	}
+	if ( cnt == 0 ) return;
+	M[1][0] = M[0][1];	M[2][0] = M[0][2];	M[2][1] = M[1][2];
+	for (int r=0; r < 3; r++)
+		for (int c=0; c < 3; c++) M[r][c] /= cnt;
+
+	double val[3], vec[3][3];
+	Jacobi3 ( M, val, vec );
+	int kmin = 0;
+	for (int k=1; k < 3; k++) if ( val[k] < val[kmin] ) kmin = k;
+	m_aniso_gamma = float( vec[0][kmin] * vec[0][kmin] );
+	for (int k=0; k < 3; k++) m_aniso_eig[k] = float( val[k] );
+	m_aniso_dir.Set ( float(vec[0][kmin]), float(vec[1][kmin]), float(vec[2][kmin]) );
+
+	if ( !OpenAnalysisFile ( m_aniso_outfile, "aniso.csv", "wt", m_aniso, [nb] (FILE* fp) {
+		fprintf ( fp, "frame, pairs, gamma, wx, wy, wz, eig0, eig1, eig2" );
+		for (int k=0; k < nb; k++) fprintf ( fp, ", b%d", k );
+		for (int k=0; k < nb; k++) fprintf ( fp, ", e%d", k );
+		fprintf ( fp, "\n" );
+	} ) ) return;
+	fprintf ( m_aniso_outfile, "%d, %d, %f, %f, %f, %f, %f, %f, %f", m_frame, cnt, m_aniso_gamma, m_aniso_dir.x, m_aniso_dir.y, m_aniso_dir.z,
+		m_aniso_eig[0], m_aniso_eig[1], m_aniso_eig[2] );
+	for (int k=0; k < nb; k++) fprintf ( m_aniso_outfile, ", %d", m_aniso_bearing[k] );
+	for (int k=0; k < nb; k++) fprintf ( m_aniso_outfile, ", %d", m_aniso_elev[k] );
+	fprintf ( m_aniso_outfile, "\n" );
+}
+
+// Near pairs on the accel grid (CPU)
+// calls fn(i, j, dsq, thread) for each pair of birds closer than rmax, once per pair (half stencil).
+// cells are split across threads. birds have moved since they were binned, so cells are reached
+// and culled with a pad of one step. a bird farther than rmax from a padded cell skips that cell.
+//
+template<class F> void Flock2::ForNearPairs ( float rmax, F fn )
+{
+	float r2max = rmax * rmax;
+	Vec3I res = m_Accel.gridRes;
+	int numCells = m_Accel.gridTotal;
+
+	if ( m_gpu ) {
+		#ifdef BUILD_CUDA
+			m_Grid.Retrieve ( AGRID );
+			m_Grid.Retrieve ( AGRIDCNT );
+			m_Grid.Retrieve ( AGRIDOFF );
+			cuCtxSynchronize ();
+		#endif
+	}
+	uint* grid = m_Grid.bufUI(AGRID);
+	uint* gridcnt = m_Grid.bufUI(AGRIDCNT);
+	uint* gridoff = m_Grid.bufUI(AGRIDOFF);
+
+	float pad = 2.0f * m_Params.max_speed * m_Params.DT;
+	Vec3I R ( int(ceil( (rmax+pad) * m_Accel.gridDelta.x )), int(ceil( (rmax+pad) * m_Accel.gridDelta.y )), int(ceil( (rmax+pad) * m_Accel.gridDelta.z )) );
+	Vec3F cw = Vec3F(1,1,1) / m_Accel.gridDelta;
+	float reach2 = (rmax + pad) * (rmax + pad);
+
+	ParallelFor ( numCells, [&] (int a, int b, int t) {
+		Vec3F pi, d, gap, lo, hi;
+		float dsq;
+		int i;
+		for (int c=a; c < b; c++) {
+			if ( gridcnt[c] == 0 ) continue;
+			int cx = c % res.x, cz = (c / res.x) % res.z, cy = c / (res.x * res.z);
+			for (int y = std::max( cy-R.y, 0 ); y <= std::min( cy+R.y, res.y-1 ); y++)
+			for (int z = std::max( cz-R.z, 0 ); z <= std::min( cz+R.z, res.z-1 ); z++)
+			for (int x = std::max( cx-R.x, 0 ); x <= std::min( cx+R.x, res.x-1 ); x++) {
+				int nc = (y * res.z + z) * res.x + x;
+				if ( nc < c || gridcnt[nc] == 0 ) continue;					// each cell pair once
+				gap.Set ( std::max( abs(x-cx)-1, 0 ) * cw.x, std::max( abs(y-cy)-1, 0 ) * cw.y, std::max( abs(z-cz)-1, 0 ) * cw.z );
+				if ( gap.Dot( gap ) >= reach2 ) continue;					// cells too far apart
+				lo = m_Accel.gridMin + Vec3F( float(x), float(y), float(z) ) * cw - Vec3F(pad, pad, pad);
+				hi = lo + cw + Vec3F(2*pad, 2*pad, 2*pad);
+				for (uint ci = gridoff[c]; ci < gridoff[c] + gridcnt[c]; ci++) {
+					i = grid[ci];
+					pi = ((Bird*) m_Birds.GetElem( FBIRD, i ))->pos;
+					gap.Set ( std::max( std::max( lo.x - pi.x, pi.x - hi.x ), 0.0f ), std::max( std::max( lo.y - pi.y, pi.y - hi.y ), 0.0f ), std::max( std::max( lo.z - pi.z, pi.z - hi.z ), 0.0f ) );
+					if ( gap.Dot( gap ) >= r2max ) continue;				// bird too far from the padded cell
+					for (uint cj = (nc == c) ? ci+1 : gridoff[nc]; cj < gridoff[nc] + gridcnt[nc]; cj++) {
+						d = ((Bird*) m_Birds.GetElem( FBIRD, grid[cj] ))->pos - pi;
+						dsq = d.Dot( d );
+						if ( dsq < r2max ) fn ( i, (int) grid[cj], dsq, t );
+					}
+				}
+			}
+		}
+	} );
+}
+
+// Single linkage dendrogram (CPU)
+// the minimum spanning tree over near pairs is the single linkage dendrogram: the clusters at
+// threshold T are the components of the MST links shorter than T. pairs within dendro_rmax are
+// found on the accel grid (ForNearPairs), then the MST is built by Boruvka:
+// each round every component picks its shortest outgoing link (atomic min on length & link index,
+// so ties are consistent and the picks form a forest), the picks are united in parallel, and
+// links inside one component are dropped. at most log2(N) rounds. links are kept shortest first,
+// so any threshold below dendro_rmax reads out in O(N) (DendrogramClusters), and cluster counts
+// for all thresholds come from one sweep (DendrogramReport).
+//
+void Flock2::BuildDendrogram ()
+{
+	if ( m_dendro_frame == m_frame ) return;				// once per frame
+	m_dendro_frame = m_frame;
+
+	int numPoints = m_Params.num_birds;
+	float rmax = (m_dendro_rmax > 0) ? m_dendro_rmax : m_Accel.psmoothradius;
+	rmax = std::max( rmax, m_Params.cluster_threshold_dist );
+	int nt = std::max( 1, std::min( m_threads, m_Accel.gridTotal ) );
+	std::vector< std::vector<dendro_link_t> > pairs ( nt );
+
+	ForNearPairs ( rmax, [&] (int i, int j, float dsq, int t) {
+		pairs[t].push_back ( dendro_link_t{ sqrt( dsq ), i, j } );
+	} );
+	std::vector<dendro_link_t> edges;
+	for (int t=0; t < nt; t++) {
+		edges.insert ( edges.end(), pairs[t].begin(), pairs[t].end() );
+		std::vector<dendro_link_t>().swap ( pairs[t] );
+	}
+
+	// Boruvka. comp is the flattened component of each bird, refreshed each round
+	std::unique_ptr< std::atomic<int>[] > parent ( new std::atomic<int>[ std::max(numPoints, 1) ] );
+	std::unique_ptr< std::atomic<uint64_t>[] > best ( new std::atomic<uint64_t>[ std::max(numPoints, 1) ] );
+	std::vector<int> comp ( numPoints );
+	for (int i=0; i < numPoints; i++) { parent[i] = i; best[i] = UINT64_MAX; comp[i] = i; }
+
+	m_dendro_links.resize ( std::max(numPoints - 1, 0) );
+	std::atomic<int> nlinks (0);
+
+	while ( !edges.empty() ) {
+		// shortest link out of each component. lengths are positive, so float bits order as uints
+		ParallelFor ( (int) edges.size(), [&] (int a, int b, int t) {
+			uint32_t bits;
+			for (int k=a; k < b; k++) {
+				int ri = comp[ edges[k].i ], rj = comp[ edges[k].j ];
+				memcpy ( &bits, &edges[k].d, 4 );
+				uint64_t key = (uint64_t(bits) << 32) | uint32_t(k);
+				for (int r : { ri, rj }) {
+					uint64_t cur = best[r].load( std::memory_order_relaxed );
+					while ( key < cur && !best[r].compare_exchange_weak ( cur, key ) );
+				}
+			}
+		} );
+
+		// unite the picks. a link picked by both its components is added once
+		ParallelFor ( numPoints, [&] (int a, int b, int t) {
+			for (int r=a; r < b; r++) {
+				uint64_t key = best[r].load( std::memory_order_relaxed );
+				if ( key == UINT64_MAX ) continue;
+				best[r] = UINT64_MAX;
+				const dendro_link_t& e = edges[ uint32_t(key) ];
+				if ( ClusterUnite ( parent.get(), e.i, e.j ) )
+					m_dendro_links[ nlinks++ ] = e;
+			}
+		} );
+		ParallelFor ( numPoints, [&] (int a, int b, int t) {
+			for (int i=a; i < b; i++) comp[i] = ClusterFind ( parent.get(), i );
+		} );
+
+		// drop links inside one component
+		size_t live = 0;
+		for (size_t k=0; k < edges.size(); k++)
+			if ( comp[ edges[k].i ] != comp[ edges[k].j ] )
+				edges[live++] = edges[k];
+		edges.resize ( live );
+	}
+	m_dendro_links.resize ( nlinks );
+	std::sort ( m_dendro_links.begin(), m_dendro_links.end(), [] (const dendro_link_t& a, const dendro_link_t& b) { return a.d < b.d; } );
+}
+
+// clusters at a threshold, from the dendrogram. labels per bird, returns the cluster count.
+// exact for thresholds up to dendro_rmax, above it links are missing
+int Flock2::DendrogramClusters ( float thresh, std::vector<int>& label )
+{
+	int numPoints = m_Params.num_birds;
+	std::vector<int> parent ( numPoints );
+	for (int i=0; i < numPoints; i++) parent[i] = i;
+
+	auto find = [&] (int x) {
+		while ( parent[x] != x ) { parent[x] = parent[parent[x]]; x = parent[x]; }
+		return x;
+	};
+	for (size_t k=0; k < m_dendro_links.size() && m_dendro_links[k].d < thresh; k++)
+		parent[ find( m_dendro_links[k].i ) ] = find( m_dendro_links[k].j );
+
+	int nc = 0;
+	label.assign ( numPoints, -1 );
+	for (int i=0; i < numPoints; i++) {
+		if ( !m_pop_alive[i] ) continue;
+		int r = find( i );
+		if ( label[r] < 0 ) label[r] = nc++;
+		label[i] = label[r];
+	}
+	return nc;
+}
+
+// cluster count & largest cluster at dendro_steps thresholds up to dendro_rmax, in one sweep
+// over the links. writes dendro.csv, one row per frame
+void Flock2::DendrogramReport ()
+{
+	int numPoints = m_Params.num_birds;
+	float rmax = (m_dendro_rmax > 0) ? m_dendro_rmax : m_Accel.psmoothradius;
+	int ns = std::max( 1, std::min( m_dendro_steps, 1024 ) );
+	std::vector<int> parent ( numPoints ), size ( numPoints, 1 );
+	std::vector<int> clusters ( ns ), largest ( ns );
+	for (int i=0; i < numPoints; i++) parent[i] = i;
+
+	auto find = [&] (int x) {
+		while ( parent[x] != x ) { parent[x] = parent[parent[x]]; x = parent[x]; }
+		return x;
+	};
+	size_t k = 0;
+	int nc = numPoints - m_pop_dead, big = (nc > 0) ? 1 : 0;
+	for (int s=0; s < ns; s++) {
+		float thresh = rmax * (s+1) / ns;
+		for (; k < m_dendro_links.size() && m_dendro_links[k].d < thresh; k++) {
+			int a = find( m_dendro_links[k].i ), b = find( m_dendro_links[k].j );
+			if ( size[a] < size[b] ) std::swap ( a, b );
+			parent[b] = a;
+			size[a] += size[b];
+			big = std::max( big, size[a] );
+			nc--;
+		}
+		clusters[s] = nc;
+		largest[s] = big;
+	}
+
+	if ( !OpenAnalysisFile ( m_dendro_outfile, "dendro.csv", "wt", m_dendro, [ns, rmax] (FILE* fp) {
+		fprintf ( fp, "frame, birds, links" );
+		for (int s=0; s < ns; s++) fprintf ( fp, ", n%g", rmax * (s+1) / ns );
+		for (int s=0; s < ns; s++) fprintf ( fp, ", max%g", rmax * (s+1) / ns );
+		fprintf ( fp, "\n" );
+	} ) ) return;
+	fprintf ( m_dendro_outfile, "%d, %d, %d", m_frame, numPoints - m_pop_dead, (int) m_dendro_links.size() );
+	for (int s=0; s < ns; s++) fprintf ( m_dendro_outfile, ", %d", clusters[s] );
+	for (int s=0; s < ns; s++) fprintf ( m_dendro_outfile, ", %d", largest[s] );
+	fprintf ( m_dendro_outfile, "\n" );
+}
+
+// Pair correlation function g(r) (analysis)
+// bins pair distances within a cutoff (gr_rmax, default the neighbor radius), from the near
+// pairs on the accel grid (ForNearPairs). each thread has its own histogram, merged after.
+// the flock is not periodic, so density is birds over the volume of occupied cells.
+// runs every gr frames, writes gr.csv.
+//
+void Flock2::PairCorrelation ()
+{
+	int nb = std::max( 4, std::min( m_gr_bins, 1024 ) );
+	float rmax = (m_gr_rmax > 0) ? m_gr_rmax : m_Accel.psmoothradius;
+	float binw = rmax / nb;
+	int numCells = m_Accel.gridTotal;
+
+	int nt = std::max( 1, std::min( m_threads, numCells ) );
+	std::vector< std::vector<xlong> > hist ( nt, std::vector<xlong>( nb, 0 ) );
+
+	ForNearPairs ( rmax, [&] (int i, int j, float dsq, int t) {
+		hist[t][ std::min( int(sqrt(dsq) / binw), nb-1 ) ]++;
+	} );
+	uint* gridcnt = m_Grid.bufUI(AGRIDCNT);
+
+	// merge & normalize. g = observed pairs / pairs expected at uniform density
+	xlong pairs = 0;
+	int n = 0, occ = 0;
+	for (int c=0; c < numCells; c++) {
+		n += gridcnt[c];
+		if ( gridcnt[c] > 0 ) occ++;
+	}
+	Vec3F cw = Vec3F(1,1,1) / m_Accel.gridDelta;
+	double rho = (occ > 0) ? n / (occ * double(cw.x) * cw.y * cw.z) : 0;
+	m_gr_g.assign ( nb, 0 );
+	for (int k=0; k < nb; k++) {
+		xlong cnt = 0;
+		for (int t=0; t < nt; t++) cnt += hist[t][k];
+		pairs += cnt;
+		double r0 = k * binw, r1 = (k+1) * binw;
+		double shell = (4.0/3.0) * 3.141592653589 * (r1*r1*r1 - r0*r0*r0);
+		m_gr_g[k] = (n > 0 && rho > 0) ? float( 2.0 * cnt / (n * rho * shell) ) : 0;
+	}
+
+	if ( !OpenAnalysisFile ( m_gr_outfile, "gr.csv", "wt", m_gr, [nb, binw] (FILE* fp) {
+		fprintf ( fp, "frame, birds, pairs, density" );
+		for (int k=0; k < nb; k++) fprintf ( fp, ", %f", (k+0.5f) * binw );
+		fprintf ( fp, "\n" );
+	} ) ) return;
+	fprintf ( m_gr_outfile, "%d, %d, %lld, %f", m_frame, n, (long long) pairs, rho );
+	for (int k=0; k < nb; k++) fprintf ( m_gr_outfile, ", %f", m_gr_g[k] );
+	fprintf ( m_gr_outfile, "\n" );
+}
+
+// Heading lag analysis (information transfer between neighbors)
+// keeps a ring of recent turns (change in heading) per bird id. each frame, for each bird and its
+// topological neighbors, finds the lag in [-lag_max, lag_max] frames that best correlates the
+// bird's turns with the neighbor's over lag_window frames. turns propagate a pair's distance per
+// lag, so the speed estimate is the sum of distances over the sum of lags of correlated pairs.
+// the cross sums of a pair are kept per lag and slid by one frame while the pair stays neighbors,
+// so cost is N*k*lags, plus N*k*lags*window for new pairs. writes lag.csv, one row per frame.
+//
+void Flock2::LagAnalysis ()
+{
+	int numPoints = m_Params.num_birds;
+	int L = std::max( 1, std::min( m_lag_max, 32 ) );
+	int W = std::max( 2, std::min( m_lag_window, 64 ) );
+	int H = L + W + 1;								// +1 for the turn leaving the window
+	int T = 2*L + 1;
+	Bird *bi, *bj;
+	Vec3F dir;
+
+	if ( m_lag_turn.size() != numPoints*H || m_lag_sab.size() != (size_t) numPoints*NBR_MAX*T ) {
+		m_lag_turn.assign ( numPoints*H, Vec3F(0,0,0) );
+		m_lag_head.assign ( numPoints, Vec3F(0,0,0) );
+		m_lag_msum.assign ( numPoints*(L+1), Vec3F(0,0,0) );
+		m_lag_qsum.assign ( numPoints*(L+1), 0 );
+		m_lag_pair.assign ( numPoints*NBR_MAX, -1 );
+		m_lag_sab.assign ( (size_t) numPoints*NBR_MAX*T, 0 );
+		m_lag_frames = 0;
+	}
+
+	// record turns, by bird id (gpu reorders birds)
+	int now = m_lag_frames % H;
+	for (int i=0; i < numPoints; i++) {
+		bi = (Bird*) m_Birds.GetElem( FBIRD, i );
+		if ( !m_pop_alive[i] || bi->id < 0 || bi->id >= numPoints ) continue;
+		dir = bi->vel;	dir.Normalize();
+		m_lag_turn[ bi->id*H + now ] = (m_lag_frames > 0) ? dir - m_lag_head[ bi->id ] : Vec3F(0,0,0);
+		m_lag_head[ bi->id ] = dir;
+	}
+	m_lag_frames++;
+	if ( m_lag_frames <= H ) return;
+
+	// turn of bird id, frames back from now
+	Vec3F* turns = m_lag_turn.data();
+	auto turn = [turns, H, now] (int id, int back) -> const Vec3F& { return turns[ id*H + (now - back + H) % H ]; };
+
+	// window sums of each bird at each offset, sliding back one frame per offset
+	for (int id=0; id < numPoints; id++) {
+		Vec3F m(0,0,0);
+		double q = 0;
+		for (int s=0; s < W; s++) {
+			m += turn(id, s);	q += turn(id, s).Dot( turn(id, s) );
+		}
+		for (int o=0; o <= L; o++) {
+			m_lag_msum[ id*(L+1) + o ] = m;
+			m_lag_qsum[ id*(L+1) + o ] = q;
+			m += turn(id, o+W) - turn(id, o);
+			q += turn(id, o+W).Dot( turn(id, o+W) ) - turn(id, o).Dot( turn(id, o) );
+		}
+	}
+
+	int nbr[NBR_MAX];
+	int prev_j[NBR_MAX];
+	double prev_sab[ NBR_MAX*(2*32+1) ];
+	int nnbr, idi, idj, oi, oj, best_t, p;
+	float c, best_c, va, vb;
+	Vec3F ma, mb;
+	double* sab;
+	int pairs = 0, lagged = 0;
+	double sum_dist = 0, sum_lag = 0;
+
+	for (int i=0; i < numPoints; i++) {
+		bi = (Bird*) m_Birds.GetElem( FBIRD, i );
+		idi = bi->id;
+		if ( !m_pop_alive[i] || idi < 0 || idi >= numPoints ) continue;
+
+		// topological neighbors (cpu), or the nearest (gpu)
+		nnbr = 0;
+		if ( !m_gpu && m_stat_nbrs.size() >= (i+1)*NBR_MAX ) {
+			for (int k=0; k < NBR_MAX && m_stat_nbrs[ i*NBR_MAX + k ] >= 0; k++)
+				nbr[nnbr++] = m_stat_nbrs[ i*NBR_MAX + k ];
+		} else if ( bi->near_j >= 0 && bi->near_j < numPoints ) {
+			nbr[nnbr++] = bi->near_j;
+		}
+
+		// this bird's pairs of the last frame
+		memcpy ( prev_j, &m_lag_pair[ idi*NBR_MAX ], NBR_MAX*sizeof(int) );
+		memcpy ( prev_sab, &m_lag_sab[ (size_t) idi*NBR_MAX*T ], NBR_MAX*T*sizeof(double) );
+		for (int k=0; k < NBR_MAX; k++)
+			m_lag_pair[ idi*NBR_MAX + k ] = -1;
+
+		for (int k=0; k < nnbr; k++) {
+			bj = (Bird*) m_Birds.GetElem( FBIRD, nbr[k] );
+			idj = bj->id;
+			if ( idj < 0 || idj >= numPoints ) continue;
+			m_lag_pair[ idi*NBR_MAX + k ] = idj;
+			sab = &m_lag_sab[ ((size_t) idi*NBR_MAX + k) * T ];
+
+			// cross sums. t > 0, neighbor turned first. t < 0, bird turned first
+			for (p=0; p < NBR_MAX && prev_j[p] != idj; ) p++;
+			for (int t = -L; t <= L; t++) {
+				oi = (t < 0) ? -t : 0;
+				oj = (t > 0) ? t : 0;
+				if ( p < NBR_MAX ) {
+					// slide the window, newest turn in, oldest out
+					sab[t+L] = prev_sab[ p*T + t+L ] + turn(idi, oi).Dot( turn(idj, oj) ) - turn(idi, W+oi).Dot( turn(idj, W+oj) );
+				} else {
+					sab[t+L] = 0;
+					for (int s=0; s < W; s++)
+						sab[t+L] += turn(idi, s+oi).Dot( turn(idj, s+oj) );
 				}
+			}
 
-				//m_lines.push_back ( Vec4F(0, PLOT_RESY-m_freq_gmin[0]*400, xf, PLOT_RESY-m_freq_gmin[0]*400 ) );
-				//m_lines.push_back ( Vec4F(0, PLOT_RESY-m_freq_gmax[0]*400, xf, PLOT_RESY-m_freq_gmax[0]*400 ) );
+			// pearson correlation of turns (mean removed, so steady turning does not correlate at every lag)
+			best_c = -2; best_t = 0;
+			for (int t = -L; t <= L; t++) {
+				oi = (t < 0) ? -t : 0;
+				oj = (t > 0) ? t : 0;
+				ma = m_lag_msum[ idi*(L+1) + oi ] * (1.0f/W);
+				mb = m_lag_msum[ idj*(L+1) + oj ] * (1.0f/W);
+				va = m_lag_qsum[ idi*(L+1) + oi ] - W * ma.Dot( ma );
+				vb = m_lag_qsum[ idj*(L+1) + oj ] - W * mb.Dot( mb );
+				if ( va < 1e-10f || vb < 1e-10f ) continue;
+				c = (sab[t+L] - W * ma.Dot( mb )) / sqrt( va*vb );
+				if ( c > best_c ) { best_c = c; best_t = t; }
+			}
+			if ( best_c < -1 ) continue;
+			pairs++;
+
+			// peak at the edge of the lag range is unresolved
+			if ( best_c >= m_lag_corr_min && best_t != 0 && abs(best_t) < L ) {
+				lagged++;
+				sum_lag += abs(best_t);
+				sum_dist += (bi->pos - bj->pos).Length();
 			}
 		}
+	}
+	m_lag_mean = (lagged > 0) ? sum_lag / lagged : 0;
+	m_lag_speed = (sum_lag > 0) ? sum_dist / (sum_lag * m_Params.DT) : 0;
 
-		// plot samples
-		s = m_samples + (N/2)*SAMPLES + x;
-		for (y = N/2; y < N; y++) {
-			v = (*s) * 0.05f / 5.f;
-			c = m_plot[0].GetPixel ( x, y);
-			c += Vec4F(v, v, v, 1);
-			m_plot[0].SetPixel ( x, y, c );
-			s += SAMPLES;
-		}
+	if ( !OpenAnalysisFile ( m_lag_outfile, "lag.csv", "wt", m_lag, [] (FILE* fp) {
+		fprintf ( fp, "frame, pairs, lagged, lag_ave, speed\n" );
+	} ) ) return;
+	fprintf ( m_lag_outfile, "%d, %d, %d, %f, %f\n", m_frame, pairs, lagged, m_lag_mean, m_lag_speed );
+}
 
-		if ( xi % xdiv == 0 ) {
-			m_plot[0].Commit ();
+// Stable flock ids (analysis)
+// clusters holding more than cluster_minsize_color of the birds, up to MAX_FLOCKS, keep the id
+// most of their birds had at the previous sample. larger clusters choose first, so a split keeps
+// the id on its larger part and a merge the id contributing most birds.
+void Flock2::UpdateStableFlocks ()
+{
+	std::vector<int> prev ( m_bird_flock );
+	std::map<int, int> votes;
+	std::set<int> taken;
+	Bird* b;
+
+	m_bird_flock.assign ( m_Params.num_birds, -1 );
+	for (auto& it : m_flock_spec)
+		it.second.birds = 0;
+
+	for (int n=0; n < MAX_FLOCKS && n < (int) cluster_histogram.size(); n++) {
+		Histogram& h = cluster_histogram[n];
+		if ( h.bird_cnt < 2 || h.bird_cnt <= m_Params.num_birds * m_Params.cluster_minsize_color ) break;
+		std::vector<int>& members = cluster_assignment[ h.cluster_id ];
+
+		votes.clear();
+		for (int i : members) {
+			b = (Bird*) m_Birds.GetElem( FBIRD, i );
+			if ( b->id < (int) prev.size() && prev[ b->id ] >= 0 ) votes[ prev[b->id] ]++;
 		}
+		int id = -1, cnt = 0;
+		for (auto& v : votes)
+			if ( v.second > cnt && taken.count( v.first )==0 ) { id = v.first; cnt = v.second; }
+		if ( id < 0 ) id = m_flock_next++;
+		taken.insert ( id );
 
-  #endif
+		for (int i : members) {
+			b = (Bird*) m_Birds.GetElem( FBIRD, i );
+			if ( b->id < (int) m_bird_flock.size() ) m_bird_flock[ b->id ] = id;
+		}
+		m_flock_spec[id].birds = members.size();
+	}
 }
 
+// Count peaks in the spectral energy of a flock (analysis)
+// smoothing, line fit and peak test as for the whole flock in OutputFFTW
+void Flock2::FlockPeaks ( flock_spec_t& fs, int xf )
+{
+	fs.peak_cnt = 0;
+	fs.peak_ave = 0;
+	fs.peak_max = 0;
+	if ( xf < 8 ) return;
+	fs.energy.resize ( std::max( (int) fs.energy.size(), xf ), 0 );
+
+	std::vector<float> s1 ( fs.energy.begin(), fs.energy.begin() + xf ), s2 ( s1 );
+	for (int iter=0; iter < 5; iter++) {
+		s1[0] = s1[1];
+		s1[xf-1] = s1[xf-2];
+		for (int j = 1; j <= xf-2; j++)
+			s2[j] = s1[j-1]*0.3 + s1[j]*0.4 + s1[j+1]*0.3;
+		s1 = s2;
+	}
+	points_t pnts;
+	for (int j = 0; j < xf; j++)
+		pnts.push_back ( Vec2F( j, s2[j] ) );
+	double A, B, C, m = 0, b = 0;
+	if ( fit( A, B, C, pnts ) ) {
+		m = (-A/B);
+		b = (-C/B);
+	}
+	float* e = &s2[0];
+	float diff;
+	for (int j = 3; j < xf-3; j++) {
+		diff = fabs( e[3] - (m*j+b) );
+		if ( e[0] < e[2] && e[2] < e[3] && e[3] > e[4] && e[4] > e[6] && diff > 0.01 ) {
+			if ( diff*100.0 > fs.peak_max ) fs.peak_max = diff*100.0f;
+			fs.peak_ave += diff*100.0f;
+			fs.peak_cnt++;
+		}
+		e++;
+	}
+	if ( fs.peak_cnt > 0 ) fs.peak_ave /= fs.peak_cnt;
+}
 
 // compute smoothed energy
 /* memcpy ( m_fftw_s1, m_fftw_energy, xf * sizeof(float) );
@@ -1839,6 +5559,7 @@ void Flock2::OutputPlot ( int what, int frame )
 	if ( x >= PLOT_RESX ) return;
 
 	for (int i=0; i < m_Params.num_birds; i++) {
+		if ( !m_pop_alive[i] ) continue;
 		b = (Bird*) m_Birds.GetElem( FBIRD, i );
 		y = min( b->id, PLOT_RESY );
 
@@ -1874,9 +5595,10 @@ void Flock2::OutputPointCloudFiles ( int frame )
 		// make file numbers continuous
 		int file_num = (frame - m_rec_start)/m_rec_step;
 
+		TracePush ( "OutputPointCloudFiles" );
 		sprintf ( fn, "birds%04d.ply", file_num );
 		fp = fopen ( fn, "wt" );
-		if (fp==0) return;
+		if (fp==0) { TracePop (); return; }
 		fprintf ( fp, "ply\n" );
 		fprintf ( fp, "format ascii 1.0\n" );
 		fprintf ( fp, "element vertex %d\n", m_Params.num_birds );
@@ -1891,12 +5613,166 @@ void Flock2::OutputPointCloudFiles ( int frame )
 		// nx,ny,nz (normal) is saved as the bird angular acceleration (but could store other bird variables)
 		// note: Y+ is up in simulation, exported with Z+ up
 		for (int i=0; i < m_Params.num_birds; i++) {
+			if ( !m_pop_alive[i] ) continue;
 			b = (Bird*) m_Birds.GetElem( FBIRD, i);
 			fprintf ( fp, "%4.3f %4.3f %4.3f %4.3f %4.3f %4.3f\n", b->pos.x, b->pos.z, b->pos.y, b->ang_accel.x, b->ang_accel.z, b->ang_accel.y );
 		}
 		fclose ( fp );
+		TracePop ();
+	}
+
+}
+
+// Spatially indexed trajectories (output)
+// every traj frames, birds are appended to traj.bin in accel grid cell order, with an index of
+// the occupied cells, so a reader loads only the birds of a region (see TrajectoryQuery).
+// birds are binned again at their current (advanced) positions, so the index is exact.
+// the grid geometry is stored per frame, as it follows the flock. dead birds are not written.
+//
+void Flock2::OutputTrajectory ()
+{
+	int numPoints = m_Params.num_birds;
+	int numCells = m_Accel.gridTotal;
+	Vec3I res = m_Accel.gridRes;
+
+	if ( !OpenAnalysisFile ( m_traj_outfile, "traj.bin", "wb", m_traj ) ) return;
+
+	// counting sort by cell. outside the grid sorts last
+	std::vector<uint> cell ( numPoints );
+	std::vector<uint> cnt ( numCells + 1, 0 );
+	ParallelFor ( numPoints, [&] (int a, int b, int t) {
+		for (int i=a; i < b; i++) {
+			Bird* bi = (Bird*) m_Birds.GetElem( FBIRD, i );
+			Vec3F gcf = (bi->pos - m_Accel.gridMin) * m_Accel.gridDelta;
+			bool in = m_pop_alive[i] && std::isfinite( gcf.x + gcf.y + gcf.z );
+			in = in && gcf.x >= 0 && gcf.y >= 0 && gcf.z >= 0 && gcf.x < res.x && gcf.y < res.y && gcf.z < res.z;
+			cell[i] = in ? (int(gcf.y) * res.z + int(gcf.z)) * res.x + int(gcf.x) : numCells;
+		}
+	} );
+	int num = 0;
+	for (int i=0; i < numPoints; i++) {
+		if ( !m_pop_alive[i] ) { cell[i] = GRID_UNDEF; continue; }
+		cnt[ cell[i] ]++;
+		num++;
+	}
+	std::vector<traj_cell_t> index;
+	uint sum = 0;
+	for (int c=0; c <= numCells; c++) {
+		if ( cnt[c] > 0 ) index.push_back ( traj_cell_t{ (c == numCells) ? GRID_UNDEF : uint(c), sum } );
+		uint n = cnt[c];
+		cnt[c] = sum;
+		sum += n;
+	}
+	std::vector<traj_rec_t> rec ( num );
+	for (int i=0; i < numPoints; i++) {
+		if ( cell[i] == GRID_UNDEF ) continue;
+		Bird* bi = (Bird*) m_Birds.GetElem( FBIRD, i );
+		rec[ cnt[ cell[i] ]++ ] = traj_rec_t{ bi->id, bi->pos, bi->vel };
+	}
+
+	traj_frame_t hdr;
+	memcpy ( hdr.magic, "FTRJ", 4 );
+	hdr.frame = m_frame;
+	hdr.time = m_time;
+	hdr.num = num;
+	hdr.ncell = (int) index.size();
+	hdr.gridMin = m_Accel.gridMin;
+	hdr.gridDelta = m_Accel.gridDelta;
+	hdr.gridRes = res;
+	hdr.next = sizeof(traj_frame_t) + xlong(hdr.ncell) * sizeof(traj_cell_t) + xlong(num) * sizeof(traj_rec_t);
+	fwrite ( &hdr, sizeof(traj_frame_t), 1, m_traj_outfile );
+	fwrite ( index.data(), sizeof(traj_cell_t), index.size(), m_traj_outfile );
+	fwrite ( rec.data(), sizeof(traj_rec_t), rec.size(), m_traj_outfile );
+	fflush ( m_traj_outfile );
+}
+
+// Read the birds of one frame inside a box from a trajectory file
+// hops frame headers to the frame, reads its cell index, then only the record runs of the
+// cells overlapping the box, merged when adjacent. I/O is proportional to the region.
+// returns the birds found, or -1 if the file or frame is missing.
+//
+int Flock2::TrajectoryQuery ( std::string fname, int frame, Vec3F bmin, Vec3F bmax, std::vector<traj_rec_t>& out )
+{
+	out.clear ();
+	FILE* fp = fopen ( fname.c_str(), "rb" );
+	if ( fp == 0 ) return -1;
+
+	traj_frame_t hdr;
+	xlong pos = 0;
+	for (;;) {
+		if ( fread ( &hdr, sizeof(traj_frame_t), 1, fp ) != 1 || memcmp ( hdr.magic, "FTRJ", 4 ) != 0 ) { fclose ( fp ); return -1; }
+		if ( hdr.frame == frame ) break;
+		pos += hdr.next;
+		if ( fseek64 ( fp, pos, SEEK_SET ) != 0 ) { fclose ( fp ); return -1; }
+	}
+	std::vector<traj_cell_t> index ( hdr.ncell );
+	if ( fread ( index.data(), sizeof(traj_cell_t), hdr.ncell, fp ) != (size_t) hdr.ncell ) { fclose ( fp ); return -1; }
+	xlong recs = pos + sizeof(traj_frame_t) + xlong(hdr.ncell) * sizeof(traj_cell_t);
+
+	// record runs of the cells in the box, one span of cells per (y,z) row
+	Vec3I res = hdr.gridRes;
+	Vec3F lo = (bmin - hdr.gridMin) * hdr.gridDelta;
+	Vec3F hi = (bmax - hdr.gridMin) * hdr.gridDelta;
+	auto clampi = [] (float v, int n) { return std::max( 0, std::min( int(floor(v)), n-1 ) ); };
+	Vec3I c0 ( clampi( lo.x, res.x ), clampi( lo.y, res.y ), clampi( lo.z, res.z ) );
+	Vec3I c1 ( clampi( hi.x, res.x ), clampi( hi.y, res.y ), clampi( hi.z, res.z ) );
+	std::vector< std::pair<uint, uint> > runs;
+	auto end = [&] (int k) { return (k+1 < hdr.ncell) ? index[k+1].start : uint(hdr.num); };
+	for (int y = c0.y; y <= c1.y; y++) {
+		for (int z = c0.z; z <= c1.z; z++) {
+			uint a = (y * res.z + z) * res.x + c0.x, b = a + (c1.x - c0.x);
+			int k = std::lower_bound ( index.begin(), index.end(), a, [] (const traj_cell_t& e, uint c) { return e.cell < c; } ) - index.begin();
+			for (; k < hdr.ncell && index[k].cell <= b; k++) {
+				if ( !runs.empty() && runs.back().second == index[k].start ) runs.back().second = end(k);
+				else runs.push_back ( std::make_pair( index[k].start, end(k) ) );
+			}
+		}
+	}
+	// birds outside the grid are tested as well
+	if ( hdr.ncell > 0 && index.back().cell == GRID_UNDEF )
+		runs.push_back ( std::make_pair( index.back().start, uint(hdr.num) ) );
+
+	std::vector<traj_rec_t> buf;
+	for (auto& r : runs) {
+		buf.resize ( r.second - r.first );
+		if ( fseek64 ( fp, recs + xlong(r.first) * sizeof(traj_rec_t), SEEK_SET ) != 0 ) break;
+		if ( fread ( buf.data(), sizeof(traj_rec_t), buf.size(), fp ) != buf.size() ) break;
+		for (auto& t : buf)
+			if ( t.pos.x >= bmin.x && t.pos.y >= bmin.y && t.pos.z >= bmin.z && t.pos.x <= bmax.x && t.pos.y <= bmax.y && t.pos.z <= bmax.z )
+				out.push_back ( t );
 	}
+	fclose ( fp );
+	return (int) out.size();
+}
 
+// Trajectory reader (-r file,frame[,x0,y0,z0,x1,y1,z1])
+// prints the birds of one frame of a trajectory file inside a box, default all, as csv on stdout
+void Flock2::TrajectoryRead ()
+{
+	std::string lin = m_traj_read, word, fname;
+	std::vector<float> v;
+	if ( !strSplitLeft ( lin, ",", fname, lin ) ) { fname = lin; lin = ""; }
+	while ( !lin.empty() ) {
+		if ( !strSplitLeft ( lin, ",", word, lin ) ) { word = lin; lin = ""; }
+		v.push_back ( strToF ( word ) );
+	}
+	if ( v.size() != 1 && v.size() != 7 ) {
+		dbgprintf ( "ERROR: -r expects file,frame[,x0,y0,z0,x1,y1,z1]\n" );
+		return;
+	}
+	Vec3F bmin (-1e10, -1e10, -1e10), bmax (1e10, 1e10, 1e10);
+	if ( v.size() == 7 ) {
+		bmin.Set ( v[1], v[2], v[3] );
+		bmax.Set ( v[4], v[5], v[6] );
+	}
+	std::vector<traj_rec_t> out;
+	if ( TrajectoryQuery ( fname, int(v[0]), bmin, bmax, out ) < 0 ) {
+		dbgprintf ( "ERROR: No frame %d in %s\n", int(v[0]), fname.c_str() );
+		return;
+	}
+	printf ( "id, x, y, z, vx, vy, vz\n" );
+	for (auto& t : out)
+		printf ( "%d, %f, %f, %f, %f, %f, %f\n", t.id, t.pos.x, t.pos.y, t.pos.z, t.vel.x, t.vel.y, t.vel.z );
 }
 
 void Flock2::AdvanceOrientationHoetzlein ()
@@ -1911,9 +5787,11 @@ void Flock2::AdvanceOrientationHoetzlein ()
 			cuCheck ( cuLaunchKernel ( m_Kernel[KERNEL_ADVANCE_ORIENT],  m_Accel.numBlocks, 1, 1, m_Accel.numThreads, 1, 1, 0, NULL, args, NULL), (char*)"Advance", (char*)"cuLaunch", (char*)"FUNC_ADVANCE", DEBUG_CUDA );
 
 			// Retrieve birds from GPU for rendering & visualization
+			TracePush ( "Retrieve" );
 			m_Birds.Retrieve ( FBIRD );
 
 			cuCtxSynchronize ();
+			TracePop ();
 		#endif
 
 	} else {
@@ -1923,8 +5801,9 @@ void Flock2::AdvanceOrientationHoetzlein ()
 		Vec3F fwd, up, right, vaxis;
 		Vec3F force, lift, drag, thrust, accel;
 		Vec3F diri, dirj;
+		Vec3F resid, delta_v;
 		Quaternion ctrl_pitch;
-		float airflow, aoa;
+		float airflow, aoa, fres, vdotv;
 
 		float L, dist;
 		float pitch, yaw;
@@ -1938,6 +5817,7 @@ void Flock2::AdvanceOrientationHoetzlein ()
 
 		for (int n=0; n < m_Params.num_birds; n++) {
 
+			if ( !m_pop_alive[n] ) continue;
 			b = (Bird*) m_Birds.GetElem( FBIRD, n);
 
 			b->clr.Set(0,0,0,0);
@@ -2034,6 +5914,7 @@ void Flock2::AdvanceOrientationHoetzlein ()
 		//
 		for (int n=0; n < m_Params.num_birds; n++) {
 
+			if ( !m_pop_alive[n] ) continue;
 			b = (Bird*) m_Birds.GetElem( FBIRD, n);
 
 			#ifdef DEBUG_BIRD
@@ -2112,6 +5993,23 @@ void Flock2::AdvanceOrientationHoetzlein ()
 			thrust = fwd * b->power * m_Params.power;
 			force += thrust;
 
+			// Compute energy used (stats, read only), as on gpu
+			// P = F v. gravity is applied to accel below, so the residual force is the thrust
+			b->lift = lift;
+			b->drag = drag;
+			b->thrust = thrust;
+			b->gravity = m_Params.gravity * m_Params.mass;
+			b->Plift = lift.Length() * b->speed;		// lift is force applied to move air downward
+			b->Pdrag = drag.Length() * b->speed;		// drag is force against motion (profile + parasitic drag)
+			resid = force - lift - drag;
+			fres = resid.Length();
+			delta_v = resid * (m_Params.DT / m_Params.mass);
+			vdotv = delta_v.Dot ( vaxis );
+			b->Pfwd = fres * vdotv;									// energy for forward acceleration (beyond drag)
+			b->Pturn = fres * (delta_v - vaxis * vdotv).Length();	// energy for turning
+			b->Ptotal = b->Plift + b->Pdrag + b->Pfwd + b->Pturn;
+			b->Ecum += b->Ptotal * m_Params.DT;						// energy used (joules)
+
 			// Integrate position
 			accel = force / m_Params.mass;				// body forces
 			accel += m_Params.gravity;						// gravity
@@ -2192,9 +6090,11 @@ void Flock2::AdvanceVectorsReynolds ()
 			cuCheck ( cuLaunchKernel ( m_Kernel[KERNEL_ADVANCE_VECTORS],  m_Accel.numBlocks, 1, 1, m_Accel.numThreads, 1, 1, 0, NULL, args, NULL), (char*)"Advance", (char*)"cuLaunch", (char*)"FUNC_ADVANCE", DEBUG_CUDA );
 
 			// Retrieve birds from GPU for rendering & visualization
+			TracePush ( "Retrieve" );
 			m_Birds.Retrieve ( FBIRD );
 
 			cuCtxSynchronize ();
+			TracePop ();
 		#endif
 
 	} else {
@@ -2210,6 +6110,7 @@ void Flock2::AdvanceVectorsReynolds ()
 		//
 		for (int n=0; n < m_Params.num_birds; n++) {
 
+			if ( !m_pop_alive[n] ) continue;
 			b = (Bird*) m_Birds.GetElem( FBIRD, n);
 
 			force.Set(0,0,0);
@@ -2509,14 +6410,53 @@ void Flock2::SelectBird (float x, float y)
 	best_dist = 1e5;
 
 	// find the bird nearest to camera ray
-	for (int i=0; i < m_Params.num_birds; i++) {
-		b = (Bird*) m_Birds.GetElem( FBIRD, i );
+	if ( m_nbr_backend == NBR_KDTREE && !m_gpu ) {
+		// k-d tree. nodes bounded by a sphere, skipped if farther from the ray than the best so far
+		int stack[KD_DEPTH_MAX+1], top = 0, nd;
+		Vec3F c;
+		KdRefit ();
+		stack[top++] = 0;
+		while ( top > 0 ) {
+			nd = stack[--top];
+			kdnode_t& node = m_kd_node[nd];
+			c = (node.bmin + node.bmax) * 0.5f;
+			q = projectPointLine( c, rpos, rpos+rdir );
+			if ( (c - q).Length() - (node.bmax - c).Length() >= best_dist ) continue;
+			if ( node.axis < 0 ) {
+				for (int k = node.start; k < node.end; k++) {
+					q = projectPointLine( m_kd_pos[k], rpos, rpos+rdir );
+					dist = (m_kd_pos[k] - q).Length();
+					if ( dist < best_dist ) {
+						best_id = ((Bird*) m_Birds.GetElem( FBIRD, m_kd_idx[k] ))->id;
+						best_dist = dist;
+					}
+				}
+			} else {
+				stack[top++] = 2*nd+2;
+				stack[top++] = 2*nd+1;
+			}
+		}
+		// birds outside the tree
+		for (int j : m_kd_out) {
+			b = (Bird*) m_Birds.GetElem( FBIRD, j );
+			q = projectPointLine( b->pos, rpos, rpos+rdir );
+			dist = (b->pos - q).Length();
+			if ( dist < best_dist ) {
+				best_id = b->id;
+				best_dist = dist;
+			}
+		}
+	} else {
+		for (int i=0; i < m_Params.num_birds; i++) {
+			if ( !m_pop_alive[i] ) continue;
+			b = (Bird*) m_Birds.GetElem( FBIRD, i );
 
-		q = projectPointLine( b->pos, rpos, rpos+rdir );
-		dist = (b->pos - q).Length();
-		if ( dist < best_dist ) {
-			best_id = b->id;
-			best_dist = dist;
+			q = projectPointLine( b->pos, rpos, rpos+rdir );
+			dist = (b->pos - q).Length();
+			if ( dist < best_dist ) {
+				best_id = b->id;
+				best_dist = dist;
+			}
 		}
 	}
 
@@ -2706,7 +6646,7 @@ void Flock2::VisualizeClusters ()
 	sprintf ( msg, "cl."); drawText ( Vec2F(400, 30), msg, tc );
 	sprintf ( msg, "cnt"); drawText ( Vec2F(430, 30), msg, tc );
 	sprintf ( msg, "centroid (x/y/z)"); drawText ( Vec2F(460, 30), msg, tc );
-	for (int i=0; i < MAX_FLOCKS; i++) {
+	for (int i=0; i < MAX_FLOCKS && i < (int) cluster_histogram.size(); i++) {
 		if(cluster_histogram.at(i).bird_cnt > m_Params.num_birds * m_Params.cluster_minsize_color) {
 			clr = GenerateColorN(i, 10);
 
@@ -2728,12 +6668,108 @@ void Flock2::VisualizeClusters ()
 }
 
 
+// Trace spans
+// each thread keeps its own stack of open spans, so spans nest per thread
+// and never need a lock. closed spans are written into a shared ring (m_trace_buf)
+// by an atomic slot counter. the oldest spans are overwritten when the ring is full.
+//
+struct trace_stack_t {
+	int				tid = -1;
+	int				depth = 0;
+	const char*		name[ TRACE_DEPTH ];
+	xlong			start[ TRACE_DEPTH ];
+};
+static thread_local trace_stack_t	g_trace_stack;
+
+inline xlong TraceNSec ()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds> ( std::chrono::steady_clock::now().time_since_epoch() ).count();
+}
+
+void Flock2::TraceStart ()
+{
+	m_trace_head = 0;
+	printf ( "Trace: recording spans.\n" );
+}
+
+void Flock2::TracePush ( const char* name )
+{
+	if (!m_trace || m_autotuning) return;
+
+	trace_stack_t& ts = g_trace_stack;
+	if ( ts.tid == -1 ) ts.tid = m_trace_threads++;			// first span on this thread
+	if ( ts.depth < TRACE_DEPTH ) {
+		ts.name[ ts.depth ] = name;
+		ts.start[ ts.depth ] = TraceNSec();
+	}
+	ts.depth++;
+}
+
+void Flock2::TracePop ()
+{
+	trace_stack_t& ts = g_trace_stack;
+	if ( m_autotuning ) return;				// trial spans are not pushed
+	if ( ts.depth == 0 ) return;			// tracing was enabled mid-span
+	ts.depth--;
+	if ( !m_trace || ts.depth >= TRACE_DEPTH ) return;
+
+	uint slot = m_trace_head.fetch_add ( 1 ) % TRACE_MAX;
+	trace_t* t = &m_trace_buf[ slot ];
+	t->name = ts.name[ ts.depth ];
+	t->tid = ts.tid;
+	t->start = ts.start[ ts.depth ];
+	t->end = TraceNSec();
+}
+
+void Flock2::OutputTrace ( std::string fname )
+{
+	// write Chrome trace JSON
+	// open with chrome://tracing or https://ui.perfetto.dev
+	// each span is a complete event ('X'), with timestamps in microsec.
+	//
+	uint head = m_trace_head;
+	uint cnt = std::min( head, (uint) TRACE_MAX );
+	if ( cnt == 0 ) return;
+
+	FILE* fp = fopen ( fname.c_str(), "wt" );
+	if ( fp == 0 ) {
+		dbgprintf ( "ERROR: Unable to write %s\n", fname.c_str() );
+		return;
+	}
+	// oldest span in ring sets the time origin
+	xlong t0 = m_trace_buf[ (head - cnt) % TRACE_MAX ].start;
+	for (uint n=0; n < cnt; n++)
+		t0 = std::min( t0, m_trace_buf[ (head - cnt + n) % TRACE_MAX ].start );
+
+	fprintf ( fp, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n" );
+	for (int n=0; n < m_trace_threads; n++) {
+		fprintf ( fp, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"%s %d\"}},\n", n, (n==0) ? "main" : "worker", n );
+	}
+	trace_t* t;
+	for (uint n=0; n < cnt; n++) {
+		t = &m_trace_buf[ (head - cnt + n) % TRACE_MAX ];
+		fprintf ( fp, "{\"name\": \"%s\", \"cat\": \"flock\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f}%s\n",
+			t->name, t->tid, (t->start - t0) / 1000.0, (t->end - t->start) / 1000.0, (n < cnt-1) ? "," : "" );
+	}
+	fprintf ( fp, "]}\n" );
+	fclose ( fp );
+
+	printf ( "Trace: wrote %d spans to %s\n", cnt, fname.c_str() );
+}
+
+
 // Run
 // run a single time step
 //
 void Flock2::Run ()
 {
+	if ( m_ooc ) {
+		RunOOC ();
+		return;
+	}
+
 	// PERF_PUSH ( "Run" );
+	TracePush ( "Run" );
 
 	TimeX t1, t2;
 	t1.SetTimeNSec();
@@ -2744,37 +6780,102 @@ void Flock2::Run ()
 
 	bird_count = 0;
 
+	//--- Arrivals & catches
+	if ( m_pop_spawn > 0 || m_pop_catch > 0 ) {
+		TracePush ( "Population" );
+		UpdatePopulation ();
+		TracePop ();
+	}
+
+	//--- Fit accel grid to flock
+	UpdateGridBounds ();
+
 	//--- Insert birds into acceleration grid
+	TracePush ( "InsertIntoGrid" );
 	InsertIntoGrid ();
+	TracePop ();
 
 	//--- Prefix scan for accel grid
+	TracePush ( "PrefixSumGrid" );
 	PrefixSumGrid ();
+	TracePop ();
 
 	//--- Find neighbors
+	TracePush ( "FindNeighbors" );
 	FindNeighbors ();
+	TracePop ();
 
 	//--- Advance birds
+	TracePush ( "Advance" );
 	if ( m_method==0 ) {
 		AdvanceOrientationHoetzlein ();			// 2024 Hoetzlein, Flock2
 	} else {
 		AdvanceVectorsReynolds ();					// 1987 Reynolds, Boids
 	}
+	TracePop ();
 
 	//--- Calculate cluster metrics (after Advance*(), because need to Retrieve data first)
+	TracePush ( "Clusters" );
 	AssignClusters ();
 	CalculateClusters ();
+	TracePop ();
+
+	// analysis outputs. none during autotune trials, they only time the sim
+	bool outputs = !m_autotuning;
+
+	//--- Heading lag between neighbors
+	if ( m_lag && outputs ) {
+		TracePush ( "LagAnalysis" );
+		LagAnalysis ();
+		TracePop ();
+	}
+
+	//--- Neighbor anisotropy
+	if ( m_aniso && outputs ) {
+		TracePush ( "NeighborAnisotropy" );
+		NeighborAnisotropy ();
+		TracePop ();
+	}
+
+	//--- Dendrogram, cluster counts at all thresholds
+	if ( m_dendro > 0 && m_frame % m_dendro == 0 && outputs ) {
+		TracePush ( "Dendrogram" );
+		BuildDendrogram ();
+		DendrogramReport ();
+		TracePop ();
+	}
+
+	//--- Pair correlation g(r)
+	if ( m_gr > 0 && m_frame % m_gr == 0 && outputs ) {
+		TracePush ( "PairCorrelation" );
+		PairCorrelation ();
+		TracePop ();
+	}
+
+	//--- Trajectories
+	if ( m_traj > 0 && m_frame % m_traj == 0 && outputs ) {
+		TracePush ( "OutputTrajectory" );
+		OutputTrajectory ();
+		TracePop ();
+	}
 
 	//--- Advance predators
+	TracePush ( "Advance_pred" );
 	Advance_pred();
+	TracePop ();
 
 	//--- Update flock data (centroid, energy)
+	TracePush ( "UpdateFlockData" );
 	UpdateFlockData ();
+	TracePop ();
 
 	//--- Outputs
 	// OutputPointCloudFiles ( m_frame );
 	// OutputPlot ( 0, m_frame );
-	if (m_analysis) {
+	if (m_analysis && outputs) {
+		TracePush ( "OutputFFTW" );
 		OutputFFTW ( m_frame );
+		TracePop ();
   }
 
 	#ifdef DEBUG_BIRD
@@ -2787,6 +6888,7 @@ void Flock2::Run ()
 	// printf ( "Run: %f msec/step, %2.2f%% real-time\n", msec, (m_Params.DT*1000.0)*100 / msec );
 
 	// PERF_POP();
+	TracePop ();
 
 	m_time += m_Params.DT;
 	m_frame++;
@@ -2796,12 +6898,221 @@ void Flock2::Run ()
 }
 
 
+// Out-of-core step (CPU)
+// the current state file is read in blocks of rows, each with one halo row on both sides (a
+// neighbor radius). a block is loaded into m_Birds and runs the in-core stages, grid, neighbors &
+// advance, with the halo birds only as neighbor candidates. the block's own birds are written to
+// the next file sorted by new row, and by grid cell within a row, as one run. birds move less than
+// a row per step, so a row is then read from the runs of ~3 adjacent blocks. the next block is
+// prefetched (madvise WILLNEED) while one runs, and rows behind it are released (DONTNEED), so a
+// step streams through the state once with about two blocks resident. blocks are ooc_block_mb.
+//
+void Flock2::RunOOC ()
+{
+	#ifndef _WIN32
+	TracePush ( "RunOOC" );
+
+	ooc_file_t& in = m_ooc_file[ m_ooc_cur ];
+	ooc_file_t& out = m_ooc_file[ 1 - m_ooc_cur ];
+	size_t rec = m_ooc_rec;
+	int rows = m_ooc_rows;
+	int nrun = (int) m_ooc_run.size();
+	Bird* b;
+
+	// birds before each row, over all runs
+	std::vector<xlong> psum ( rows+1, 0 );
+	for (int r=0; r < nrun; r++)
+		for (int y=0; y < rows; y++)
+			psum[y+1] += m_ooc_run[r][y+1] - m_ooc_run[r][y];
+	for (int y=0; y < rows; y++)
+		psum[y+1] += psum[y];
+
+	// blocks of rows, each loaded with its halo rows [lo, hi)
+	auto lo = [] (int y) { return std::max( 0, y-1 ); };
+	auto hi = [rows] (int y) { return std::min( rows, y+1 ); };
+	xlong budget = std::max( (xlong) 1, xlong( m_ooc_block_mb * 1048576.0 / (sizeof(Bird) + 2*sizeof(uint)) ) );
+	std::vector<int> blk ( 1, 0 );
+	for (int y=1; y <= rows; y++)
+		if ( y == rows || psum[ hi(y+1) ] - psum[ lo(blk.back()) ] > budget ) blk.push_back ( y );
+	m_ooc_blocks = (int) blk.size() - 1;
+
+	// records of rows [y0, y1), in every run
+	auto advise = [&] (int y0, int y1, int advice) {
+		for (int r=0; r < nrun; r++)
+			OOCAdvise ( in, m_ooc_run[r][y0], m_ooc_run[r][y1], advice );
+	};
+	OOCAdvise ( in, 0, m_ooc_num, MADV_SEQUENTIAL );
+	advise ( lo(blk[0]), hi(blk[1]), MADV_WILLNEED );
+
+	std::vector< std::vector<xlong> > runs;
+	std::vector<char> core;
+	std::vector<int> ord, sorted, nrow;
+	xlong wr = 0;
+	int num_max = 0;
+	double cen[3] = {0,0,0}, sum[7] = {0,0,0,0,0,0,0};
+
+	for (int k=0; k < m_ooc_blocks; k++) {
+
+		int y0 = blk[k], y1 = blk[k+1];
+		if ( k+1 < m_ooc_blocks )
+			advise ( lo(y1), hi( blk[k+2] ), MADV_WILLNEED );
+
+		//--- Load block & halo rows
+		TracePush ( "OOCLoad" );
+		int num = int( psum[ hi(y1) ] - psum[ lo(y0) ] );
+		num_max = std::max( num_max, num );
+		OOCReserve ( num );
+		int i = 0;
+		for (int r=0; r < nrun; r++) {
+			xlong a = m_ooc_run[r][ lo(y0) ];
+			int n = int( m_ooc_run[r][ hi(y1) ] - a );
+			if ( n == 0 ) continue;
+			ParallelFor ( n, [&, a, i] (int s, int e, int t) {
+				for (int j=s; j < e; j++)
+					memcpy ( m_Birds.GetElem( FBIRD, i+j ), in.map + size_t(a+j) * rec, rec );
+			} );
+			i += n;
+		}
+		m_Params.num_birds = num;
+
+		// block grid. world x & z, the rows in y. edge rows also hold birds beyond the world bounds
+		Vec3F gmin ( m_Accel.bound_min.x, m_ooc_ymin + lo(y0)*m_ooc_h, m_Accel.bound_min.z );
+		Vec3F gmax ( m_Accel.bound_max.x, m_ooc_ymin + hi(y1)*m_ooc_h, m_Accel.bound_max.z );
+		core.assign ( num, 0 );
+		for (i=0; i < num; i++) {
+			b = (Bird*) m_Birds.GetElem( FBIRD, i );
+			int y = OOCRow ( b->pos.y );
+			core[i] = ( y >= y0 && y < y1 );
+			m_pop_alive[i] = 1;
+			if ( !std::isfinite( b->pos.x + b->pos.y + b->pos.z ) ) continue;
+			gmin.x = std::min(gmin.x, b->pos.x);	gmax.x = std::max(gmax.x, b->pos.x);
+			gmin.y = std::min(gmin.y, b->pos.y);	gmax.y = std::max(gmax.y, b->pos.y);
+			gmin.z = std::min(gmin.z, b->pos.z);	gmax.z = std::max(gmax.z, b->pos.z);
+		}
+		TracePop ();
+
+		ResizeGrid ( gmin, gmax, "out-of-core block" );
+
+		TracePush ( "InsertIntoGrid" );
+		InsertIntoGrid ();
+		TracePop ();
+
+		TracePush ( "PrefixSumGrid" );
+		PrefixSumGrid ();
+		TracePop ();
+
+		// halo birds are only neighbor candidates. the grid backend takes candidates from the grid,
+		// so their queries are skipped. the others build from alive birds, so halo birds are queried too
+		if ( m_nbr_backend == NBR_GRID && !m_nbr_islands )
+			for (i=0; i < num; i++) m_pop_alive[i] = core[i];
+
+		TracePush ( "FindNeighbors" );
+		FindNeighbors ();
+		TracePop ();
+
+		for (i=0; i < num; i++) m_pop_alive[i] = core[i];
+
+		TracePush ( "Advance" );
+		if ( m_method==0 ) {
+			AdvanceOrientationHoetzlein ();
+		} else {
+			AdvanceVectorsReynolds ();
+		}
+		TracePop ();
+
+		//--- Write the block's birds to the next file, by new row, in grid cell order within a row
+		TracePush ( "OOCWrite" );
+		uint* grid = m_Grid.bufUI(AGRID);
+		uint* fgc = m_Birds.bufUI(FGCELL);
+		int ngrid = m_Grid.bufUI(AGRIDOFF)[ m_Accel.gridTotal-1 ] + m_Grid.bufUI(AGRIDCNT)[ m_Accel.gridTotal-1 ];
+		ord.clear ();
+		for (int c=0; c < ngrid; c++)
+			if ( core[ grid[c] ] ) ord.push_back ( grid[c] );
+		for (i=0; i < num; i++)
+			if ( core[i] && fgc[i] == GRID_UNDEF ) ord.push_back ( i );
+
+		std::vector<xlong> run ( rows+1, 0 );
+		nrow.resize ( ord.size() );
+		for (int j=0; j < ord.size(); j++) {
+			b = (Bird*) m_Birds.GetElem( FBIRD, ord[j] );
+			nrow[j] = OOCRow ( b->pos.y );
+			run[ nrow[j]+1 ]++;
+			if ( !std::isfinite( b->pos.x + b->pos.y + b->pos.z ) ) continue;
+			cen[0] += b->pos.x;		cen[1] += b->pos.y;		cen[2] += b->pos.z;
+			sum[0] += b->speed;
+			sum[1] += b->Plift;		sum[2] += b->Pdrag;		sum[3] += b->Pfwd;
+			sum[4] += b->Pturn;		sum[5] += b->Ptotal;	sum[6] += b->Ecum;
+		}
+		for (int y=0; y < rows; y++)
+			run[y+1] += run[y];
+		sorted.resize ( ord.size() );
+		{
+			std::vector<xlong> next ( run.begin(), run.end()-1 );
+			for (int j=0; j < ord.size(); j++)
+				sorted[ next[ nrow[j] ]++ ] = ord[j];
+		}
+		ParallelFor ( (int) sorted.size(), [&, wr] (int s, int e, int t) {
+			for (int j=s; j < e; j++)
+				memcpy ( out.map + size_t(wr + j) * rec, m_Birds.GetElem( FBIRD, sorted[j] ), rec );
+		} );
+		for (int y=0; y <= rows; y++)
+			run[y] += wr;
+		runs.push_back ( run );
+		OOCAdvise ( out, wr, wr + sorted.size(), MADV_DONTNEED );
+		wr += sorted.size();
+
+		// release rows no later block loads
+		advise ( lo(y0), lo(y1), MADV_DONTNEED );
+		TracePop ();
+	}
+
+	m_ooc_run.swap ( runs );
+	m_ooc_cur = 1 - m_ooc_cur;
+
+	// flock averages
+	float n = float( std::max( 1, m_ooc_num ) );
+	m_Flock.centroid = Vec3F( cen[0]/n, cen[1]/n, cen[2]/n );
+	m_Flock.speed = sum[0] / n;
+	m_Flock.Plift = sum[1] / n;
+	m_Flock.Pdrag = sum[2] / n;
+	m_Flock.Pfwd = sum[3] / n;
+	m_Flock.Pturn = sum[4] / n;
+	m_Flock.Ptotal = sum[5] / n;
+	m_Flock.Ecum = sum[6] / n;
+
+	if ( NbrLogFrame() )
+		printf ( "Out-of-core: frame %d, %d blocks of up to %d birds, %.1f MB state\n", m_frame, m_ooc_blocks, num_max, m_ooc_file[0].size / 1048576.0 );
+
+	TracePop ();
+
+	m_time += m_Params.DT;
+	m_frame++;
+
+	runcount += 1;
+	#endif
+}
+
+
 void Flock2::DrawAccelGrid ()
 {
 	Vec3F r,a,b;
 	float v;
 
 	uint* gc = (uint*) m_Grid.bufUI(AGRIDCNT);
+	CellStat* cs = (CellStat*) m_Grid.bufUI(ACELLSTAT);
+
+	// neighbor search cost, normalized by the most expensive cell
+	float vmax = 1.0;
+	if ( m_draw_grid == 2 ) {
+		if (m_gpu) {
+			#ifdef BUILD_CUDA
+				m_Grid.Retrieve ( ACELLSTAT );
+				cuCtxSynchronize();
+			#endif
+		}
+		for (int n=0; n < m_Accel.gridTotal; n++)
+			vmax = fmax( vmax, float(cs[n].cand) );
+	}
 
 	for (r.y=0; r.y < m_Accel.gridRes.y; r.y++) {
 		for (r.z=0; r.z < m_Accel.gridRes.z; r.z++) {
@@ -2810,15 +7121,200 @@ void Flock2::DrawAccelGrid ()
 				a = m_Accel.gridMin + r / m_Accel.gridDelta;
 				b = a + (Vec3F(0.99f,0.99f,0.99f) / m_Accel.gridDelta );
 
-				v = fmin(1.0, float(*gc)/10.0f);
+				if ( m_draw_grid == 2 ) {
+					v = float(cs->cand) / vmax;
+				} else {
+					v = fmin(1.0, float(*gc)/10.0f);
+				}
 
 				drawBox3D ( a, b, Vec4F(v, 1-v, 1-v, 0.02 + v) );
 
 				gc++;
+				cs++;
+			}
+		}
+	}
+
+}
+
+void Flock2::ResetCellStats ()
+{
+	memset ( m_Grid.bufUI(ACELLSTAT), 0, m_Accel.gridTotal*sizeof(CellStat) );
+
+	if (m_gpu) {
+		#ifdef BUILD_CUDA
+			cuCheck ( cuMemsetD8 ( m_Grid.gpu(ACELLSTAT), 0, m_Accel.gridTotal*sizeof(CellStat) ), (char*)"ResetCellStats", (char*)"cuMemsetD8", (char*)"ACELLSTAT", DEBUG_CUDA );
+		#endif
+	}
+	m_cell_stats_start = m_frame;
+}
+
+void Flock2::OutputCellStats ( std::string fname )
+{
+	// write neighbor search cost per occupied cell, as CSV
+	// accumulated since the last reset (ResetCellStats).
+	// cell center is in world coordinates.
+	//
+	if (m_gpu) {
+		#ifdef BUILD_CUDA
+			m_Grid.Retrieve ( ACELLSTAT );
+			m_Grid.Retrieve ( AGRIDCNT );
+			cuCtxSynchronize();
+		#endif
+	}
+	FILE* fp = fopen ( fname.c_str(), "wt" );
+	if ( fp == 0 ) {
+		dbgprintf ( "ERROR: Unable to write %s\n", fname.c_str() );
+		return;
+	}
+	CellStat* cs = (CellStat*) m_Grid.bufUI(ACELLSTAT);
+	uint* gcnt = m_Grid.bufUI(AGRIDCNT);
+	xlong cand = 0, fov = 0, ins = 0;
+	int steps = m_frame - m_cell_stats_start;
+	Vec3F ctr;
+	Vec3I r;
+	int n;
+
+	fprintf ( fp, "cell, x, y, z, birds, candidates, fov_rejects, inserts\n" );
+	for (r.y=0; r.y < m_Accel.gridRes.y; r.y++) {
+		for (r.z=0; r.z < m_Accel.gridRes.z; r.z++) {
+			for (r.x=0; r.x < m_Accel.gridRes.x; r.x++) {
+				n = (r.y * m_Accel.gridRes.z + r.z) * m_Accel.gridRes.x + r.x;
+				if ( cs[n].cand == 0 ) continue;
+				ctr = m_Accel.gridMin + (Vec3F(r) + Vec3F(0.5f,0.5f,0.5f)) / m_Accel.gridDelta;
+				fprintf ( fp, "%d, %4.1f, %4.1f, %4.1f, %d, %u, %u, %u\n", n, ctr.x, ctr.y, ctr.z, gcnt[n], cs[n].cand, cs[n].fov_reject, cs[n].insert );
+				cand += cs[n].cand;
+				fov += cs[n].fov_reject;
+				ins += cs[n].insert;
+			}
+		}
+	}
+	fclose ( fp );
+
+	printf ( "Cell stats: %d steps, %lld candidates, %lld fov rejects, %lld inserts. Wrote %s\n", steps, cand, fov, ins, fname.c_str() );
+}
+
+// Benchmark neighbor backends (CPU)
+// places the birds in synthetic distributions inside the current flock bounds, then times
+// grid, k-d tree and hierarchical grid (build + query) on each and checks all find the same neighbors.
+// bird positions are restored after. writes bench_nbrs.csv
+//
+void Flock2::BenchmarkNeighbors ()
+{
+	int numPoints = m_Params.num_birds;
+	int numLive = numPoints - m_pop_dead;
+	if ( numLive <= 0 ) return;
+
+	const char* dname[4] = { "uniform", "core", "multicore", "stragglers" };
+	std::vector<Vec3F> pos_save ( numPoints );
+	std::vector<int> knn ( numPoints*NBR_MAX );
+	Vec3F bmin, bmax, ctr[4], p;
+	Mersenne rnd;
+	nbr_query_t q;
+	Bird* b;
+
+	// save state. queries run on cpu, without cluster neighbors
+	int gpu = m_gpu;
+	m_gpu = 0;
+	rnd.seed ( m_seed );
+
+	// bounds of live birds. dead slots are not in the grid or tree, and are left in place
+	int first = 0;
+	while ( !m_pop_alive[first] ) first++;
+	bmin = bmax = ((Bird*) m_Birds.GetElem( FBIRD, first ))->pos;
+	for (int i=0; i < numPoints; i++) {
+		if ( !m_pop_alive[i] ) continue;
+		b = (Bird*) m_Birds.GetElem( FBIRD, i );
+		pos_save[i] = b->pos;
+		bmin.x = std::min(bmin.x, b->pos.x);	bmax.x = std::max(bmax.x, b->pos.x);
+		bmin.y = std::min(bmin.y, b->pos.y);	bmax.y = std::max(bmax.y, b->pos.y);
+		bmin.z = std::min(bmin.z, b->pos.z);	bmax.z = std::max(bmax.z, b->pos.z);
+	}
+	Vec3F ext = bmax - bmin;
+	for (int c=0; c < 4; c++)
+		ctr[c] = bmin + Vec3F( rnd.randF(0.2f, 0.8f)*ext.x, rnd.randF(0.2f, 0.8f)*ext.y, rnd.randF(0.2f, 0.8f)*ext.z );
+
+	FILE* fp = fopen ( "bench_nbrs.csv", "wt" );
+	if ( fp ) fprintf ( fp, "dist, birds, grid_build_ms, grid_query_ms, grid_cand, kd_build_ms, kd_query_ms, kd_cand, hgrid_build_ms, hgrid_query_ms, hgrid_cand, mismatch\n" );
+
+	for (int dist=0; dist < 4; dist++) {
+
+		// place birds. gaussian-like cores are a sum of uniforms
+		for (int i=0; i < numPoints; i++) {
+			if ( !m_pop_alive[i] ) continue;
+			b = (Bird*) m_Birds.GetElem( FBIRD, i );
+			p = rnd.randV3(-0.5f, 0.5f) + rnd.randV3(-0.5f, 0.5f) + rnd.randV3(-0.5f, 0.5f);
+			switch ( dist ) {
+			case 0:	p = bmin + Vec3F( rnd.randF()*ext.x, rnd.randF()*ext.y, rnd.randF()*ext.z );	break;
+			case 1:	p = ctr[0] + p * ext * 0.1f;	break;
+			case 2:	p = ctr[ i % 4 ] + p * ext * 0.05f;	break;
+			case 3:	p = (i % 10 == 0) ? bmin + Vec3F( rnd.randF()*ext.x, rnd.randF()*ext.y, rnd.randF()*ext.z ) : ctr[0] + p * ext * 0.05f;	break;
+			}
+			b->pos = p;
+		}
+
+		// grid
+		xlong t0 = TraceNSec ();
+		InsertIntoGrid ();
+		PrefixSumGrid ();
+		xlong t1 = TraceNSec ();
+		xlong gcand = 0;
+		for (int i=0; i < numPoints; i++) {
+			if ( !m_pop_alive[i] ) continue;
+			FindNeighborsBird ( i, q, false, false );
+			gcand += q.ncand;
+			for (int k=0; k < NBR_MAX; k++)
+				knn[ i*NBR_MAX + k ] = (k < q.sort_num) ? q.sort_j[k] : -1;
+			std::sort ( &knn[i*NBR_MAX], &knn[i*NBR_MAX] + q.sort_num );
+		}
+		xlong t2 = TraceNSec ();
+
+		// k-d tree
+		KdBuild ();
+		xlong t3 = TraceNSec ();
+		xlong kcand = 0;
+		int mismatch = 0;
+		for (int i=0; i < numPoints; i++) {
+			if ( !m_pop_alive[i] ) continue;
+			FindNeighborsKd ( i, q, false );
+			kcand += q.ncand;
+			std::sort ( q.sort_j, q.sort_j + q.sort_num );
+			for (int k=0; k < NBR_MAX; k++) {
+				if ( knn[ i*NBR_MAX + k ] != ((k < q.sort_num) ? q.sort_j[k] : -1) ) { mismatch++; break; }
+			}
+		}
+		xlong t4 = TraceNSec ();
+
+		// hierarchical grid, over the accel grid built above
+		HGridBuild ();
+		xlong t5 = TraceNSec ();
+		xlong hcand = 0;
+		for (int i=0; i < numPoints; i++) {
+			if ( !m_pop_alive[i] ) continue;
+			FindNeighborsHGrid ( i, q, false );
+			hcand += q.ncand;
+			std::sort ( q.sort_j, q.sort_j + q.sort_num );
+			for (int k=0; k < NBR_MAX; k++) {
+				if ( knn[ i*NBR_MAX + k ] != ((k < q.sort_num) ? q.sort_j[k] : -1) ) { mismatch++; break; }
 			}
 		}
+		xlong t6 = TraceNSec ();
+
+		printf ( "Benchmark: %-10s %d birds. grid %6.2f + %7.2f ms, %lld cand. kd-tree %6.2f + %7.2f ms, %lld cand. hgrid %6.2f + %7.2f ms, %lld cand. mismatch %d\n",
+			dname[dist], numLive, (t1-t0)*1e-6, (t2-t1)*1e-6, gcand, (t3-t2)*1e-6, (t4-t3)*1e-6, kcand, (t5-t4)*1e-6, (t6-t5)*1e-6, hcand, mismatch );
+		if ( fp ) fprintf ( fp, "%s, %d, %f, %f, %lld, %f, %f, %lld, %f, %f, %lld, %d\n",
+			dname[dist], numLive, (t1-t0)*1e-6, (t2-t1)*1e-6, gcand, (t3-t2)*1e-6, (t4-t3)*1e-6, kcand, (t5-t4)*1e-6, (t6-t5)*1e-6, hcand, mismatch );
 	}
+	if ( fp ) fclose ( fp );
 
+	// restore state
+	for (int i=0; i < numPoints; i++)
+		if ( m_pop_alive[i] ) ((Bird*) m_Birds.GetElem( FBIRD, i ))->pos = pos_save[i];
+	InsertIntoGrid ();
+	PrefixSumGrid ();
+	if ( m_nbr_backend == NBR_KDTREE ) KdBuild ();
+	if ( m_nbr_backend == NBR_HGRID ) HGridBuild ();
+	m_gpu = gpu;
 }
 
 void Flock2::CameraToBird ( int n )
@@ -2865,7 +7361,7 @@ bool Flock2::init ()
 	m_running = true;
 	m_cockpit_view = false;
 	m_draw_mesh = 0;
-	m_draw_grid = false;
+	m_draw_grid = 0;
 	m_draw_origin = false;
 	m_draw_help = false;
 	m_draw_clusters = true;
@@ -2924,6 +7420,12 @@ bool Flock2::init ()
 	m_cam->setNearFar ( 1.0, 100000 );
 	m_cam->SetOrbit ( Vec3F(-30,30,0), Vec3F(0,50,0), 300, 1 );
 
+	// Trajectory reader. print a region, then exit
+	if ( !m_traj_read.empty() ) {
+		TrajectoryRead ();
+		exit ( 0 );
+	}
+
 	// Initialize experimental setup
 	//
 	m_run = -1;																				// setup run
@@ -2945,9 +7447,18 @@ bool Flock2::init ()
 	m_val.z = float(m_val.y-m_val.x) / m_num_run;
 	m_runs_outfile = fopen ( "output.csv", "wt" );
 	fprintf ( m_runs_outfile, "run, num_run, val, #bird, #peaks, peak_ave, peak_max, g0_min,g0_max, g1_min,g1_max, g2_min,g2_max, g3_min,g3_max\n" );
+	m_flocks_outfile = fopen ( "output_flocks.csv", "wt" );
+	fprintf ( m_flocks_outfile, "run, val, flock, #bird, #peaks, peak_ave, peak_max, g0_ave, g1_ave, g2_ave, g3_ave\n" );
 
 	StartNextRun ();				// this will call Reset
 
+	// Sweep worker. run queued jobs, then exit
+	if ( !m_queue_dir.empty() ) {
+		RunQueue ();
+		shutdown ();
+		exit ( 0 );
+	}
+
 	// Load 3D mesh
 	// LoadMesh (0, "starling_low_poly.obj", 5.0 );
 	// LoadMesh (1, "putto.obj", 2.0);
@@ -3105,8 +7616,9 @@ void Flock2::RenderBirdsWithMesh (int i)
 
 	// Render birds
 	Bird* b;
-	for (int n = 0; n < m_Birds.GetNumElem(FBIRD); n++) {
+	for (int n = 0; n < m_Params.num_birds; n++) {
 
+		if ( !m_pop_alive[n] ) continue;
 		b = (Bird*) m_Birds.GetElem(FBIRD, n);
 
 		model.Identity();
@@ -3164,7 +7676,9 @@ void Flock2::RenderBirdsWithDart ()
 	Bird* b;
 	float bird_size = 0.10f; //0.05f;
 
-	for (int n = 0; n < m_Birds.GetNumElem(FBIRD); n++) {
+	for (int n = 0; n < m_Params.num_birds; n++) {
+
+		if ( !m_pop_alive[n] ) continue;
 
 		// bird color
 		b = (Bird*)m_Birds.GetElem(FBIRD, n);
@@ -3248,29 +7762,34 @@ void Flock2::drawBackground ()
 	if (m_draw_help) {
 		char msg[1024];
 		Vec4F tc (1,1,1,1);
-		drawText ( Vec2F(10, h - 500), "Help", tc );
-		drawText ( Vec2F(10, h - 500 +  20), "ESC: quit", tc );
-		drawText ( Vec2F(10, h - 500 +  40), "Space: pause/resume", tc );
-		drawText ( Vec2F(10, h - 500 +  60), "o: draw origin", tc );
-		drawText ( Vec2F(10, h - 500 +  80), "a: m_analysis", tc );
-		drawText ( Vec2F(10, h - 500 + 100), "m: m_method", tc );
-		drawText ( Vec2F(10, h - 500 + 120), "v: toggle visualization mode", tc );
-		drawText ( Vec2F(10, h - 500 + 140), "s: m_draw_mesh", tc );
-		drawText ( Vec2F(10, h - 500 + 160), "g: m_draw_grid", tc );
-		drawText ( Vec2F(10, h - 500 + 180), "o: m_draw_origin", tc );
-		drawText ( Vec2F(10, h - 500 + 200), "h: m_draw_help", tc );
-		drawText ( Vec2F(10, h - 500 + 220), "i: m_draw_clusters", tc );
-		drawText ( Vec2F(10, h - 500 + 240), "p: m_draw_plot", tc );
-		drawText ( Vec2F(10, h - 500 + 260), "w: calculate clusters on/off", tc );
-		drawText ( Vec2F(10, h - 500 + 280), "e: enable/disable predator", tc );
-		drawText ( Vec2F(10, h - 500 + 300), "c: m_cockpit_view", tc );
-		drawText ( Vec2F(10, h - 500 + 320), "r: Reset", tc );
-		drawText ( Vec2F(10, h - 500 + 340), "z: m_bird_sel--", tc );
-		drawText ( Vec2F(10, h - 500 + 360), "x: m_bird_sel++", tc );
-		drawText ( Vec2F(10, h - 500 + 380), "n: no m_bird_sel", tc );
-		drawText ( Vec2F(10, h - 500 + 400), "j: m_cluster_sel--", tc );
-		drawText ( Vec2F(10, h - 500 + 420), "k: m_cluster_sel++", tc );
-		drawText ( Vec2F(10, h - 500 + 440), "l: no m_cluster_sel", tc );
+		drawText ( Vec2F(10, h - 640), "Help", tc );
+		drawText ( Vec2F(10, h - 640 +  20), "ESC: quit", tc );
+		drawText ( Vec2F(10, h - 640 +  40), "Space: pause/resume", tc );
+		drawText ( Vec2F(10, h - 640 +  60), "o: draw origin", tc );
+		drawText ( Vec2F(10, h - 640 +  80), "a: m_analysis", tc );
+		drawText ( Vec2F(10, h - 640 + 100), "m: m_method", tc );
+		drawText ( Vec2F(10, h - 640 + 120), "v: toggle visualization mode", tc );
+		drawText ( Vec2F(10, h - 640 + 140), "s: m_draw_mesh", tc );
+		drawText ( Vec2F(10, h - 640 + 160), "g: m_draw_grid (off, counts, search cost)", tc );
+		drawText ( Vec2F(10, h - 640 + 180), "o: m_draw_origin", tc );
+		drawText ( Vec2F(10, h - 640 + 200), "h: m_draw_help", tc );
+		drawText ( Vec2F(10, h - 640 + 220), "i: m_draw_clusters", tc );
+		drawText ( Vec2F(10, h - 640 + 240), "p: m_draw_plot", tc );
+		drawText ( Vec2F(10, h - 640 + 260), "w: calculate clusters on/off", tc );
+		drawText ( Vec2F(10, h - 640 + 280), "e: enable/disable predator", tc );
+		drawText ( Vec2F(10, h - 640 + 300), "c: m_cockpit_view", tc );
+		drawText ( Vec2F(10, h - 640 + 320), "r: Reset", tc );
+		drawText ( Vec2F(10, h - 640 + 340), "z: m_bird_sel--", tc );
+		drawText ( Vec2F(10, h - 640 + 360), "x: m_bird_sel++", tc );
+		drawText ( Vec2F(10, h - 640 + 380), "n: no m_bird_sel", tc );
+		drawText ( Vec2F(10, h - 640 + 400), "j: m_cluster_sel--", tc );
+		drawText ( Vec2F(10, h - 640 + 420), "k: m_cluster_sel++", tc );
+		drawText ( Vec2F(10, h - 640 + 440), "l: no m_cluster_sel", tc );
+		drawText ( Vec2F(10, h - 640 + 460), "t: trace start/stop (writes trace.json)", tc );
+		drawText ( Vec2F(10, h - 640 + 480), "f: export cell search cost (writes cellstats.csv)", tc );
+		drawText ( Vec2F(10, h - 640 + 500), "y: approximate neighbor search on/off (cpu)", tc );
+		drawText ( Vec2F(10, h - 640 + 520), "b: neighbor backend (grid, graph walk, k-d tree, hierarchical grid)", tc );
+		drawText ( Vec2F(10, h - 640 + 540), "d: benchmark neighbor backends (writes bench_nbrs.csv)", tc );
 	}
 }
 
@@ -3307,14 +7826,17 @@ void Flock2::display ()
 
 	//----------- 2D Background (sketch mode)
 	//
+	TracePush ( "Render:Background" );
 	start2D(w, h);					// this 2D draw goes behind (before) the 3D stuff
 		drawBackground ();
 	end2D();
+	TracePop ();
 
 	//----------- 3D Render (sketch mode)
 	//
 	if (m_draw_mesh==0) {
 
+		TracePush ( "Render:3D" );
 		start3D(m_cam);			// draws all 3D stuff
 
 			setLight3D ( Vec3F(0, 200, 0), Vec4F(1, 1, 1, 1) );
@@ -3368,7 +7890,7 @@ void Flock2::display ()
 				drawCircle3D(m_Flock.centroid, 0.5, Vec4F(Vec4F(0.8, 1.0, 0.0, 1)));
 				drawCircle3D(m_Flock.centroid, 1.5, Vec4F(Vec4F(0.8, 1.0, 0.0, 1)));
 
-				for (int i=0; i < MAX_FLOCKS; i++) {
+				for (int i=0; i < MAX_FLOCKS && i < (int) cluster_histogram.size(); i++) {
 	  			  	if(cluster_histogram.at(i).bird_cnt > m_Params.num_birds * m_Params.cluster_minsize_color) {
 						drawCircle3D(m_Flock.flock_centers[i], 0.5, Vec4F(Vec4F(1.0, 0.8, 0.0, 1)));
 						drawCircle3D(m_Flock.flock_centers[i], 1.5, Vec4F(Vec4F(1.0, 0.8, 0.0, 1)));
@@ -3398,6 +7920,7 @@ void Flock2::display ()
 				drawCircle3D (p->pos, p->pos + (p->vel * predator_size), 1.5, pclr);
 			}
 		end3D();
+		TracePop ();
 	}
 
 	//----------- 2D Overlay (sketch mode)
@@ -3405,6 +7928,7 @@ void Flock2::display ()
 	Vec4F tc (1,1,1,1);
 	float xscal, yscal;
 
+	TracePush ( "Render:Overlay" );
 	start2D ( w, h );			// this 2D draw is overlayed on top
 
 		clr = Vec4F(0,0,0,1);
@@ -3485,12 +8009,16 @@ void Flock2::display ()
 		setTextSz ( 24, 0 );						// set text height
 		drawText ( Vec2F(getWidth()-600, 10), msg, tc );	*/
 	end2D();
+	TracePop ();
 
 	// Render all items from sketch mode (actual OpenGL render)
+	TracePush ( "Render:drawAll" );
 	drawAll ();
+	TracePop ();
 
 	// Render birds as meshes (direct mode, OpenGL)
 	if (m_draw_mesh > 0) {
+		TracePush ( "Render:Mesh" );
 		selfStartDraw3D(m_cam);
 		selfSetLight3D(Vec3F(0, 100, 200), Vec4F(1.5, 1.5, .6, 1));
 		selfSetTexture();
@@ -3499,6 +8027,7 @@ void Flock2::display ()
 		RenderBirdsWithMesh ( m_draw_mesh-1 );
 
 		selfEndDraw3D();
+		TracePop ();
 	}
 
 	appPostRedisplay();		// Post redisplay since simulation is continuous
@@ -3596,13 +8125,53 @@ void Flock2::keyboard(int keycode, AppEnum action, int mods, int x, int y)
 	case 's':
 		if (++m_draw_mesh > 2 ) m_draw_mesh = 0;
 		break;
-	case 'g': m_draw_grid = !m_draw_grid; break;
+	case 'g':
+		if (++m_draw_grid > 2) m_draw_grid = 0;
+		if (m_draw_grid == 2 && !m_Params.cell_stats) {
+			// start collecting neighbor search cost
+			#ifdef BUILD_CUDA
+				if (m_gpu && m_Grid.gpu(ACELLSTAT) == 0) {
+					dbgprintf ( "ERROR: Cell stats buffer not on GPU.\n" );
+					break;
+				}
+			#endif
+			m_Params.cell_stats = 1;
+			ResetCellStats ();
+			#ifdef BUILD_CUDA
+				if (m_gpu) cuCheck ( cuMemcpyHtoD ( m_cuParam, &m_Params, sizeof(Params) ),(char*)"Params", (char*)"cuMemcpyHtoD", (char*)"cuParam", DEBUG_CUDA );
+			#endif
+		}
+		break;
+	case 'f':
+		// export neighbor search cost and restart accumulation
+		OutputCellStats ( "cellstats.csv" );
+		ResetCellStats ();
+		break;
 	case 'o': m_draw_origin = !m_draw_origin; break;
 	case 'h': m_draw_help = !m_draw_help; break;
 	case 'i': m_draw_clusters = !m_draw_clusters; break;
 	case 'p': m_draw_plot = !m_draw_plot; break;
 	case 'w': m_calculate_clusters = !m_calculate_clusters; break;
+	case 'b':
+		// neighbor backend (cpu)
+		if ( ++m_nbr_backend > NBR_HGRID ) m_nbr_backend = NBR_GRID;
+		printf ( "Neighbors: backend %d\n", m_nbr_backend );
+		break;
+	case 'd':
+		BenchmarkNeighbors ();
+		break;
+	case 'y':
+		// approximate neighbor search (cpu)
+		m_nbr_approx = 1-m_nbr_approx;
+		printf ( "Neighbors: %s search\n", m_nbr_approx ? "approximate" : "exact" );
+		break;
 	case 'e': m_Params.num_predators = (m_Params.num_predators + 1 ) % 2 ; break;
+	case 't':
+		// toggle trace recording. stopping writes the trace file.
+		m_trace = 1-m_trace;
+		if (m_trace)	TraceStart ();
+		else			OutputTrace ( "trace.json" );
+		break;
 
 	case 'c':
 		m_cockpit_view = !m_cockpit_view;
@@ -3616,7 +8185,7 @@ void Flock2::keyboard(int keycode, AppEnum action, int mods, int x, int y)
 		break;
 	case 'x':
 		m_bird_sel++;
-		if (m_bird_sel > m_Birds.GetNumElem(FBIRD)) m_bird_sel = m_Birds.GetNumElem(FBIRD)-1;
+		if (m_bird_sel >= m_Params.num_birds) m_bird_sel = m_Params.num_birds-1;
 		break;
 	case 'n':
 		m_bird_sel = -1;
@@ -3657,7 +8226,99 @@ void Flock2::startup ()
 	m_analysis = 0;			// 0 = off, 1 = analyze freq & energy
 	m_visualize = VISUALIZE_CLUSTERS;		// for possible values see flock_types.h, VISUALIZE_* defines
 	m_viewgrid = 0;
+	m_trace = 0;
+	m_trace_head = 0;
+	m_trace_threads = 0;
 	m_seed = 12;
+	m_threads = std::max( 1, (int) std::thread::hardware_concurrency() );
+	m_autotune = 0;
+	m_autotune_frames = 8;
+	m_autotune_tol = 0.001;
+	m_autotune_ctol = 0.05;
+	m_autotuning = false;
+	m_grid_track = 0;
+	m_grid_margin = 0.25;
+	m_grid_shrink = 4.0;
+	m_nbr_backend = NBR_GRID;
+	m_kd_num = 0;
+	m_hgrid_occ = 32;
+	m_hgrid_sub = 2;
+	m_hgrid_levels = 3;
+	m_hg_res = 4;	m_hg_levels = 1;
+	m_nbr_islands = 0;
+	m_queue_lease = 60;
+	m_queue_poll = 2;
+	m_queue_beat = 0;
+	m_health = 1;
+	m_health_speed = 4.0;
+	m_health_log = 100;
+	m_health_frame = -1000000;
+	memset ( m_health_cnt, 0, sizeof(m_health_cnt) );
+	memset ( m_health_sum, 0, sizeof(m_health_sum) );
+	m_delay = 0;
+	m_delay_depth = 0;
+	m_delay_frames = 0;
+	m_delay_read = -1;
+	m_pop_max = 0;
+	m_pop_spawn = 0;
+	m_pop_catch = 0;
+	m_pop_compact = 64;
+	m_pop_cap = 0;
+	m_pop_dead = 0;
+	m_pop_caught = 0;
+	m_pop_acc = 0;
+	m_energy_out = 0;
+	m_energy_outfile = 0;
+	m_cluster_mode = 0;
+	m_cl_cells = 0;
+	m_cl_refine = 0;
+	m_aniso = 0;
+	m_aniso_k = 1;
+	m_aniso_bins = 36;
+	m_aniso_gamma = 0;
+	m_aniso_outfile = 0;
+	m_dendro = 0;
+	m_dendro_rmax = 0;
+	m_dendro_steps = 32;
+	m_dendro_frame = -1;
+	m_dendro_outfile = 0;
+	m_gr = 0;
+	m_gr_bins = 64;
+	m_gr_rmax = 0;
+	m_gr_outfile = 0;
+	m_traj = 0;
+	m_traj_outfile = 0;
+	m_lag = 0;
+	m_lag_max = 6;
+	m_lag_window = 8;
+	m_lag_corr_min = 0.5;
+	m_lag_frames = 0;
+	m_lag_mean = 0;
+	m_lag_speed = 0;
+	m_lag_outfile = 0;
+	m_flocks_outfile = 0;
+	m_nbr_island_chunk = 512;
+	m_islands_cnt = 0;
+	m_ooc = 0;
+	m_ooc_block_mb = 1024;
+	m_ooc_path = "flock_state.bin";
+	m_ooc_cur = 0;
+	m_ooc_num = 0;
+	m_ooc_rec = 0;
+	m_ooc_rows = 0;
+	m_ooc_blocks = 0;
+	m_nbr_backstop = 10;
+	m_nbr_backstop_frame = 0;
+	m_nbr_nearest = 1;
+	m_nbr_temporal = 0;
+	m_nbr_margin = 1.0;
+	m_nbr_refresh = 8;
+	m_nbr_approx = 0;
+	m_nbr_cand_max = 32;
+	m_nbr_stop_cnt = 0;
+	m_nbr_stop_dist = 2.0;
+	m_nbr_recall_freq = 100;
+	m_nbr_recall = 1;
 
 	// Default params
 	SetupParams();
@@ -3671,6 +8332,34 @@ void Flock2::startup ()
 
 void Flock2::shutdown()
 {
+	m_pool.Stop ();
+	if (m_trace) {
+		OutputTrace ( "trace.json" );
+	}
+	if (m_lag_outfile) {
+		fclose ( m_lag_outfile );
+	}
+	if (m_energy_outfile) {
+		fclose ( m_energy_outfile );
+	}
+	if (m_gr_outfile) {
+		fclose ( m_gr_outfile );
+	}
+	if (m_traj_outfile) {
+		fclose ( m_traj_outfile );
+	}
+	if (m_dendro_outfile) {
+		fclose ( m_dendro_outfile );
+	}
+	if (m_aniso_outfile) {
+		fclose ( m_aniso_outfile );
+	}
+	if (m_flocks_outfile) {
+		fclose ( m_flocks_outfile );
+	}
+	OOCUnmap ( m_ooc_file[0] );
+	OOCUnmap ( m_ooc_file[1] );
+
   #ifdef USE_FFTW
 	// destroy FFTW buffers
 	fftw_destroy_plan( m_fftw_plan);
@@ -108,6 +108,22 @@ extern "C" __global__ void countingSortFull ( int pnum )
 
 
 
+// Cell vs. view cone (fov culling), see BoxOutsideCone in app_flock.cpp
+// box relative to the bird, already known to be behind it.
+#define CONE_EPS	1e-4f
+#define CELL_EPS	1e-3f		// cell box padding (m), covers rounding in grid insert
+
+inline __device__ bool boxOutsideCone ( float3 bmin, float3 bmax, float3 dir, float fovcos )
+{
+	if ( fovcos > 0 ) return true;
+	float3 v;
+	for (int n=0; n < 8; n++) {
+		v = make_float3( (n & 1) ? bmax.x : bmin.x, (n & 2) ? bmax.y : bmin.y, (n & 4) ? bmax.z : bmin.z );
+		if ( dot(v, dir) >= (fovcos - CONE_EPS) * length(v) ) return false;
+	}
+	return true;
+}
+
 extern "C" __global__ void findNeighborsTopological ( int pnum)
 {
 	uint i = __mul24(blockIdx.x, blockDim.x) + threadIdx.x;	// particle index
@@ -116,6 +132,7 @@ extern "C" __global__ void findNeighborsTopological ( int pnum)
 	// Get search cell
 	uint gc = FBirds.bufUI(FGCELL)[ i ];
 	if ( gc == GRID_UNDEF ) return;						// particle out-of-range
+	uint home = gc;
 	gc -= (1*FAccel.gridRes.z + 1)*FAccel.gridRes.x + 1;
 
 	register int cell, c, j, cndx;
@@ -128,6 +145,7 @@ extern "C" __global__ void findNeighborsTopological ( int pnum)
 	const float rc = FParams.cluster_threshold_dist * FParams.cluster_threshold_dist;
 	float birdang;
 	int k, m;
+	uint ncand = 0, nfov = 0, nins = 0;				// search cost
 
 	// topological distance
 	float sort_d_nbr[16];
@@ -151,15 +169,48 @@ extern "C" __global__ void findNeighborsTopological ( int pnum)
 
 	nearest = rd2;
 
+	// fov cone culling. home cell min & cell width, relative to bird
+	float3 cw, hmin, bmin, bmax, bd;
+	const float3* cone = 0;
+	const float3* cmin = FAccel.gridCone[7];		// octant (-x,-y,-z) holds the min corner of each adjacent cell
+	if ( FParams.nbr_cull && FParams.fovcos > -1 ) {
+		cw = make_float3( 1.0f / FAccel.gridDelta.x, 1.0f / FAccel.gridDelta.y, 1.0f / FAccel.gridDelta.z );
+		hmin = make_float3( home % FAccel.gridRes.x, home / (FAccel.gridRes.x*FAccel.gridRes.z), (home / FAccel.gridRes.x) % FAccel.gridRes.z );
+		hmin = FAccel.gridMin + hmin * cw - bi->pos;
+		cone = FAccel.gridCone[ (diri.x < 0 ? 1 : 0) | (diri.y < 0 ? 2 : 0) | (diri.z < 0 ? 4 : 0) ];
+	}
+
 	// check 3x3 grid cells
 	for ( c=0; c < FAccel.gridAdjCnt; c++) {
 		cell = gc + FAccel.gridAdj[c];
+		if ( FGrid.bufI(AGRIDCNT)[cell] == 0 ) continue;
+
+		// skip cells outside the field-of-view, keeping cluster neighbors
+		if ( cone && dot( hmin + cone[c] * cw, diri ) < 0 ) {
+			bmin = hmin + cmin[c] * cw - CELL_EPS;
+			bmax = bmin + cw + 2*CELL_EPS;
+			if ( boxOutsideCone ( bmin, bmax, diri, FParams.fovcos ) ) {
+				bd = make_float3( fmaxf(bmin.x, fmaxf(0.f, -bmax.x)), fmaxf(bmin.y, fmaxf(0.f, -bmax.y)), fmaxf(bmin.z, fmaxf(0.f, -bmax.z)) );
+				if ( dot(bd, bd) >= rc ) continue;
+				for ( cndx = FGrid.bufI(AGRIDOFF)[cell]; cndx < FGrid.bufI(AGRIDOFF)[cell] + FGrid.bufI(AGRIDCNT)[cell]; cndx++ ) {
+					j = FGrid.bufI(AGRID)[ cndx ];
+					dist = ( ((Bird*) FBirds.data(FBIRD))[j].pos - bi->pos );
+					if ( dot(dist, dist) < rc && bi->cluster_nbr_cnt < CLUSTER_NBRS_MAX_ARRAY ) {
+						bi->cluster_nbrs[bi->cluster_nbr_cnt] = j;
+						bi->cluster_nbr_cnt++;
+					}
+				}
+				continue;
+			}
+		}
+
 		// check each entry in grid..
 		for ( cndx = FGrid.bufI(AGRIDOFF)[cell]; cndx < FGrid.bufI(AGRIDOFF)[cell] + FGrid.bufI(AGRIDCNT)[cell]; cndx++ ) {
 			j = FGrid.bufI(AGRID)[ cndx ];
 			if (i==j) continue;
 
 			bj = ((Bird*) FBirds.data(FBIRD)) + j;
+			ncand++;
 
 			// check for neighbor
 			dist = ( bj->pos - bi->pos );
@@ -197,6 +248,7 @@ extern "C" __global__ void findNeighborsTopological ( int pnum)
 
 						sort_d_nbr[k] = dsq;
 						sort_j_nbr[k] = j;
+						if ( k < FParams.neighbors ) nins++;
 
 						// max topological neighbors
 						if (++sort_num > FParams.neighbors ) sort_num = FParams.neighbors;
@@ -205,11 +257,21 @@ extern "C" __global__ void findNeighborsTopological ( int pnum)
 					// count boundary neighbors
 					bi->r_nbrs++;
 
+				} else {
+					nfov++;
 				}
 			}
 		}
 	}
 
+	// accumulate search cost into home cell
+	if ( FParams.cell_stats ) {
+		CellStat* cs = ((CellStat*) FGrid.data(ACELLSTAT)) + home;
+		atomicAdd ( &cs->cand, ncand );
+		atomicAdd ( &cs->fov_reject, nfov );
+		atomicAdd ( &cs->insert, nins );
+	}
+
 	// compute nearest and average among N (~7) topological neighbors
 	for (k=0; k < sort_num; k++) {
 		bj = ((Bird*) FBirds.data(FBIRD)) + sort_j_nbr[k];
@@ -587,6 +649,7 @@ extern "C" __global__ void advanceOrientationHoetzlein ( float time, float dt, f
 	b->Pturn = Fresidual * length( delta_v - vdotv * vaxis );	 // energy for turning
 	// total energy/bird = lift + drag + fwd energy + turn energy
 	b->Ptotal = b->Plift + b->Pdrag + b->Pfwd + b->Pturn;
+	b->Ecum += b->Ptotal * dt;
 
 	//float cl = min( (b->Pfwd-0.0187) * 10000.0f, 1.0);
 	//float cl = min( b->Pturn * 1000.0f, 1.0);
@@ -709,6 +772,7 @@ extern "C" __global__ void advanceVectorsReynolds ( float time, float dt, float
 	b->Pturn = Fresidual * length( delta_v - vdotv * vaxis );	 // energy for turning
 	// total energy/bird = lift + drag + fwd energy + turn energy
 	b->Ptotal = b->Plift + b->Pdrag + b->Pfwd + b->Pturn;
+	b->Ecum += b->Ptotal * dt;
 
 	// [stats only] visualize turn energy
 	// float cl = min( b->Pturn * 100.0f, 1.0);
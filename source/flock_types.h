@@ -25,6 +25,7 @@
 	#define AAUXSCAN1		4
 	#define AAUXARRAY2		5
 	#define AAUXSCAN2		6
+	#define ACELLSTAT		7
 	#define AGRID_pred      9
 	#define AGRIDCNT_pred	10
 
@@ -88,6 +89,7 @@
 		int			id, near_j, t_nbrs, r_nbrs;
 		float		speed, pitch_adv, power;
 		float		Plift, Pdrag, Pfwd, Pturn, Ptotal;
+		float		Ecum;						// energy used since added (joules)
 
 		int			cluster_id;
 		uint		cluster_nbrs[CLUSTER_NBRS_MAX_ARRAY];
@@ -101,9 +103,11 @@
 		f3			centroid;
 		float		speed;
 		float		Plift, Pdrag, Pfwd, Pturn, Ptotal;
+		float		Ecum;						// ave energy used per bird
 
 		int			num_flocks;
 		f3			flock_centers[ MAX_FLOCKS ];
+		float		flock_power[ MAX_FLOCKS ];	// ave power per bird of largest clusters
 	};
 
 	enum predState {
@@ -138,6 +142,7 @@
 		i3			gridRes, gridScanMax;
 		int			gridSrch, gridTotal, gridAdjCnt, gridActive;
 		int			gridAdj[64];
+		f3			gridCone[8][64];		// fov cone culling: forward-most corner of each adjacent cell, per heading octant
 
 		// gpu
 		int			numThreads, numBlocks;
@@ -145,6 +150,14 @@
 		int			szPnts;
 	};
 
+	// neighbor search cost, per grid cell
+	// accumulated over the birds whose home cell it is
+	struct CellStat {
+		uint		cand;			// candidates tested
+		uint		fov_reject;		// candidates within radius, rejected by field-of-view
+		uint		insert;			// insertions into topological list
+	};
+
 	struct ALIGN(32) Params {
 
 		int			steps;
@@ -199,6 +212,9 @@
 		float		reynolds_avoidance;
 		float		reynolds_cohesion;
 		float		reynolds_alignment;
+
+		int			cell_stats;			// accumulate neighbor search cost per cell (CellStat)
+		int			nbr_cull;			// skip adjacent cells entirely outside the field-of-view
 	};
 
 	struct ALIGN(16) Histogram {